@@ -48,6 +48,7 @@ struct mod_ls {
 static void init_cfg(void);
 static void add_mod(const char *mod);
 static struct mod *find_mod(const char *mod);
+static struct mod *find_mod_in(struct mod_ls *ls, const char *mod);
 static void add_setting(const char *mod, const char *key, const char *value);
 static struct setting *find_setting(const char *mod, const char *key);
 static FILE *get_cfg_file(void);
@@ -98,9 +99,19 @@ static void add_mod(const char *mod)
 static struct mod *find_mod(const char *mod)
 {
         extern struct mod_ls *cfg;
+
+        return find_mod_in(cfg, mod);
+}
+
+/** 
+ * @brief Search for and return a mod from any configuration list.
+ *        Return NULL if it isn't found.
+ */
+static struct mod *find_mod_in(struct mod_ls *ls, const char *mod)
+{
         struct mod *cur;
 
-        for (cur = cfg->first; cur != NULL; cur = cur->next)
+        for (cur = ls->first; cur != NULL; cur = cur->next)
                 if (!strcasecmp(cur->mod, mod))
                         return cur;
 
@@ -339,17 +350,85 @@ static FILE *get_cfg_file(void)
 void clear_cfg(void)
 {
         extern struct mod_ls *cfg;
+
+        cfg_stash_free(cfg);
+        cfg = NULL;
+}
+
+/** 
+ * @brief Take the current configuration list out of service, so a fresh
+ *        one can be parsed and compared against it.
+ *
+ * @return The old list, give it to cfg_stash_free() when you're done
+ */
+struct mod_ls *cfg_stash(void)
+{
+        extern struct mod_ls *cfg;
+        struct mod_ls *old = cfg;
+
+        cfg = NULL;
+
+        return old;
+}
+
+/** 
+ * @brief Free a configuration list taken with cfg_stash().
+ */
+void cfg_stash_free(struct mod_ls *ls)
+{
         struct mod *cur;
         struct mod *next;
 
-        for (cur = cfg->first; cur != NULL; cur = next) {
+        if (ls == NULL)
+                return;
+
+        for (cur = ls->first; cur != NULL; cur = next) {
                 next = cur->next;
                 free(cur->mod);
                 clear_settings(cur->setting_ls);
                 free(cur);
         }
 
-        freenull(cfg);
+        free(ls);
+}
+
+/** 
+ * @brief See if a mod's settings are any different in the current
+ *        configuration than in an old one.
+ *
+ * @return 1 if something was added, removed or changed, 0 if not
+ */
+int cfg_mod_changed(struct mod_ls *old, const char *mod)
+{
+        struct mod *ocur = find_mod_in(old, mod);
+        struct mod *ncur = find_mod(mod);
+        struct setting *scur;
+        struct setting *find;
+        int ocount = 0;
+        int ncount = 0;
+
+        if (ocur == NULL || ncur == NULL)
+                return ocur != ncur;
+
+        for (scur = ncur->setting_ls->first; scur != NULL; scur = scur->next)
+                ncount++;
+
+        for (scur = ocur->setting_ls->first; scur != NULL; scur = scur->next) {
+                ocount++;
+
+                find = find_setting(mod, scur->key);
+                if (find == NULL)
+                        return 1;
+
+                if (find->value == NULL || scur->value == NULL) {
+                        if (find->value != scur->value)
+                                return 1;
+                } else if (strcmp(find->value, scur->value)) {
+                        return 1;
+                }
+        }
+
+        return ocount != ncount;
 }
 
 /** 
@@ -13,8 +13,13 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+struct mod_ls;
+
 void parse_cfg(void);
 void clear_cfg(void);
+struct mod_ls *cfg_stash(void);
+void cfg_stash_free(struct mod_ls *ls);
+int cfg_mod_changed(struct mod_ls *old, const char *mod);
 
 /**
  * These functions are to be used by donky modules to look up user settings
@@ -10,192 +10,1586 @@
  * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
  */
 
+#include <errno.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <netinet/in.h>
-#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "../config.h"
 #include "cfg.h"
 #include "daemon.h"
+#include "default_settings.h"
+#include "event.h"
+#include "frame.h"
+#include "host.h"
 #include "main.h"
+#include "mcast.h"
+#include "metrics.h"
+#include "module.h"
 #include "net.h"
+#include "pool.h"
 #include "protocol.h"
+#include "relay.h"
 #include "request.h"
+#include "sampler.h"
+#include "shm.h"
 #include "util.h"
 
+/* How many ready descriptors we handle per wakeup. */
+#define DONKY_MAX_EVENTS 64
+
+/* Smallest chunk we hand to recv(). */
+#define DONKY_READ_CHUNK 1024
+
+/* Most queued messages we hand to a single writev(). */
+#define DONKY_MAX_IOV 64
+
+/* Slots in each reactor's timer wheel, one per second. */
+#define DONKY_WHEEL_SLOTS 256
+
+/* Most I/O threads we'll start, no matter what the config says. */
+#define DONKY_MAX_REACTORS 64
+
+/**
+ * One of these per I/O thread.  A reactor owns its own event loop, its own
+ * TCP listener and every connection accepted on it, so nobody else ever
+ * reads from or writes to those sockets.  Other threads that want to send
+ * something queue it on the connection and put the connection on the
+ * owner's dirty list.
+ */
+struct donky_reactor {
+        int num;
+        pthread_t thread;
+        int is_launched;        /* bool, has its own thread */
+        int stop;               /* bool, get out of the loop */
+        struct event_loop *events;
+
+        /* Connections, listeners included.  The owner is the only one that
+         * changes this list, but others walk it for stats. */
+        pthread_mutex_t conn_lock;
+        donky_conn *dc_start;
+        donky_conn *dc_end;
+
+        /* Connections with output waiting to be flushed. */
+        pthread_mutex_t dirty_lock;
+        donky_conn *dirty_start;
+        int wake_pending;       /* bool, woken when the tick ends */
+
+        /* Hashed timer wheel for auth and idle timeouts.  A connection
+         * sits in slot (expires % DONKY_WHEEL_SLOTS), so adding, moving and
+         * expiring one never needs a list scan. */
+        donky_conn *wheel[DONKY_WHEEL_SLOTS];
+        unsigned long wheel_tick;       /* Next second to look at. */
+        int wheel_count;
+};
+
 /* Globals. */
-static fd_set donky_fds;
-static int donky_sock = -1;
-static int donky_fdmax;
-donky_conn *dc_start = NULL;
-donky_conn *dc_end = NULL;
+static struct donky_reactor *reactors = NULL;
+static int reactor_count = 0;
+static int donky_unix_sock = -1;
+static char donky_unix_path[256];
+static unsigned int donky_send_queue = DEFAULT_SEND_QUEUE;
+static size_t donky_send_buffer = DEFAULT_SEND_BUFFER;
+static size_t donky_max_line = DEFAULT_MAX_LINE;
+static int donky_max_clients = DEFAULT_MAX_CLIENTS;
+static int donky_max_unauthed = DEFAULT_MAX_UNAUTHED;
+static int donky_auth_timeout = DEFAULT_AUTH_TIMEOUT;
+static int donky_idle_timeout = DEFAULT_IDLE_TIMEOUT;
+static pthread_mutex_t admit_lock = PTHREAD_MUTEX_INITIALIZER;
+static int donky_has_pass = 0; /* bool, [daemon] pass, under admit_lock */
+static int client_count = 0;
+static int unauthed_count = 0;
+static char donky_listen_spec[512];
+static donky_conn donky_signals; /* Stands in for the signal pipe. */
+static pthread_mutex_t tick_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t tick_thread;
+static int in_tick = 0; /* bool */
+
+/* Function prototypes. */
+static int donky_conn_read(donky_conn *cur);
+static int donky_conn_lines(donky_conn *cur);
+static int donky_conn_read_packet(donky_conn *cur);
+static void donky_conn_new(donky_conn *cur);
+static donky_conn *donky_conn_add(struct donky_reactor *r, int sock);
+static char *donky_conn_format(donky_conn *cur,
+                               size_t *len,
+                               const char *format,
+                               va_list ap);
+static char *donky_conn_text(donky_conn *cur,
+                             size_t *len,
+                             const char *format, ...);
+static int donky_conn_queue(donky_conn *cur,
+                            unsigned int id,
+                            int keyed,
+                            char *data,
+                            size_t n);
+static void donky_conn_batch(donky_conn *cur);
+static int donky_conn_flush(donky_conn *cur);
+static void donky_conn_unqueue(donky_conn *cur);
+static int donky_conn_flush_stream(donky_conn *cur);
+static int donky_conn_flush_packet(donky_conn *cur);
+static int donky_conn_deferred(void);
+static void donky_conn_flush_dirty(struct donky_reactor *r);
+static void donky_conn_free_queue(donky_conn *cur);
+static void donky_conn_clear(struct donky_reactor *r);
+static void *donky_reactor_run(void *arg);
+static int donky_reactors_start(void);
+static void donky_reactors_stop(void);
+static int donky_conn_admit(int *authed);
+static void donky_conn_release(int authed);
+static void donky_conn_expire(donky_conn *cur, unsigned long now);
+static void donky_timer_set(donky_conn *cur, unsigned long when);
+static void donky_timer_del(donky_conn *cur);
+static void donky_wheel_advance(struct donky_reactor *r);
+static unsigned long donky_now(void);
+static void donky_signal_drain(void);
+static void donky_settings(void);
+static void donky_listen_describe(char *buf, size_t size);
+static int donky_listen(void);
+static int donky_listener_add(struct donky_reactor *r, int sock, int is_packet);
+static void clean_dis_shiz(void);
+
+/**
+ * @brief Donky loop (tm)
+ */
+void donky_loop(void)
+{
+        int i;
+
+        donky_settings();
+
+        reactor_count = get_int_key("daemon", "io_threads",
+                                    DEFAULT_IO_THREADS);
+        if (reactor_count < 1)
+                reactor_count = 1;
+        if (reactor_count > DONKY_MAX_REACTORS)
+                reactor_count = DONKY_MAX_REACTORS;
+
+#ifndef SO_REUSEPORT
+        /* Without SO_REUSEPORT they can't each have a listener. */
+        if (reactor_count > 1) {
+                fprintf(stderr, "No SO_REUSEPORT here, using one I/O "
+                        "thread.\n");
+                reactor_count = 1;
+        }
+#endif
+
+        reactors = calloc(reactor_count, sizeof(struct donky_reactor));
+
+        for (i = 0; i < reactor_count; i++) {
+                reactors[i].num = i;
+                pthread_mutex_init(&reactors[i].conn_lock, NULL);
+                pthread_mutex_init(&reactors[i].dirty_lock, NULL);
+        }
+
+        /* Set up an event loop for each, epoll if we have it. */
+        for (i = 0; i < reactor_count; i++) {
+                if ((reactors[i].events = event_loop_new()) == NULL) {
+                        fprintf(stderr, "Couldn't set up the event loop!\n");
+                        clean_dis_shiz();
+                        donky_exit = 1;
+                        return;
+                }
+        }
+
+        /* The main thread runs the first reactor itself, and it's the one
+         * that hears about signals. */
+        reactors[0].thread = pthread_self();
+        if (donky_signal_fd != -1)
+                event_add(reactors[0].events, donky_signal_fd, EVENT_READ,
+                          &donky_signals);
+
+        /* Start listening, get out of here if we can't. */
+        if ((donky_listen() == -1)) {
+                fprintf(stderr, "I just can't listen! Ok! ;[\n");
+                clean_dis_shiz();
+                donky_exit = 1;
+                return;
+        }
+
+        /* Values go out through shared memory too, if anyone wants them.
+         * Not worth dying over if it doesn't work out. */
+        if (shm_open_table() == -1)
+                fprintf(stderr, "Couldn't set up shared memory, moving on.\n");
+
+        request_list_lock();
+        if (mcast_start() == -1)
+                fprintf(stderr, "Couldn't set up multicast, moving on.\n");
+        request_list_unlock();
+
+        /* Start the request handler and the other I/O threads. */
+        if (donky_reactors_start() == -1) {
+                fprintf(stderr, "Couldn't start the I/O threads!\n");
+                clean_dis_shiz();
+                donky_exit = 1;
+                return;
+        }
+
+        donky_reactor_run(&reactors[0]);
+
+        /* Run cleanup routine. */
+        clean_dis_shiz();
+}
+
+/**
+ * @brief Start the request handler and an I/O thread for every reactor but
+ *        the first.  Signals are blocked in all of them, so SIGHUP and
+ *        friends always interrupt the main thread.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int donky_reactors_start(void)
+{
+        sigset_t block;
+        sigset_t old;
+        int ret = 0;
+        int i;
+
+        sigemptyset(&block);
+        sigaddset(&block, SIGTERM);
+        sigaddset(&block, SIGHUP);
+        sigaddset(&block, SIGINT);
+        pthread_sigmask(SIG_BLOCK, &block, &old);
+
+        /* Workers first, the request handler hands them everything. */
+        if (pool_start(&request_handler_poke) == -1)
+                fprintf(stderr, "Couldn't start all the workers, moving "
+                        "on.\n");
+
+        request_handler_start();
+
+        if (relay_start() == -1)
+                fprintf(stderr, "Couldn't start the relay, moving on.\n");
+
+        if (metrics_start() == -1)
+                fprintf(stderr, "Couldn't start metrics, moving on.\n");
+
+        for (i = 1; i < reactor_count; i++) {
+                if (pthread_create(&reactors[i].thread, NULL,
+                                   &donky_reactor_run, &reactors[i]) != 0) {
+                        ret = -1;
+                        break;
+                }
+
+                reactors[i].is_launched = 1;
+        }
+
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        return ret;
+}
+
+/**
+ * @brief Tell the I/O threads to finish up and wait for them.
+ */
+static void donky_reactors_stop(void)
+{
+        int i;
+
+        for (i = 1; i < reactor_count; i++) {
+                if (!reactors[i].is_launched)
+                        continue;
+
+                reactors[i].stop = 1;
+                event_wake(reactors[i].events);
+                pthread_join(reactors[i].thread, NULL);
+                reactors[i].is_launched = 0;
+        }
+}
+
+/**
+ * @brief Event loop of a single reactor.  Runs until we're exiting or told
+ *        to stop.  The first one also takes care of reloads.
+ *
+ * @param arg Reactor
+ *
+ * @return NULL
+ */
+static void *donky_reactor_run(void *arg)
+{
+        struct donky_reactor *r = arg;
+        struct event_fired fired[DONKY_MAX_EVENTS];
+        donky_conn *cur;
+        int n;
+        int i;
+
+        r->wheel_tick = donky_now();
+
+        /* Infinite donky listener loop of death (tm) */
+        while (!donky_exit && !r->stop) {
+                /* SIGHUP, reload without dropping anybody.  The request
+                 * handler does it, so we're not held up. */
+                if (donky_reload && r->num == 0) {
+                        donky_reload = 0;
+                        request_handler_reload();
+                }
+
+                /* Wait until we have some crap to read, or the timer
+                 * wheel needs turning. */
+                n = event_wait(r->events, fired, DONKY_MAX_EVENTS,
+                               (r->wheel_count) ? 1000 : -1);
+
+                if (n == -1) {
+                        /* Signals land here, the loop condition decides. */
+                        if (errno == EINTR)
+                                continue;
+
+                        perror("event_wait");
+                        break;
+                }
+
+                /* Each event carries its own connection, no list walking. */
+                for (i = 0; i < n; i++) {
+                        cur = fired[i].data;
+
+                        /* A signal, the loop condition takes it from here. */
+                        if (cur == &donky_signals) {
+                                donky_signal_drain();
+                                continue;
+                        }
+
+                        /* New connection :o */
+                        if (cur->is_listener) {
+                                donky_conn_new(cur);
+                                continue;
+                        }
+
+                        /* Incoming data. */
+                        if ((fired[i].mask & EVENT_READ) &&
+                            !((cur->is_packet) ? donky_conn_read_packet(cur) :
+                                                 donky_conn_read(cur)))
+                                continue;
+
+                        /* Room to send what's been waiting. */
+                        if (fired[i].mask & EVENT_WRITE)
+                                donky_conn_flush(cur);
+                }
+
+                /* Send out whatever got queued while we were busy. */
+                donky_conn_flush_dirty(r);
+
+                donky_wheel_advance(r);
+        }
+
+        return NULL;
+}
+
+/**
+ * @brief Empty out the signal pipe.
+ */
+static void donky_signal_drain(void)
+{
+        char buf[64];
+
+        while (read(donky_signal_fd, buf, sizeof(buf)) > 0)
+                ;
+}
+
+/**
+ * @brief Reload the config in place.  Connections, listeners and
+ *        subscriptions all stay, only modules whose settings changed get
+ *        reloaded.  Everybody else that reads the config does it with the
+ *        request list locked, so holding it keeps them out of the way.
+ *        Module methods on the workers don't, so they get paused.  Called
+ *        by the request handler, with the request list locked.
+ */
+void donky_reconfigure(void)
+{
+        struct mod_ls *old;
+        char spec[sizeof(donky_listen_spec)];
+
+        printf("Reloading the config...\n");
+
+        /* Module methods don't hold the lock, so wait them out, saying who
+         * we're waiting on. */
+        module_report_busy();
+        pool_pause();
+
+        old = cfg_stash();
+        parse_cfg();
+        module_reconfigure(old);
+
+        if (cfg_mod_changed(old, "multicast")) {
+                mcast_stop();
+                if (mcast_start() == -1)
+                        fprintf(stderr, "Couldn't set up multicast.\n");
+        }
+
+        if (cfg_mod_changed(old, "relay"))
+                fprintf(stderr, "Relay settings changed, restart donky to "
+                        "use them.\n");
+        if (cfg_mod_changed(old, "metrics"))
+                fprintf(stderr, "Metrics settings changed, restart donky to "
+                        "use them.\n");
+
+        cfg_stash_free(old);
+
+        donky_settings();
+
+        pool_resume();
+
+        /* We don't tear down listeners with people on them. */
+        donky_listen_describe(spec, sizeof(spec));
+        if (strcmp(spec, donky_listen_spec))
+                fprintf(stderr, "Listener settings changed, restart donky "
+                        "to use them.\n");
+}
+
+/**
+ * @brief Pick up the [daemon] settings that can change on the fly.
+ */
+static void donky_settings(void)
+{
+        donky_send_queue = get_int_key("daemon", "send_queue",
+                                       DEFAULT_SEND_QUEUE);
+        donky_send_buffer = get_int_key("daemon", "send_buffer",
+                                        DEFAULT_SEND_BUFFER);
+        donky_max_line = get_int_key("daemon", "max_line", DEFAULT_MAX_LINE);
+        donky_max_clients = get_int_key("daemon", "max_clients",
+                                        DEFAULT_MAX_CLIENTS);
+        donky_max_unauthed = get_int_key("daemon", "max_unauthed",
+                                         DEFAULT_MAX_UNAUTHED);
+        donky_auth_timeout = get_int_key("daemon", "auth_timeout",
+                                         DEFAULT_AUTH_TIMEOUT);
+        donky_idle_timeout = get_int_key("daemon", "idle_timeout",
+                                         DEFAULT_IDLE_TIMEOUT);
+
+        /* Accepting doesn't take the request lock, so it gets a copy. */
+        pthread_mutex_lock(&admit_lock);
+        donky_has_pass = (get_char_key("daemon", "pass", NULL) != NULL);
+        pthread_mutex_unlock(&admit_lock);
+}
+
+
+/**
+ * @brief Describe the settings that only take effect when we start
+ *        listening, so we can tell when a reload changed them.
+ *
+ * @param buf Where to write
+ * @param size Size of buf
+ */
+static void donky_listen_describe(char *buf, size_t size)
+{
+        snprintf(buf, size, "%s|%d|%s|%d|%d|%d",
+                 get_char_key("daemon", "host", "0.0.0.0"),
+                 get_int_key("daemon", "port", 7000),
+                 get_char_key("daemon", "unix_socket", ""),
+                 get_bool_key("daemon", "unix_seqpacket", 0),
+                 get_int_key("daemon", "io_threads", DEFAULT_IO_THREADS),
+                 get_int_key("daemon", "listen_backlog",
+                             DEFAULT_LISTEN_BACKLOG));
+}
+
+/**
+ * @brief Start reading from a donky connection.  Readiness is edge-triggered,
+ *        so keep going until the socket runs dry.  Lines can show up in
+ *        pieces or by the hundred, so everything goes through the
+ *        connection's input buffer.
+ *
+ * @param cur Connection to read from
+ *
+ * @return 1 if the connection is still around, 0 if it was dropped
+ */
+static int donky_conn_read(donky_conn *cur)
+{
+        size_t room;
+        int n;
+
+        while (1) {
+                /* Make sure there's a decent chunk of room to read into. */
+                if (cur->in_size - cur->in_len < DONKY_READ_CHUNK) {
+                        cur->in_size = (cur->in_size) ?
+                                       cur->in_size * 2 : DONKY_READ_CHUNK;
+                        cur->in_buf = realloc(cur->in_buf, cur->in_size);
+                }
+
+                room = cur->in_size - cur->in_len - 1;
+                n = recv(cur->sock, cur->in_buf + cur->in_len, room, 0);
+
+                if (n == -1) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                return 1;
+                        if (errno == EINTR)
+                                continue;
+
+                        perror("recv");
+                        donky_conn_drop(cur);
+                        return 0;
+                } else if (n == 0) {
+                        DEBUGF(("Connection hung up on us!\n"));
+                        donky_conn_drop(cur);
+                        return 0;
+                }
+
+                cur->in_len += n;
+                cur->last_active = donky_now();
+
+                if (!donky_conn_lines(cur))
+                        return 0;
+
+                /* Didn't fill the buffer, so the socket is dry. */
+                if ((size_t) n < room)
+                        return 1;
+        }
+}
+
+/**
+ * @brief Hand every complete line in the input buffer to the protocol
+ *        handler, then keep the leftover partial line for next time.
+ *
+ * @param cur Connection
+ *
+ * @return 1 if the connection is still around, 0 if it was dropped
+ */
+static int donky_conn_lines(donky_conn *cur)
+{
+        char *line = cur->in_buf;
+        char *end = cur->in_buf + cur->in_len;
+        char *eol;
+        int too_long = 0; /* bool */
+
+        /* One lock for the whole batch, not one per line. */
+        request_list_lock();
+
+        while ((eol = memchr(line, '\n', end - line))) {
+                if ((size_t) (eol - line) > donky_max_line) {
+                        too_long = 1;
+                        break;
+                }
+
+                /* Remove \r\n (if it is there) */
+                *eol = '\0';
+                if (eol > line && eol[-1] == '\r')
+                        eol[-1] = '\0';
+
+                /* Send away to the protocol handler. */
+                if (*line) {
+                        DEBUGF(("line = [%s]\n", line));
+                        protocol_handle(cur, line);
+                }
+
+                line = eol + 1;
+
+                if (cur->is_closing)
+                        break;
+        }
+
+        request_list_unlock();
+
+        /* They said bye, get the goodbye out and drop. */
+        if (cur->is_closing) {
+                donky_conn_flush(cur);
+                donky_conn_drop(cur);
+                return 0;
+        }
+
+        /* Keep the partial line around. */
+        cur->in_len = end - line;
+        memmove(cur->in_buf, line, cur->in_len);
+
+        if (too_long || cur->in_len > donky_max_line) {
+                fprintf(stderr, "Connection %d sent a line over %lu bytes, "
+                        "dropping it.\n", cur->sock,
+                        (unsigned long) donky_max_line);
+                donky_conn_send(cur, PROTO_ERROR);
+                donky_conn_flush(cur);
+                donky_conn_drop(cur);
+                return 0;
+        }
+
+        return 1;
+}
+
+/**
+ * @brief Read from a SOCK_SEQPACKET connection.  Every message is exactly
+ *        one command, so there's no line buffering to do.
+ *
+ * @param cur Connection to read from
+ *
+ * @return 1 if the connection is still around, 0 if it was dropped
+ */
+static int donky_conn_read_packet(donky_conn *cur)
+{
+        char *line;
+        int n;
+
+        if (cur->in_size < donky_max_line + 1) {
+                cur->in_size = donky_max_line + 1;
+                cur->in_buf = realloc(cur->in_buf, cur->in_size);
+        }
+
+        while (1) {
+                n = recv(cur->sock, cur->in_buf, cur->in_size, MSG_TRUNC);
+
+                if (n == -1) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                return 1;
+                        if (errno == EINTR)
+                                continue;
+
+                        perror("recv");
+                        donky_conn_drop(cur);
+                        return 0;
+                } else if (n == 0) {
+                        DEBUGF(("Connection hung up on us!\n"));
+                        donky_conn_drop(cur);
+                        return 0;
+                }
+
+                /* MSG_TRUNC gives us the real length of the message. */
+                if ((size_t) n > donky_max_line) {
+                        fprintf(stderr, "Connection %d sent a message over "
+                                "%lu bytes, dropping it.\n", cur->sock,
+                                (unsigned long) donky_max_line);
+                        donky_conn_send(cur, PROTO_ERROR);
+                        donky_conn_flush(cur);
+                        donky_conn_drop(cur);
+                        return 0;
+                }
+
+                cur->last_active = donky_now();
+
+                /* Be nice to clients that frame anyway. */
+                line = cur->in_buf;
+                line[n] = '\0';
+                while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+                        line[--n] = '\0';
+
+                if (*line) {
+                        DEBUGF(("packet = [%s]\n", line));
+                        request_list_lock();
+                        protocol_handle(cur, line);
+                        request_list_unlock();
+                }
+
+                /* They said bye, get the goodbye out and drop. */
+                if (cur->is_closing) {
+                        donky_conn_flush(cur);
+                        donky_conn_drop(cur);
+                        return 0;
+                }
+        }
+}
+
+/**
+ * @brief Handle new donky connections.  Accept until the backlog is empty,
+ *        since we only hear about the listener becoming readable once.
+ *
+ * @param cur Listener connection
+ */
+static void donky_conn_new(donky_conn *cur)
+{
+        donky_conn *n;
+        int newfd;
+        int authed;
+
+        while (1) {
+                newfd = accept(cur->sock, NULL, NULL);
+
+                if (newfd == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                                perror("donky_client_new: accept");
+                        return;
+                }
+
+                /* Nobody gets to block us, output goes through the queue. */
+                sock_set_nonblock(newfd, 1);
+
+                /* Full up?  Tell them, if the socket will take it. */
+                if (!donky_conn_admit(&authed)) {
+                        DEBUGF(("Too many connections, turning one away.\n"));
+                        if (send(newfd, PROTO_BUSY "\r\n",
+                                 sizeof(PROTO_BUSY "\r\n") -
+                                 ((cur->is_packet) ? 3 : 1), 0) == -1) {
+                                DEBUGF(("Couldn't even say BUSY.\n"));
+                        }
+                        close(newfd);
+                        continue;
+                }
+
+                DEBUGF(("New connection, adding to client list.\n"));
+                if ((n = donky_conn_add(cur->owner, newfd)) == NULL) {
+                        donky_conn_release(authed);
+                        close(newfd);
+                        continue;
+                }
+
+                /* Packet listeners hand out packet connections. */
+                n->is_packet = cur->is_packet;
+                n->is_authed = authed;
+
+                /* Start the auth and idle clocks. */
+                n->accepted = n->last_active = donky_now();
+                donky_conn_expire(n, n->accepted);
+
+                donky_conn_send(n, PROTO_CONN_ACK);
+        }
+}
+
+/**
+ * @brief Check a new connection against max_clients and max_unauthed, and
+ *        count it if it gets in.
+ *
+ * @param authed Set to 1 if there's no password, so no auth needed
+ *
+ * @return 1 if it's allowed in, 0 if we're full
+ */
+static int donky_conn_admit(int *authed)
+{
+        int ret = 1;
+
+        pthread_mutex_lock(&admit_lock);
+
+        *authed = !donky_has_pass;
+
+        if (donky_max_clients > 0 && client_count >= donky_max_clients)
+                ret = 0;
+        if (!*authed && donky_max_unauthed > 0 &&
+            unauthed_count >= donky_max_unauthed)
+                ret = 0;
+
+        if (ret) {
+                client_count++;
+                if (!*authed)
+                        unauthed_count++;
+        }
+
+        pthread_mutex_unlock(&admit_lock);
+
+        return ret;
+}
+
+/**
+ * @brief Give back a connection's spot from donky_conn_admit().
+ *
+ * @param authed The connection was authenticated (bool)
+ */
+static void donky_conn_release(int authed)
+{
+        pthread_mutex_lock(&admit_lock);
+        client_count--;
+        if (!authed)
+                unauthed_count--;
+        pthread_mutex_unlock(&admit_lock);
+}
+
+/**
+ * @brief A connection got the password right.
+ *
+ * @param cur Connection
+ */
+void donky_conn_authed(donky_conn *cur)
+{
+        if (cur->is_authed)
+                return;
+
+        cur->is_authed = 1;
+
+        pthread_mutex_lock(&admit_lock);
+        unauthed_count--;
+        pthread_mutex_unlock(&admit_lock);
+}
+
+/**
+ * @brief Timer wheel callback.  Drop the connection if it blew its auth
+ *        deadline or has been idle too long, otherwise figure out when to
+ *        look at it again.  A connection with subscriptions isn't idle, it
+ *        just doesn't have anything to say.
+ *
+ * @param cur Connection
+ * @param now Current time
+ */
+static void donky_conn_expire(donky_conn *cur, unsigned long now)
+{
+        unsigned long when = 0;
+        int subs;
+
+        if (!cur->is_authed && donky_auth_timeout > 0) {
+                when = cur->accepted + donky_auth_timeout;
+
+                if (now >= when) {
+                        DEBUGF(("Connection %d never authenticated.\n",
+                                cur->sock));
+                        donky_conn_send(cur, PROTO_BYE);
+                        if (donky_conn_flush(cur))
+                                donky_conn_drop(cur);
+                        return;
+                }
+        }
+
+        if (donky_idle_timeout > 0) {
+                /* Somebody's got it for a while (a reload), don't wait
+                 * around, just give them the benefit of the doubt. */
+                if (request_list_trylock()) {
+                        subs = cur->subs;
+                        request_list_unlock();
+                } else {
+                        subs = 1;
+                }
+
+                if (subs > 0)
+                        cur->last_active = now;
+
+                if (now >= cur->last_active + donky_idle_timeout) {
+                        DEBUGF(("Connection %d is idle.\n", cur->sock));
+                        donky_conn_send(cur, PROTO_BYE);
+                        if (donky_conn_flush(cur))
+                                donky_conn_drop(cur);
+                        return;
+                }
+
+                if (when == 0 || cur->last_active + donky_idle_timeout < when)
+                        when = cur->last_active + donky_idle_timeout;
+        }
+
+        if (when)
+                donky_timer_set(cur, when);
+}
+
+/**
+ * @brief Put a connection on its reactor's timer wheel, or move it if it's
+ *        there already.
+ *
+ * @param cur Connection
+ * @param when Time to look at it again
+ */
+static void donky_timer_set(donky_conn *cur, unsigned long when)
+{
+        struct donky_reactor *r = cur->owner;
+        donky_conn **slot = &r->wheel[when % DONKY_WHEEL_SLOTS];
+
+        donky_timer_del(cur);
+
+        cur->expires = when;
+        cur->in_wheel = 1;
+        cur->wheel_prev = NULL;
+        cur->wheel_next = *slot;
+        if (*slot)
+                (*slot)->wheel_prev = cur;
+        *slot = cur;
+
+        r->wheel_count++;
+}
+
+/**
+ * @brief Take a connection off the timer wheel.
+ *
+ * @param cur Connection
+ */
+static void donky_timer_del(donky_conn *cur)
+{
+        struct donky_reactor *r = cur->owner;
+
+        if (!cur->in_wheel)
+                return;
+
+        if (cur->wheel_prev)
+                cur->wheel_prev->wheel_next = cur->wheel_next;
+        else
+                r->wheel[cur->expires % DONKY_WHEEL_SLOTS] = cur->wheel_next;
+        if (cur->wheel_next)
+                cur->wheel_next->wheel_prev = cur->wheel_prev;
+
+        cur->in_wheel = 0;
+        cur->wheel_next = NULL;
+        cur->wheel_prev = NULL;
+
+        r->wheel_count--;
+}
+
+/**
+ * @brief Turn the timer wheel up to now, expiring whatever is due.  Each
+ *        second only touches its own slot, and connections that aren't
+ *        due yet (a lap or more away) are skipped over.
+ *
+ * @param r Reactor
+ */
+static void donky_wheel_advance(struct donky_reactor *r)
+{
+        unsigned long now = donky_now();
+        donky_conn *cur;
+        donky_conn *next;
+
+        /* Been asleep for more than a lap, every slot gets one look. */
+        if (now - r->wheel_tick >= DONKY_WHEEL_SLOTS)
+                r->wheel_tick = now - DONKY_WHEEL_SLOTS + 1;
+
+        for (; r->wheel_tick <= now; r->wheel_tick++) {
+                cur = r->wheel[r->wheel_tick % DONKY_WHEEL_SLOTS];
+
+                while (cur) {
+                        next = cur->wheel_next;
+
+                        if (cur->expires <= now) {
+                                donky_timer_del(cur);
+                                donky_conn_expire(cur, now);
+                        }
+
+                        cur = next;
+                }
+        }
+}
+
+/**
+ * @brief Seconds on the monotonic clock, the timer wheel's idea of time.
+ *
+ * @return Seconds
+ */
+static unsigned long donky_now(void)
+{
+        return (unsigned long) get_mono_time();
+}
+
+/**
+ * @brief Add donky client to a reactor's linked list.
+ *
+ * @param r Reactor that will own the client
+ * @param sock Socket of client
+ *
+ * @return Newly created node.
+ */
+static donky_conn *donky_conn_add(struct donky_reactor *r, int sock)
+{
+        donky_conn *n = malloc(sizeof(donky_conn));
+
+        n->sock = sock;
+        n->owner = r;
+        n->is_listener = 0;
+        n->is_packet = 0;
+        n->is_binary = 0;
+        n->is_authed = 0;
+        n->is_closing = 0;
+        n->is_broken = 0;
+        n->subs = 0;
+
+        n->accepted = 0;
+        n->last_active = 0;
+        n->expires = 0;
+        n->in_wheel = 0;
+        n->wheel_next = NULL;
+        n->wheel_prev = NULL;
+
+        n->in_buf = NULL;
+        n->in_len = 0;
+        n->in_size = 0;
 
-/* Function prototypes. */
-static void donky_conn_read(donky_conn *cur);
-static void donky_conn_new(donky_conn *cur);
-static donky_conn *donky_conn_add(int sock);
-static int donky_listen(void);
-static void clean_dis_shiz(void);
-static void donky_conn_set_fdmax(void);
+        pthread_mutex_init(&n->out_lock, NULL);
+        n->out_start = NULL;
+        n->out_end = NULL;
+        n->out_len = 0;
+        n->out_hwm = 0;
+        n->out_keyed = 0;
+        n->out_bytes = 0;
+        n->out_conflated = 0;
+        n->out_writes = 0;
+        n->want_write = 0;
+        n->is_dirty = 0;
+        n->dirty_next = NULL;
+
+        n->prev = NULL;
+        n->next = NULL;
+
+        /* Watch the socket, the event hands us this node back. */
+        if (event_add(r->events, sock, EVENT_READ, n) == -1) {
+                pthread_mutex_destroy(&n->out_lock);
+                free(n);
+                return NULL;
+        }
+
+        pthread_mutex_lock(&r->conn_lock);
+        if (r->dc_end == NULL) {
+                r->dc_start = n;
+                r->dc_end = n;
+        } else {
+                r->dc_end->next = n;
+                n->prev = r->dc_end;
+                r->dc_end = n;
+        }
+        pthread_mutex_unlock(&r->conn_lock);
+
+        return n;
+}
 
 /**
- * @brief Donky loop (tm)
+ * @brief Queue a message for a connection, CR-LF appended.
+ *
+ * @param cur Connection
+ * @param format Format string
+ * @param ... Format arguments
+ *
+ * @return 1 if queued, 0 if the connection is going away
  */
-void donky_loop(void)
+int donky_conn_send(donky_conn *cur, const char *format, ...)
 {
-        fd_set fds;
-        donky_conn *cur;
-        
-        /* Start listening, get out of here if we can't. */
-        if ((donky_listen() == -1)) {
-                fprintf(stderr, "I just can't listen! Ok! ;[\n");
-                donky_exit = 1;
-                return;
+        va_list ap;
+        char *data;
+        size_t len;
+
+        if (cur->is_broken)
+                return 0;
+
+        va_start(ap, format);
+        data = donky_conn_format(cur, &len, format, ap);
+        va_end(ap);
+
+        return donky_conn_queue(cur, 0, 0, data, len);
+}
+
+/**
+ * @brief Queue a string variable update for a connection.  If an older
+ *        value for the same id is still sitting in the queue, it gets
+ *        replaced, so a slow client only ever gets the latest value.
+ *
+ * @param cur Connection
+ * @param id Subscription id
+ * @param type Variable type
+ * @param str Value
+ *
+ * @return 1 if queued, 0 if the connection is going away
+ */
+int donky_conn_update_str(donky_conn *cur,
+                          unsigned int id,
+                          int type,
+                          const char *str)
+{
+        char *data;
+        size_t len;
+
+        if (cur->is_broken)
+                return 0;
+
+        if (cur->is_binary)
+                data = frame_str(id, type, str, &len);
+        else
+                data = donky_conn_text(cur, &len, "%u:%d:%s", id, type, str);
+
+        return donky_conn_queue(cur, id, 1, data, len);
+}
+
+/**
+ * @brief Queue a numeric variable update for a connection, same deal as
+ *        donky_conn_update_str().
+ *
+ * @param cur Connection
+ * @param id Subscription id
+ * @param type Variable type
+ * @param val Value
+ *
+ * @return 1 if queued, 0 if the connection is going away
+ */
+int donky_conn_update_int(donky_conn *cur,
+                          unsigned int id,
+                          int type,
+                          unsigned long val)
+{
+        char *data;
+        size_t len;
+
+        if (cur->is_broken)
+                return 0;
+
+        if (cur->is_binary)
+                data = frame_u64(id, type, val, &len);
+        else
+                data = donky_conn_text(cur, &len, "%u:%d:%lu", id, type, val);
+
+        return donky_conn_queue(cur, id, 1, data, len);
+}
+
+/**
+ * @brief Switch a connection between the text and binary protocols.
+ *        Everything queued from here on is in the new format.
+ *
+ * @param cur Connection
+ * @param on 1 for binary, 0 for text
+ */
+void donky_conn_set_binary(donky_conn *cur, int on)
+{
+        struct donky_msg *m;
+
+        pthread_mutex_lock(&cur->out_lock);
+
+        /* Whatever's queued is in the old format, don't swap new stuff in. */
+        for (m = cur->out_start; m; m = m->next)
+                m->is_sealed = 1;
+
+        cur->is_binary = on;
+
+        pthread_mutex_unlock(&cur->out_lock);
+}
+
+/**
+ * @brief Format a message the way the connection wants it: a line with
+ *        CR-LF, a bare packet, or a binary text frame.
+ *
+ * @param cur Connection
+ * @param len Set to the message length
+ * @param format Format string
+ * @param ap Format arguments
+ *
+ * @return Malloc'd message
+ */
+static char *donky_conn_format(donky_conn *cur,
+                               size_t *len,
+                               const char *format,
+                               va_list ap)
+{
+        char buffer[2048];
+        char *data;
+        int n;
+
+        /* Format once, right into the message. */
+        n = vsnprintf(buffer, sizeof(buffer) - 2, format, ap);
+        if (n < 0)
+                n = 0;
+        if (n > (int) sizeof(buffer) - 3)
+                n = sizeof(buffer) - 3;
+
+        if (cur->is_binary)
+                return frame_text(buffer, n, len);
+
+        if (!cur->is_packet) {
+                buffer[n++] = '\r';
+                buffer[n++] = '\n';
         }
 
-        /* Zero the file descriptor sets. */
-        FD_ZERO(&donky_fds);
+        data = malloc(n);
+        memcpy(data, buffer, n);
+        *len = n;
 
-        /* Set maximum file descriptor number. */
-        donky_fdmax = donky_sock;
+        return data;
+}
 
-        /* Add the listening socket to the connection list. */
-        donky_conn_add(donky_sock);
+/**
+ * @brief Same as donky_conn_format(), with the arguments right here.
+ *
+ * @param cur Connection
+ * @param len Set to the message length
+ * @param format Format string
+ * @param ... Format arguments
+ *
+ * @return Malloc'd message
+ */
+static char *donky_conn_text(donky_conn *cur,
+                             size_t *len,
+                             const char *format, ...)
+{
+        va_list ap;
+        char *data;
 
-        /* Start the request handler. */
-        request_handler_start();
+        va_start(ap, format);
+        data = donky_conn_format(cur, len, format, ap);
+        va_end(ap);
 
-        /* Infinite donky listener loop of death (tm) */
-        while (!donky_exit && !donky_reload) {
-                fds = donky_fds;
+        return data;
+}
 
-                /* Wait until we have some crap to read. */
-                if ((select(donky_fdmax + 1, &fds, NULL, NULL, NULL) == -1)) {
-                        perror("select");
-                        break;
-                }
+/**
+ * @brief Stick a message on the output queue.
+ *
+ * @param cur Connection
+ * @param id Subscription id
+ * @param keyed Conflate with older messages for this id (bool)
+ * @param data Malloc'd message, the queue owns it now
+ * @param n Length of data
+ *
+ * @return 1 if queued, 0 if the connection is going away
+ */
+static int donky_conn_queue(donky_conn *cur,
+                            unsigned int id,
+                            int keyed,
+                            char *data,
+                            size_t n)
+{
+        struct donky_reactor *r = cur->owner;
+        struct donky_msg *m;
+        int wake = 0;
 
-                /* Traverse the linked list. */
-                cur = dc_start;
-                
-                while (cur) {
-                        /* Check if this connection is the one that triggered
-                         * the select. */
-                        if (!FD_ISSET(cur->sock, &fds)) {
-                                cur = cur->next;
-                                continue;
-                        }
-                                
-                        
-                        /* New connection :o */
-                        if (cur->sock == donky_sock)
-                                donky_conn_new(cur);
-                        /* Incoming data. */
-                        else
-                                donky_conn_read(cur);
+        pthread_mutex_lock(&cur->out_lock);
 
-                        cur = cur->next;
+        /* Behind already?  Replace the value nobody has seen yet. */
+        if (keyed) {
+                for (m = cur->out_start; m; m = m->next) {
+                        if (m->keyed && m->id == id &&
+                            m->off == 0 && !m->is_sealed) {
+                                free(m->data);
+                                m->data = data;
+                                m->len = n;
+                                cur->out_conflated++;
+                                pthread_mutex_unlock(&cur->out_lock);
+                                return 1;
+                        }
                 }
         }
 
-        /* Run cleanup routine. */
-        clean_dis_shiz();
+        m = malloc(sizeof(struct donky_msg));
+        m->id = id;
+        m->keyed = keyed;
+        m->data = data;
+        m->len = n;
+        m->off = 0;
+        m->is_sealed = 0;
+        m->next = NULL;
+
+        if (cur->out_end == NULL) {
+                cur->out_start = m;
+                cur->out_end = m;
+        } else {
+                cur->out_end->next = m;
+                cur->out_end = m;
+        }
+
+        if (++cur->out_len > cur->out_hwm)
+                cur->out_hwm = cur->out_len;
+        if (keyed)
+                cur->out_keyed++;
+        else
+                cur->out_bytes += n;
+
+        /* Conflation keeps the values down to about one per subscription,
+         * so only what's piled up past that counts.  Replies can't be
+         * conflated, so a client pipelining a pile of commands is only
+         * cut off once they add up to something big. */
+        if (cur->out_keyed > donky_send_queue + cur->subs ||
+            cur->out_bytes > donky_send_buffer) {
+                fprintf(stderr, "Connection %d is not keeping up, "
+                        "dropping it.\n", cur->sock);
+                cur->is_broken = 1;
+        }
+
+        pthread_mutex_unlock(&cur->out_lock);
+
+        /* Put it on the owning reactor's flush list. */
+        pthread_mutex_lock(&r->dirty_lock);
+        if (!cur->is_dirty) {
+                cur->is_dirty = 1;
+                cur->dirty_next = r->dirty_start;
+                r->dirty_start = cur;
+                wake = !pthread_equal(pthread_self(), r->thread);
+        }
+
+        /* The owner flushes on its way around anyhow, and in the middle of
+         * a tick we hold off so everything goes out in one write. */
+        if (wake && donky_conn_deferred()) {
+                r->wake_pending = 1;
+                wake = 0;
+        }
+        pthread_mutex_unlock(&r->dirty_lock);
+
+        if (wake)
+                event_wake(r->events);
+
+        return 1;
 }
 
 /**
- * @brief Start reading from a donky connection.
+ * @brief Send as much of the output queue as the socket will take.
+ *        Only the owning reactor calls this.
  *
- * @param cur Connection to read from
+ * @param cur Connection
+ *
+ * @return 1 if the connection is still around, 0 if it was dropped
  */
-static void donky_conn_read(donky_conn *cur)
+static int donky_conn_flush(donky_conn *cur)
 {
-        char buf[1024];
-        char *line;
-        int n;
-        
-        n = recv(cur->sock, &buf, sizeof(buf) - 1, 0);
+        int blocked;
 
-        if (n == -1) {
-                perror("recv");
-                donky_conn_drop(cur);
-                return;
-        } else if (n == 0) {
-                DEBUGF(("Connection hung up on us!\n"));
+        pthread_mutex_lock(&cur->out_lock);
+
+        blocked = (cur->is_packet) ? donky_conn_flush_packet(cur) :
+                                     donky_conn_flush_stream(cur);
+
+        /* Only ask about writability while there's a backlog. */
+        if (!cur->is_broken && blocked != cur->want_write) {
+                cur->want_write = blocked;
+                event_mod(cur->owner->events, cur->sock,
+                          EVENT_READ | ((blocked) ? EVENT_WRITE : 0), cur);
+        }
+
+        pthread_mutex_unlock(&cur->out_lock);
+
+        if (cur->is_broken) {
+                DEBUGF(("Send failed, dropping connection.\n"));
                 donky_conn_drop(cur);
-                return;
+                return 0;
         }
 
-        buf[n] = '\0';
+        return 1;
+}
+
+/**
+ * @brief Take the first message off a connection's queue, it's been sent.
+ *        Called with out_lock held.
+ *
+ * @param cur Connection
+ */
+static void donky_conn_unqueue(donky_conn *cur)
+{
+        struct donky_msg *m = cur->out_start;
+
+        cur->out_start = m->next;
+        if (cur->out_start == NULL)
+                cur->out_end = NULL;
+        cur->out_len--;
 
-        /* Split up line by \r\n incase we got multiple commands at once. */
-        for (line = strtok(buf, "\r\n"); line; line = strtok(NULL, "\r\n")) {
-                /* Remove \r\n (if it is there) */
-                chomp(line);
-                chomp(line);
+        /* Keyed ones stopped counting once they were started on. */
+        if (!m->keyed)
+                cur->out_bytes -= m->len;
+        else if (m->off == 0)
+                cur->out_keyed--;
 
-                /* Send away to the protocol handler. */
-                DEBUGF(("line = [%s]\n", line));
-                protocol_handle(cur, line);
+        free(m->data);
+        free(m);
+}
+
+/**
+ * @brief Send the output queue of a stream connection, gathering as many
+ *        messages as we can into each writev().  A whole tick worth of
+ *        updates usually goes out in one call.  Called with out_lock held.
+ *
+ * @param cur Connection
+ *
+ * @return 1 if the socket is full, 0 otherwise
+ */
+static int donky_conn_flush_stream(donky_conn *cur)
+{
+        struct iovec iov[DONKY_MAX_IOV];
+        struct donky_msg *m;
+        ssize_t n;
+        size_t left;
+        int cnt;
+
+        while (!cur->is_broken && cur->out_start) {
+                if (cur->is_binary)
+                        donky_conn_batch(cur);
+
+                /* Gather up the queue, the first one may be half sent. */
+                for (cnt = 0, m = cur->out_start;
+                     m && cnt < DONKY_MAX_IOV;
+                     cnt++, m = m->next) {
+                        iov[cnt].iov_base = m->data + m->off;
+                        iov[cnt].iov_len = m->len - m->off;
+                }
+
+                n = writev(cur->sock, iov, cnt);
+                cur->out_writes++;
+
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                return 1;
+
+                        cur->is_broken = 1;
+                        return 0;
+                }
+
+                /* Throw away whatever made it out. */
+                left = n;
+                while ((m = cur->out_start) && left >= m->len - m->off) {
+                        left -= m->len - m->off;
+
+                        donky_conn_unqueue(cur);
+                }
+
+                if (m && left) {
+                        if (m->keyed && m->off == 0)
+                                cur->out_keyed--;
+                        m->off += left;
+                }
         }
+
+        return 0;
 }
 
 /**
- * @brief Handle new donky connection.
+ * @brief Wrap the start of a binary connection's queue in a batch frame,
+ *        so the client gets a tick worth of updates as one frame.  Called
+ *        with out_lock held.
  *
- * @param cur Listener connection
+ * @param cur Connection
  */
-static void donky_conn_new(donky_conn *cur)
+static void donky_conn_batch(donky_conn *cur)
 {
-        int newfd = accept(cur->sock, NULL, NULL);
+        unsigned char header[FRAME_HEADER_MAX];
+        struct donky_msg *m;
+        struct donky_msg *b;
+        size_t len = 0;
+        int cnt = 0;
 
-        if (newfd == -1) {
-                perror("donky_client_new: accept");
+        /* Already part way through a batch (or a message). */
+        if (cur->out_start->is_sealed || cur->out_start->off)
                 return;
+
+        /* The header takes up one writev slot. */
+        for (m = cur->out_start; m && cnt < DONKY_MAX_IOV - 1; m = m->next) {
+                len += m->len;
+                cnt++;
         }
 
-        if (newfd > donky_fdmax)
-                donky_fdmax = newfd;
+        if (cnt < 2)
+                return;
+
+        b = malloc(sizeof(struct donky_msg));
+        b->id = 0;
+        b->keyed = 0;
+        b->len = frame_header(header, FRAME_BATCH, len);
+        b->data = malloc(b->len);
+        memcpy(b->data, header, b->len);
+        b->off = 0;
+        b->is_sealed = 1;
 
-        DEBUGF(("New connection, adding to client list.\n"));
-        donky_conn_add(newfd);
-        sendcrlf(newfd, PROTO_CONN_ACK);
+        /* The length is set in stone now, no more swapping values in. */
+        for (m = cur->out_start; cnt--; m = m->next)
+                m->is_sealed = 1;
+
+        b->next = cur->out_start;
+        cur->out_start = b;
+        cur->out_len++;
+        cur->out_bytes += b->len;
 }
 
 /**
- * @brief Add donky client to linked list.
+ * @brief Send the output queue of a packet connection, one message per
+ *        send() so message boundaries stay put.  Called with out_lock held.
  *
- * @param sock Socket of client
+ * @param cur Connection
  *
- * @return Newly created node.
+ * @return 1 if the socket is full, 0 otherwise
  */
-static donky_conn *donky_conn_add(int sock)
+static int donky_conn_flush_packet(donky_conn *cur)
 {
-        donky_conn *n = malloc(sizeof(donky_conn));
+        struct donky_msg *m;
+        int n;
 
-        n->sock = sock;
-        n->is_authed = 0;
-        
-        n->prev = NULL;
-        n->next = NULL;
+        while (!cur->is_broken && (m = cur->out_start)) {
+                n = send(cur->sock, m->data, m->len, 0);
+                cur->out_writes++;
 
-        if (dc_end == NULL) {
-                dc_start = n;
-                dc_end = n;
-        } else {
-                dc_end->next = n;
-                n->prev = dc_end;
-                dc_end = n;
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                return 1;
+
+                        cur->is_broken = 1;
+                        return 0;
+                }
+
+                donky_conn_unqueue(cur);
         }
 
-        /* Add socket to the main fd set. */
-        FD_SET(sock, &donky_fds);
+        return 0;
+}
 
-        return n;
+/**
+ * @brief Start a tick.  Until donky_tick_end(), anything this thread queues
+ *        for another reactor just sits there, so each connection gets all
+ *        of its updates in one go instead of one write per update.
+ */
+void donky_tick_begin(void)
+{
+        pthread_mutex_lock(&tick_lock);
+        tick_thread = pthread_self();
+        in_tick = 1;
+        pthread_mutex_unlock(&tick_lock);
+}
+
+/**
+ * @brief End a tick and wake every reactor that got something queued.
+ */
+void donky_tick_end(void)
+{
+        int wake;
+        int i;
+
+        pthread_mutex_lock(&tick_lock);
+        in_tick = 0;
+        pthread_mutex_unlock(&tick_lock);
+
+        for (i = 0; i < reactor_count; i++) {
+                pthread_mutex_lock(&reactors[i].dirty_lock);
+                wake = reactors[i].wake_pending;
+                reactors[i].wake_pending = 0;
+                pthread_mutex_unlock(&reactors[i].dirty_lock);
+
+                if (wake)
+                        event_wake(reactors[i].events);
+        }
+}
+
+/**
+ * @brief Is this thread in the middle of a tick?
+ *
+ * @return 1 if wakes should wait for donky_tick_end(), 0 otherwise
+ */
+static int donky_conn_deferred(void)
+{
+        int ret;
+
+        pthread_mutex_lock(&tick_lock);
+        ret = in_tick && pthread_equal(pthread_self(), tick_thread);
+        pthread_mutex_unlock(&tick_lock);
+
+        return ret;
+}
+
+/**
+ * @brief Flush every connection that had something queued since last time.
+ *
+ * @param r Reactor whose connections to flush
+ */
+static void donky_conn_flush_dirty(struct donky_reactor *r)
+{
+        donky_conn *cur;
+
+        while (1) {
+                pthread_mutex_lock(&r->dirty_lock);
+                if ((cur = r->dirty_start)) {
+                        r->dirty_start = cur->dirty_next;
+                        cur->dirty_next = NULL;
+                        cur->is_dirty = 0;
+                }
+                pthread_mutex_unlock(&r->dirty_lock);
+
+                if (cur == NULL)
+                        break;
+
+                donky_conn_flush(cur);
+        }
+}
+
+/**
+ * @brief Free everything left in a connection's output queue.
+ *
+ * @param cur Connection
+ */
+static void donky_conn_free_queue(donky_conn *cur)
+{
+        struct donky_msg *m;
+        struct donky_msg *next;
+
+        for (m = cur->out_start; m; m = next) {
+                next = m->next;
+                free(m->data);
+                free(m);
+        }
+
+        cur->out_start = NULL;
+        cur->out_end = NULL;
+        cur->out_len = 0;
+        cur->out_keyed = 0;
+        cur->out_bytes = 0;
 }
 
 /**
@@ -205,84 +1599,196 @@ static donky_conn *donky_conn_add(int sock)
  */
 void donky_conn_drop(donky_conn *cur)
 {
-        struct request_list *r;
-        
+        struct donky_reactor *r = cur->owner;
+        struct request_list *req;
+        donky_conn **pp;
+
+        pthread_mutex_lock(&r->conn_lock);
         if (cur->prev)
                 cur->prev->next = cur->next;
         if (cur->next)
                 cur->next->prev = cur->prev;
-        if (cur == dc_start)
-                dc_start = cur->next;
-        if (cur == dc_end)
-                dc_end = cur->prev;
-
-        /* This was fdmax, so lets find the next fdmax. */
-        if (cur->sock == donky_fdmax)
-                donky_conn_set_fdmax();
+        if (cur == r->dc_start)
+                r->dc_start = cur->next;
+        if (cur == r->dc_end)
+                r->dc_end = cur->prev;
+        pthread_mutex_unlock(&r->conn_lock);
 
-        /* Remove from fd set and close the socket. */
-        FD_CLR(cur->sock, &donky_fds);
+        /* Stop watching and close the socket. */
+        event_del(r->events, cur->sock);
         close(cur->sock);
 
-        /* Remove any requests this connection might have. */
-        while ((r = request_list_find_by_conn(cur)))
-                request_list_remove(r);
+        donky_timer_del(cur);
+        if (!cur->is_listener)
+                donky_conn_release(cur->is_authed);
+
+        /* Remove any requests this connection might have.  After this the
+         * request handler can't get at us anymore. */
+        request_list_lock();
+        while ((req = request_list_find_by_conn(cur)))
+                request_list_remove(req);
+        relay_drop_conn(cur);
+        request_list_unlock();
+
+        /* Get off the flush list. */
+        pthread_mutex_lock(&r->dirty_lock);
+        for (pp = &r->dirty_start; *pp; pp = &(*pp)->dirty_next) {
+                if (*pp == cur) {
+                        *pp = cur->dirty_next;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&r->dirty_lock);
 
         /* Free some memorah! */
+        free(cur->in_buf);
+        donky_conn_free_queue(cur);
+        pthread_mutex_destroy(&cur->out_lock);
         free(cur);
 
         DEBUGF(("Dropped connection like a freakin' turd.\n"));
 }
 
 /**
- * @brief Find the largest sock file descriptor.
+ * @brief Call a function for every client connection on every reactor.
+ *        Each reactor's list is locked while it's walked, so the function
+ *        must not drop connections.
+ *
+ * @param func Function to call
+ * @param arg Passed along to func
  */
-static void donky_conn_set_fdmax(void)
+void donky_conn_foreach(void (*func)(donky_conn *, void *), void *arg)
 {
-        donky_conn *cur = dc_start;
+        donky_conn *cur;
+        int i;
 
-        donky_fdmax = -1;
+        for (i = 0; i < reactor_count; i++) {
+                pthread_mutex_lock(&reactors[i].conn_lock);
 
-        while (cur) {
-                if (cur->sock > donky_fdmax)
-                        donky_fdmax = cur->sock;
-                
-                cur = cur->next;
+                for (cur = reactors[i].dc_start; cur; cur = cur->next)
+                        if (!cur->is_listener)
+                                func(cur, arg);
+
+                pthread_mutex_unlock(&reactors[i].conn_lock);
         }
 }
 
 /**
- * @brief Clear the donky connections.
+ * @brief Clear the donky connections of a reactor.
+ *
+ * @param r Reactor
  */
-static void donky_conn_clear(void)
+static void donky_conn_clear(struct donky_reactor *r)
 {
-        donky_conn *cur = dc_start;
+        donky_conn *cur = r->dc_start;
         donky_conn *next;
 
         while (cur) {
                 next = cur->next;
 
                 close(cur->sock);
+                free(cur->in_buf);
+                donky_conn_free_queue(cur);
+                pthread_mutex_destroy(&cur->out_lock);
                 free(cur);
-                
+
                 cur = next;
         }
 
-        dc_start = NULL;
-        dc_end = NULL;
+        r->dc_start = NULL;
+        r->dc_end = NULL;
+        r->dirty_start = NULL;
+        memset(r->wheel, 0, sizeof(r->wheel));
+        r->wheel_count = 0;
+
+        client_count = 0;
+        unauthed_count = 0;
 }
 
 /**
- * @brief Start listening on the configured host and port.
+ * @brief Start listening on the configured host and port, and/or the
+ *        configured Unix socket.  Every reactor gets its own TCP listener
+ *        on the same port and the kernel spreads new connections over
+ *        them.  The Unix socket belongs to the first reactor.
+ *
+ * @return 0 on success, -1 if something we were told to open failed
  */
 static int donky_listen(void)
 {
         const char *host = get_char_key("daemon", "host", "0.0.0.0");
         int port = get_int_key("daemon", "port", 7000);
-        
-        donky_sock = create_tcp_listener(host, port);
+        const char *path = get_char_key("daemon", "unix_socket", NULL);
+        int packet = get_bool_key("daemon", "unix_seqpacket", 0);
+        int backlog = get_int_key("daemon", "listen_backlog",
+                                  DEFAULT_LISTEN_BACKLOG);
+        int sock;
+        int i;
+
+        donky_listen_describe(donky_listen_spec, sizeof(donky_listen_spec));
+
+        /* A port of 0 means Unix socket only. */
+        for (i = 0; port > 0 && i < reactor_count; i++) {
+                sock = create_tcp_listener(host, port, reactor_count > 1,
+                                           backlog);
+                if (donky_listener_add(&reactors[i], sock, 0) == -1)
+                        return -1;
+        }
+
+        if (path) {
+#ifdef SOCK_SEQPACKET
+                donky_unix_sock = create_unix_listener(path, (packet) ?
+                                                       SOCK_SEQPACKET :
+                                                       SOCK_STREAM,
+                                                       backlog);
+#else
+                if (packet)
+                        fprintf(stderr, "No SOCK_SEQPACKET here, "
+                                "using a stream socket.\n");
+                packet = 0;
+                donky_unix_sock = create_unix_listener(path, SOCK_STREAM,
+                                                       backlog);
+#endif
+                strfcpy(donky_unix_path, path, sizeof(donky_unix_path));
+                if (donky_listener_add(&reactors[0], donky_unix_sock,
+                                       packet) == -1)
+                        return -1;
+        }
+
+        if (port <= 0 && donky_unix_sock == -1) {
+                fprintf(stderr, "No port or unix_socket to listen on!\n");
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Add a listening socket to a reactor's connection list.
+ *
+ * @param r Reactor that accepts on it
+ * @param sock Listening socket
+ * @param is_packet Accepted connections use SOCK_SEQPACKET (bool)
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int donky_listener_add(struct donky_reactor *r, int sock, int is_packet)
+{
+        donky_conn *n;
+
+        if (sock == -1)
+                return -1;
+
+        sock_set_nonblock(sock, 1);
 
-        return donky_sock;
+        if ((n = donky_conn_add(r, sock)) == NULL) {
+                close(sock);
+                return -1;
+        }
+
+        n->is_listener = 1;
+        n->is_packet = is_packet;
+
+        return 0;
 }
 
 /**
@@ -290,7 +1796,41 @@ static int donky_listen(void)
  */
 static void clean_dis_shiz(void)
 {
+        int i;
+
         DEBUGF(("Cleaning up some daemon junk... ;[\n"));
-        donky_conn_clear();
-        FD_ZERO(&donky_fds);
+
+        /* The request handler, the relay and the other I/O threads queue onto
+         * connections, so they go first. */
+        donky_reactors_stop();
+        request_handler_stop();
+        sampler_stop();
+        pool_stop();
+        host_stop_all();
+        relay_stop();
+        metrics_stop();
+
+        for (i = 0; i < reactor_count; i++) {
+                donky_conn_clear(&reactors[i]);
+                event_loop_free(reactors[i].events);
+                pthread_mutex_destroy(&reactors[i].conn_lock);
+                pthread_mutex_destroy(&reactors[i].dirty_lock);
+        }
+
+        free(reactors);
+        reactors = NULL;
+        reactor_count = 0;
+
+        /* Request handler's gone, nobody's writing to it anymore. */
+        shm_close_table();
+
+        request_list_lock();
+        mcast_stop();
+        request_list_unlock();
+
+        /* Don't leave the socket file laying around. */
+        if (donky_unix_sock != -1) {
+                unlink(donky_unix_path);
+                donky_unix_sock = -1;
+        }
 }
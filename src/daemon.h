@@ -13,10 +13,61 @@
 #ifndef DAEMON_H
 #define DAEMON_H
 
+#include <pthread.h>
+#include <stddef.h>
+
+/* A formatted message waiting to go out on a connection. */
+struct donky_msg {
+        unsigned int id;        /* Subscription id, if keyed. */
+        int keyed;              /* bool, newer values for id replace this */
+        char *data;
+        size_t len;
+        size_t off;             /* How much of data has been sent. */
+        int is_sealed;          /* bool, don't replace, it's spoken for */
+
+        struct donky_msg *next;
+};
+
+struct donky_reactor;
+
 struct donky_conn_node {
         int sock;
+        struct donky_reactor *owner;    /* I/O thread this belongs to. */
 
+        int is_listener; /* bool */
+        int is_packet;  /* bool, SOCK_SEQPACKET, one message per update */
+        int is_binary;  /* bool, speaks the binary protocol */
         int is_authed; /* bool */
+        int is_closing; /* bool, drop once we're done reading */
+        int is_broken;  /* bool, drop next time the loop sees it */
+        int subs;       /* Requests on the request list. */
+
+        /* Timeouts, in seconds on the monotonic clock. */
+        unsigned long accepted;
+        unsigned long last_active;
+        unsigned long expires;  /* When the timer wheel looks at us next. */
+        int in_wheel;   /* bool */
+        struct donky_conn_node *wheel_next;
+        struct donky_conn_node *wheel_prev;
+
+        /* Input buffer, holds whatever we have of the current line(s). */
+        char *in_buf;
+        size_t in_len;
+        size_t in_size;
+
+        /* Output queue.  Anybody may append, only the owner sends. */
+        pthread_mutex_t out_lock;
+        struct donky_msg *out_start;
+        struct donky_msg *out_end;
+        unsigned int out_len;           /* Messages queued right now. */
+        unsigned int out_hwm;           /* Most messages ever queued. */
+        unsigned int out_keyed;         /* Values queued, none of it sent. */
+        size_t out_bytes;               /* Bytes of replies queued. */
+        unsigned long out_conflated;    /* Values replaced before sending. */
+        unsigned long out_writes;       /* Write calls made on the socket. */
+        int want_write; /* bool, waiting for the socket to drain */
+        int is_dirty;   /* bool, on the flush list */
+        struct donky_conn_node *dirty_next;
         
         struct donky_conn_node *next;
         struct donky_conn_node *prev;
@@ -25,6 +76,21 @@ struct donky_conn_node {
 typedef struct donky_conn_node donky_conn;
 
 void donky_loop(void);
+void donky_reconfigure(void);
 void donky_conn_drop(donky_conn *cur);
+void donky_conn_foreach(void (*func)(donky_conn *, void *), void *arg);
+void donky_tick_begin(void);
+void donky_tick_end(void);
+int donky_conn_send(donky_conn *cur, const char *format, ...);
+int donky_conn_update_str(donky_conn *cur,
+                          unsigned int id,
+                          int type,
+                          const char *str);
+int donky_conn_update_int(donky_conn *cur,
+                          unsigned int id,
+                          int type,
+                          unsigned long val);
+void donky_conn_set_binary(donky_conn *cur, int on);
+void donky_conn_authed(donky_conn *cur);
 
 #endif /* DAEMON_H */
@@ -0,0 +1,258 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "deadline.h"
+
+/* Function prototypes. */
+static void deadline_swap(struct deadline_heap *heap, int a, int b);
+static void deadline_up(struct deadline_heap *heap, int i);
+static void deadline_down(struct deadline_heap *heap, int i);
+
+/**
+ * @brief Put a node in the heap, or move it if it's already there.
+ *
+ * @param heap Heap
+ * @param n Node
+ * @param due When it's due
+ */
+void deadline_set(struct deadline_heap *heap, struct deadline *n, double due)
+{
+        double old = n->due;
+
+        n->due = due;
+
+        if (n->slot >= 0) {
+                if (due < old)
+                        deadline_up(heap, n->slot);
+                else
+                        deadline_down(heap, n->slot);
+                return;
+        }
+
+        if (heap->len == heap->size) {
+                heap->size = (heap->size) ? heap->size * 2 : 64;
+                heap->nodes = realloc(heap->nodes, heap->size *
+                                      sizeof(struct deadline *));
+        }
+
+        n->slot = heap->len;
+        heap->nodes[heap->len++] = n;
+        deadline_up(heap, n->slot);
+}
+
+/**
+ * @brief Take a node out of the heap.  Nodes that aren't in it are fine.
+ *
+ * @param heap Heap
+ * @param n Node
+ */
+void deadline_del(struct deadline_heap *heap, struct deadline *n)
+{
+        int i = n->slot;
+
+        if (i < 0)
+                return;
+
+        n->slot = -1;
+        heap->len--;
+
+        if (i == heap->len)
+                return;
+
+        /* Last one fills the hole, then goes wherever it belongs. */
+        heap->nodes[i] = heap->nodes[heap->len];
+        heap->nodes[i]->slot = i;
+        deadline_up(heap, i);
+        deadline_down(heap, heap->nodes[i]->slot);
+}
+
+/**
+ * @brief Soonest node, left in the heap.
+ *
+ * @param heap Heap
+ *
+ * @return Node, NULL if the heap is empty
+ */
+struct deadline *deadline_top(struct deadline_heap *heap)
+{
+        return (heap->len) ? heap->nodes[0] : NULL;
+}
+
+/**
+ * @brief Empty out a heap.  The nodes belong to somebody else.
+ *
+ * @param heap Heap
+ */
+void deadline_clear(struct deadline_heap *heap)
+{
+        int i;
+
+        for (i = 0; i < heap->len; i++)
+                heap->nodes[i]->slot = -1;
+
+        free(heap->nodes);
+        heap->nodes = NULL;
+        heap->len = 0;
+        heap->size = 0;
+}
+
+/**
+ * @brief Where in its period something should fire, so a pile of things
+ *        with the same timeout don't all go off at once.  It's a hash, so
+ *        the same variable lands in the same spot every time.
+ *
+ * @param name Variable name
+ * @param args Args, NULL for none
+ *
+ * @return Fraction of the period, 0 to just under 1
+ */
+double deadline_phase(const char *name, const char *args)
+{
+        unsigned long hash = 2166136261UL;
+
+        /* FNV-1a, good enough to scatter names around. */
+        while (*name)
+                hash = ((hash ^ (unsigned char) *name++) * 16777619UL) &
+                       0xffffffffUL;
+
+        if (args) {
+                hash = ((hash ^ ' ') * 16777619UL) & 0xffffffffUL;
+                while (*args)
+                        hash = ((hash ^ (unsigned char) *args++) *
+                                16777619UL) & 0xffffffffUL;
+        }
+
+        return (double) (hash & 0xffff) / 65536.0;
+}
+
+/**
+ * @brief Next deadline after now on a grid of period, shifted by phase.
+ *        Staying on the grid means a slow pass doesn't make it drift.
+ *
+ * @param now Current time
+ * @param period Period
+ * @param phase Fraction of the period, from deadline_phase()
+ *
+ * @return Deadline
+ */
+double deadline_next(double now, double period, double phase)
+{
+        double offset = phase * period;
+
+        return offset + period * (floor((now - offset) / period) + 1);
+}
+
+/**
+ * @brief Next time the wall clock is on a multiple of period, as a
+ *        monotonic deadline so it can go in a heap with the rest.  Just
+ *        after it, so a clock shows the second that just started.  It
+ *        only holds until somebody sets the clock.
+ *
+ * @param now Current CLOCK_MONOTONIC time
+ * @param wall Wall clock time at the same moment
+ * @param period Period
+ *
+ * @return Deadline
+ */
+double deadline_aligned(double now, double wall, double period)
+{
+        return now + period * (floor(wall / period) + 1) - wall +
+               DEADLINE_ALIGN_LATE;
+}
+
+/**
+ * @brief Push a deadline back onto a coarser grid, so deadlines that don't
+ *        mind waiting end up on the same instant and share a wakeup.  The
+ *        grid is the biggest power of two seconds that fits in slack, so
+ *        a coarse one always lands on the finer ones too.
+ *
+ * @param due Deadline
+ * @param slack How much later it may be, 0 for not at all
+ *
+ * @return Deadline, no earlier and no more than slack later
+ */
+double deadline_coalesce(double due, double slack)
+{
+        double grid;
+        int exp;
+
+        if (slack <= 0)
+                return due;
+
+        frexp(slack, &exp);
+        grid = ldexp(1.0, exp - 1);
+
+        return grid * ceil(due / grid);
+}
+
+/**
+ * @brief Swap two heap slots.
+ *
+ * @param heap Heap
+ * @param a Slot
+ * @param b Other slot
+ */
+static void deadline_swap(struct deadline_heap *heap, int a, int b)
+{
+        struct deadline *tmp = heap->nodes[a];
+
+        heap->nodes[a] = heap->nodes[b];
+        heap->nodes[b] = tmp;
+        heap->nodes[a]->slot = a;
+        heap->nodes[b]->slot = b;
+}
+
+/**
+ * @brief Move a node towards the top until its parent is sooner.
+ *
+ * @param heap Heap
+ * @param i Slot
+ */
+static void deadline_up(struct deadline_heap *heap, int i)
+{
+        int parent;
+
+        while (i > 0) {
+                parent = (i - 1) / 2;
+                if (heap->nodes[parent]->due <= heap->nodes[i]->due)
+                        break;
+
+                deadline_swap(heap, i, parent);
+                i = parent;
+        }
+}
+
+/**
+ * @brief Move a node towards the bottom until its children are later.
+ *
+ * @param heap Heap
+ * @param i Slot
+ */
+static void deadline_down(struct deadline_heap *heap, int i)
+{
+        int child;
+
+        while ((child = i * 2 + 1) < heap->len) {
+                if (child + 1 < heap->len &&
+                    heap->nodes[child + 1]->due < heap->nodes[child]->due)
+                        child++;
+
+                if (heap->nodes[i]->due <= heap->nodes[child]->due)
+                        break;
+
+                deadline_swap(heap, i, child);
+                i = child;
+        }
+}
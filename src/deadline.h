@@ -0,0 +1,45 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+/**
+ * Something with a deadline.  It lives inside whatever owns it, and knows
+ * where it is in the heap so it can be moved or taken out without a search.
+ */
+#define DEADLINE_ALIGN_LATE 0.001 /* Aligned ones go this long after */
+
+struct deadline {
+        double due;             /* CLOCK_MONOTONIC seconds */
+        int slot;               /* Index in the heap, -1 for not in one */
+};
+
+/**
+ * Min-heap of deadlines, soonest on top.
+ */
+struct deadline_heap {
+        struct deadline **nodes;
+        int len;
+        int size;
+};
+
+void deadline_set(struct deadline_heap *heap, struct deadline *n, double due);
+void deadline_del(struct deadline_heap *heap, struct deadline *n);
+struct deadline *deadline_top(struct deadline_heap *heap);
+void deadline_clear(struct deadline_heap *heap);
+double deadline_phase(const char *name, const char *args);
+double deadline_next(double now, double period, double phase);
+double deadline_aligned(double now, double wall, double period);
+double deadline_coalesce(double due, double slack);
+
+#endif /* DEADLINE_H */
@@ -11,5 +11,20 @@
  */
 
 #define DEFAULT_GLOBAL_SLEEP 1.0
+#define DEFAULT_SLACK 0.1               /* of the period, in low_wakeup */
+#define DEFAULT_TIMER_SLACK 0.05        /* seconds, in low_wakeup */
+#define DEFAULT_LOW_WAKEUP_SLEEP 60.0   /* longest sleep in low_wakeup */
+#define DEFAULT_SEND_QUEUE 1024
+#define DEFAULT_SEND_BUFFER 1048576  /* bytes of replies per client */
+#define DEFAULT_MAX_LINE 4096
+#define DEFAULT_IO_THREADS 1
+#define DEFAULT_WORKERS 4
+#define DEFAULT_DEADLINE 30.0           /* seconds, 0 means forever */
+#define DEFAULT_QUARANTINE 5.0          /* seconds, doubles each time */
+#define DEFAULT_LISTEN_BACKLOG 128
+#define DEFAULT_MAX_CLIENTS 0           /* 0 means no limit */
+#define DEFAULT_MAX_UNAUTHED 32
+#define DEFAULT_AUTH_TIMEOUT 10         /* seconds */
+#define DEFAULT_IDLE_TIMEOUT 300        /* seconds */
 #define DEFAULT_CONF ".donkyrc"
 #define DEFAULT_CONF_GLOBAL "donky.conf"
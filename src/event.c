@@ -0,0 +1,472 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../config.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <sys/select.h>
+#include <sys/time.h>
+#endif
+
+#include "event.h"
+
+/* Function prototypes. */
+static int event_wake_open(int *wake);
+static void event_wake_drain(int fd);
+
+/**
+ * @brief Open a non-blocking self-pipe used to kick a sleeping loop.
+ *
+ * @param wake Two element array, read end first
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int event_wake_open(int *wake)
+{
+        if (pipe(wake) == -1) {
+                perror("pipe");
+                return -1;
+        }
+
+        fcntl(wake[0], F_SETFL, fcntl(wake[0], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(wake[1], F_SETFL, fcntl(wake[1], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(wake[0], F_SETFD, FD_CLOEXEC);
+        fcntl(wake[1], F_SETFD, FD_CLOEXEC);
+
+        return 0;
+}
+
+/**
+ * @brief Empty out the self-pipe.
+ *
+ * @param fd Read end of the pipe
+ */
+static void event_wake_drain(int fd)
+{
+        char buf[64];
+
+        while (read(fd, buf, sizeof(buf)) > 0)
+                ;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/**
+ * epoll backend.  The caller's pointer lives in the epoll data, so a ready
+ * event goes straight to its owner without any lookups.
+ */
+struct event_loop {
+        int epfd;
+        struct epoll_event *events;
+        int nevents;
+        int wake[2];    /* Self-pipe for event_wake() */
+};
+
+/**
+ * @brief Translate EVENT_* flags into epoll flags.
+ *
+ * @param mask EVENT_* flags
+ *
+ * @return Edge-triggered epoll flags
+ */
+static unsigned int event_to_epoll(int mask)
+{
+        unsigned int ev = EPOLLET;
+
+        if (mask & EVENT_READ)
+                ev |= EPOLLIN | EPOLLRDHUP;
+        if (mask & EVENT_WRITE)
+                ev |= EPOLLOUT;
+
+        return ev;
+}
+
+/**
+ * @brief Create a new event loop.
+ *
+ * @return Event loop, or NULL on failure
+ */
+struct event_loop *event_loop_new(void)
+{
+        struct event_loop *el = malloc(sizeof(struct event_loop));
+
+        if (el == NULL)
+                return NULL;
+
+        el->wake[0] = el->wake[1] = -1;
+
+        if ((el->epfd = epoll_create(64)) == -1) {
+                perror("epoll_create");
+                free(el);
+                return NULL;
+        }
+
+        el->nevents = 64;
+        el->events = malloc(el->nevents * sizeof(struct epoll_event));
+
+        /* The loop itself is the data pointer for its self-pipe. */
+        if (event_wake_open(el->wake) == -1 ||
+            event_add(el, el->wake[0], EVENT_READ, el) == -1) {
+                event_loop_free(el);
+                return NULL;
+        }
+
+        return el;
+}
+
+/**
+ * @brief Destroy an event loop.  Registered descriptors are not closed.
+ *
+ * @param el Event loop
+ */
+void event_loop_free(struct event_loop *el)
+{
+        if (el == NULL)
+                return;
+
+        close(el->epfd);
+        if (el->wake[0] != -1) {
+                close(el->wake[0]);
+                close(el->wake[1]);
+        }
+        free(el->events);
+        free(el);
+}
+
+/**
+ * @brief Start watching a descriptor.
+ *
+ * @param el Event loop
+ * @param fd Descriptor
+ * @param mask EVENT_* flags we're interested in
+ * @param data Pointer handed back when this descriptor fires
+ *
+ * @return 0 on success, -1 on failure
+ */
+int event_add(struct event_loop *el, int fd, int mask, void *data)
+{
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = event_to_epoll(mask);
+        ev.data.ptr = data;
+
+        if (epoll_ctl(el->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+                perror("epoll_ctl");
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Change what we are watching a descriptor for.
+ *
+ * @param el Event loop
+ * @param fd Descriptor
+ * @param mask EVENT_* flags we're interested in
+ * @param data Pointer handed back when this descriptor fires
+ *
+ * @return 0 on success, -1 on failure
+ */
+int event_mod(struct event_loop *el, int fd, int mask, void *data)
+{
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = event_to_epoll(mask);
+        ev.data.ptr = data;
+
+        if (epoll_ctl(el->epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+                perror("epoll_ctl");
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Stop watching a descriptor.
+ *
+ * @param el Event loop
+ * @param fd Descriptor
+ */
+void event_del(struct event_loop *el, int fd)
+{
+        struct epoll_event ev;
+
+        /* Pre 2.6.9 kernels want a non-NULL event here. */
+        memset(&ev, 0, sizeof(ev));
+        epoll_ctl(el->epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+/**
+ * @brief Wait for some descriptors to become ready.
+ *
+ * @param el Event loop
+ * @param fired Array to fill with ready descriptors
+ * @param max Size of the fired array
+ * @param timeout Milliseconds to wait, -1 for forever
+ *
+ * @return Number of fired events, 0 on timeout, -1 on error (errno is set)
+ */
+int event_wait(struct event_loop *el,
+               struct event_fired *fired,
+               int max,
+               int timeout)
+{
+        int n;
+        int i;
+        int j;
+        unsigned int ev;
+
+        if (max > el->nevents) {
+                el->nevents = max;
+                el->events = realloc(el->events,
+                                     max * sizeof(struct epoll_event));
+        }
+
+        n = epoll_wait(el->epfd, el->events, max, timeout);
+
+        for (i = 0, j = 0; i < n; i++) {
+                ev = el->events[i].events;
+
+                /* Just a wake up, nothing to hand back. */
+                if (el->events[i].data.ptr == el) {
+                        event_wake_drain(el->wake[0]);
+                        continue;
+                }
+
+                fired[j].data = el->events[i].data.ptr;
+                fired[j].mask = 0;
+
+                if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                        fired[j].mask |= EVENT_READ;
+                if (ev & EPOLLOUT)
+                        fired[j].mask |= EVENT_WRITE;
+                if (ev & (EPOLLHUP | EPOLLERR))
+                        fired[j].mask |= EVENT_ERROR;
+                j++;
+        }
+
+        return (n == -1) ? -1 : j;
+}
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+/**
+ * select() backend for the BSDs.  Level-triggered and capped at FD_SETSIZE,
+ * but it keeps the same interface.
+ */
+struct event_loop {
+        fd_set rfds;
+        fd_set wfds;
+        int fdmax;
+        int masks[FD_SETSIZE];
+        void *data[FD_SETSIZE];
+        int wake[2];    /* Self-pipe for event_wake() */
+};
+
+/**
+ * @brief Create a new event loop.
+ *
+ * @return Event loop, or NULL on failure
+ */
+struct event_loop *event_loop_new(void)
+{
+        struct event_loop *el = calloc(1, sizeof(struct event_loop));
+
+        if (el == NULL)
+                return NULL;
+
+        FD_ZERO(&el->rfds);
+        FD_ZERO(&el->wfds);
+        el->fdmax = -1;
+
+        /* The loop itself is the data pointer for its self-pipe. */
+        if (event_wake_open(el->wake) == -1) {
+                free(el);
+                return NULL;
+        }
+        event_add(el, el->wake[0], EVENT_READ, el);
+
+        return el;
+}
+
+/**
+ * @brief Destroy an event loop.  Registered descriptors are not closed.
+ *
+ * @param el Event loop
+ */
+void event_loop_free(struct event_loop *el)
+{
+        if (el == NULL)
+                return;
+
+        close(el->wake[0]);
+        close(el->wake[1]);
+        free(el);
+}
+
+/**
+ * @brief Start watching a descriptor.
+ *
+ * @param el Event loop
+ * @param fd Descriptor
+ * @param mask EVENT_* flags we're interested in
+ * @param data Pointer handed back when this descriptor fires
+ *
+ * @return 0 on success, -1 on failure
+ */
+int event_add(struct event_loop *el, int fd, int mask, void *data)
+{
+        if (fd < 0 || fd >= FD_SETSIZE) {
+                fprintf(stderr, "event_add: fd %d is over FD_SETSIZE\n", fd);
+                return -1;
+        }
+
+        if (fd > el->fdmax)
+                el->fdmax = fd;
+
+        return event_mod(el, fd, mask, data);
+}
+
+/**
+ * @brief Change what we are watching a descriptor for.
+ *
+ * @param el Event loop
+ * @param fd Descriptor
+ * @param mask EVENT_* flags we're interested in
+ * @param data Pointer handed back when this descriptor fires
+ *
+ * @return 0 on success, -1 on failure
+ */
+int event_mod(struct event_loop *el, int fd, int mask, void *data)
+{
+        if (fd < 0 || fd >= FD_SETSIZE)
+                return -1;
+
+        el->masks[fd] = mask;
+        el->data[fd] = data;
+
+        if (mask & EVENT_READ)
+                FD_SET(fd, &el->rfds);
+        else
+                FD_CLR(fd, &el->rfds);
+
+        if (mask & EVENT_WRITE)
+                FD_SET(fd, &el->wfds);
+        else
+                FD_CLR(fd, &el->wfds);
+
+        return 0;
+}
+
+/**
+ * @brief Stop watching a descriptor.
+ *
+ * @param el Event loop
+ * @param fd Descriptor
+ */
+void event_del(struct event_loop *el, int fd)
+{
+        if (fd < 0 || fd >= FD_SETSIZE)
+                return;
+
+        FD_CLR(fd, &el->rfds);
+        FD_CLR(fd, &el->wfds);
+        el->masks[fd] = 0;
+        el->data[fd] = NULL;
+
+        /* This was fdmax, so lets find the next fdmax. */
+        if (fd == el->fdmax)
+                while (el->fdmax >= 0 && el->masks[el->fdmax] == 0)
+                        el->fdmax--;
+}
+
+/**
+ * @brief Wait for some descriptors to become ready.
+ *
+ * @param el Event loop
+ * @param fired Array to fill with ready descriptors
+ * @param max Size of the fired array
+ * @param timeout Milliseconds to wait, -1 for forever
+ *
+ * @return Number of fired events, 0 on timeout, -1 on error (errno is set)
+ */
+int event_wait(struct event_loop *el,
+               struct event_fired *fired,
+               int max,
+               int timeout)
+{
+        fd_set rfds = el->rfds;
+        fd_set wfds = el->wfds;
+        struct timeval tv;
+        int fd;
+        int n;
+
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+
+        if (select(el->fdmax + 1, &rfds, &wfds, NULL,
+                   (timeout < 0) ? NULL : &tv) == -1)
+                return -1;
+
+        for (n = 0, fd = 0; fd <= el->fdmax && n < max; fd++) {
+                fired[n].mask = 0;
+
+                if (FD_ISSET(fd, &rfds))
+                        fired[n].mask |= EVENT_READ;
+                if (FD_ISSET(fd, &wfds))
+                        fired[n].mask |= EVENT_WRITE;
+
+                if (fired[n].mask == 0)
+                        continue;
+
+                /* Just a wake up, nothing to hand back. */
+                if (el->data[fd] == el) {
+                        event_wake_drain(el->wake[0]);
+                        continue;
+                }
+
+                fired[n].data = el->data[fd];
+                n++;
+        }
+
+        return n;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
+
+/**
+ * @brief Wake up a loop blocked in event_wait().  Safe to call from any
+ *        thread, and a bunch of wakes before the loop gets around to it
+ *        collapse into one.
+ *
+ * @param el Event loop
+ */
+void event_wake(struct event_loop *el)
+{
+        char c = 0;
+
+        /* A full pipe means a wake is already pending. */
+        if (write(el->wake[1], &c, 1) == -1)
+                return;
+}
@@ -0,0 +1,45 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "../config.h"
+
+#define EVENT_READ  1   /* Descriptor is readable (or hung up). */
+#define EVENT_WRITE 2   /* Descriptor is writable. */
+#define EVENT_ERROR 4   /* Error or hang up condition. */
+
+/**
+ * Readiness is reported edge-triggered when epoll is available, so whoever
+ * handles an event must read/write/accept until EAGAIN.  The select()
+ * fallback is level-triggered, which is fine with that same rule.
+ */
+struct event_fired {
+        void *data;     /* Pointer handed to event_add(). */
+        int mask;       /* EVENT_* flags that fired. */
+};
+
+struct event_loop;
+
+struct event_loop *event_loop_new(void);
+void event_loop_free(struct event_loop *el);
+int event_add(struct event_loop *el, int fd, int mask, void *data);
+int event_mod(struct event_loop *el, int fd, int mask, void *data);
+void event_del(struct event_loop *el, int fd);
+void event_wake(struct event_loop *el);
+int event_wait(struct event_loop *el,
+               struct event_fired *fired,
+               int max,
+               int timeout);
+
+#endif /* EVENT_H */
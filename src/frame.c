@@ -0,0 +1,177 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame.h"
+
+/* Function prototypes. */
+static char *frame_update(int tag,
+                          unsigned int id,
+                          int type,
+                          const unsigned char *data,
+                          size_t dlen,
+                          size_t *len);
+
+/**
+ * @brief Write a varint.
+ *
+ * @param buf Where to write, at least FRAME_VARINT_MAX bytes
+ * @param v Value
+ *
+ * @return Bytes written
+ */
+size_t frame_varint(unsigned char *buf, unsigned long v)
+{
+        size_t n = 0;
+
+        while (v >= 0x80) {
+                buf[n++] = (v & 0x7f) | 0x80;
+                v >>= 7;
+        }
+        buf[n++] = v;
+
+        return n;
+}
+
+/**
+ * @brief Write the length and tag that start a frame.
+ *
+ * @param buf Where to write, at least FRAME_HEADER_MAX bytes
+ * @param tag FRAME_* tag
+ * @param len Payload length, not counting the tag
+ *
+ * @return Bytes written
+ */
+size_t frame_header(unsigned char *buf, int tag, size_t len)
+{
+        size_t n = frame_varint(buf, len + 1);
+
+        buf[n++] = tag;
+
+        return n;
+}
+
+/**
+ * @brief Build a text frame, for replies that have no binary form.
+ *
+ * @param str Text, no \r\n
+ * @param slen Length of str
+ * @param len Set to the frame length
+ *
+ * @return Malloc'd frame
+ */
+char *frame_text(const char *str, size_t slen, size_t *len)
+{
+        unsigned char *buf = malloc(FRAME_HEADER_MAX + slen);
+        size_t n;
+
+        n = frame_header(buf, FRAME_TEXT, slen);
+        memcpy(buf + n, str, slen);
+        *len = n + slen;
+
+        return (char *) buf;
+}
+
+/**
+ * @brief Build a string variable update.
+ *
+ * @param id Subscription id
+ * @param type Variable type
+ * @param str Value
+ * @param len Set to the frame length
+ *
+ * @return Malloc'd frame
+ */
+char *frame_str(unsigned int id, int type, const char *str, size_t *len)
+{
+        return frame_update(FRAME_STR, id, type, (const unsigned char *) str,
+                            strlen(str), len);
+}
+
+/**
+ * @brief Build an unsigned integer variable update.
+ *
+ * @param id Subscription id
+ * @param type Variable type
+ * @param v Value
+ * @param len Set to the frame length
+ *
+ * @return Malloc'd frame
+ */
+char *frame_u64(unsigned int id, int type, unsigned long v, size_t *len)
+{
+        unsigned char data[8];
+        int i;
+
+        /* unsigned long might only be 32 bits, the top just stays 0. */
+        for (i = 0; i < 8; i++) {
+                data[i] = v & 0xff;
+                v >>= 8;
+        }
+
+        return frame_update(FRAME_U64, id, type, data, 8, len);
+}
+
+/**
+ * @brief Build a frame saying which variable an id is.
+ *
+ * @param id Subscription id
+ * @param type Variable type
+ * @param name Variable name, then a space and the args if it has any
+ * @param len Set to the frame length
+ *
+ * @return Malloc'd frame
+ */
+char *frame_name(unsigned int id, int type, const char *name, size_t *len)
+{
+        return frame_update(FRAME_NAME, id, type, (const unsigned char *) name,
+                            strlen(name), len);
+}
+
+/**
+ * @brief Build a variable update frame.
+ *
+ * @param tag FRAME_STR, FRAME_U64 or FRAME_NAME
+ * @param id Subscription id
+ * @param type Variable type
+ * @param data Encoded value
+ * @param dlen Length of data
+ * @param len Set to the frame length
+ *
+ * @return Malloc'd frame
+ */
+static char *frame_update(int tag,
+                          unsigned int id,
+                          int type,
+                          const unsigned char *data,
+                          size_t dlen,
+                          size_t *len)
+{
+        unsigned char ids[FRAME_VARINT_MAX * 2];
+        unsigned char *buf;
+        size_t ilen;
+        size_t n;
+
+        ilen = frame_varint(ids, id);
+        ilen += frame_varint(ids + ilen, type);
+
+        buf = malloc(FRAME_HEADER_MAX + ilen + dlen);
+        n = frame_header(buf, tag, ilen + dlen);
+        memcpy(buf + n, ids, ilen);
+        memcpy(buf + n + ilen, data, dlen);
+        *len = n + ilen + dlen;
+
+        return (char *) buf;
+}
+
@@ -0,0 +1,42 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+
+/**
+ * Binary protocol frames.  Every frame is a varint length, followed by that
+ * many bytes: a one byte tag and the payload.  Varints are little endian
+ * base 128, low 7 bits first, high bit set on every byte but the last.
+ */
+#define FRAME_TEXT   0  /* Text protocol line without the \r\n */
+#define FRAME_STR    1  /* varint id, varint type, string bytes */
+#define FRAME_U64    2  /* varint id, varint type, 8 byte LE unsigned */
+#define FRAME_BATCH  4  /* Any number of complete frames back to back */
+#define FRAME_NAME   5  /* varint id, varint type, "var args" (multicast) */
+
+/* Longest varint we'll write, enough for 64 bits. */
+#define FRAME_VARINT_MAX 10
+
+/* Room for a frame's length and tag. */
+#define FRAME_HEADER_MAX (FRAME_VARINT_MAX + 1)
+
+size_t frame_varint(unsigned char *buf, unsigned long v);
+size_t frame_header(unsigned char *buf, int tag, size_t len);
+char *frame_text(const char *str, size_t slen, size_t *len);
+char *frame_str(unsigned int id, int type, const char *str, size_t *len);
+char *frame_u64(unsigned int id, int type, unsigned long v, size_t *len);
+char *frame_name(unsigned int id, int type, const char *name, size_t *len);
+
+#endif /* FRAME_H */
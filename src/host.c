@@ -0,0 +1,834 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../config.h"
+#include "cfg.h"
+#include "host.h"
+#include "mem.h"
+#include "module.h"
+#include "util.h"
+
+/**
+ * Isolated modules run in a copy of donky started with --module-host, one
+ * per isolate = group.  We write a command line down a socketpair and it
+ * writes reply lines back:
+ *
+ *   load <path>         module <name>, var <name> <method> <timeout> <type>
+ *                       for each of its variables, then ok (or err)
+ *   call <var>[ <args>] s <length> with the string in the shared area,
+ *                       i <number>, or err
+ *   cron <var>          ok or err
+ *
+ * Fields are split by tabs, and args is the rest of the line.  Strings come
+ * back through a file we both have mapped, so it's the same one copy into
+ * the evaluation as a module loaded right in here costs.
+ */
+
+/* Globals. */
+extern struct module_var *mv_start;
+static struct module_host *host_start = NULL;
+static char host_self[MAXPATHLEN];
+
+/* Function prototypes. */
+static struct module_host *host_get(const char *group);
+static int host_spawn(struct module_host *h);
+static int host_ensure(struct module_host *h);
+static int host_load(struct module_host *h, const char *path, int announce);
+static void host_reap(struct module_host *h);
+static void host_down(struct module_host *h);
+static int host_send(struct module_host *h, const char *buf, size_t len);
+static int host_read_line(struct module_host *h,
+                          char *line,
+                          size_t size,
+                          int timeout);
+static char *host_next(char *s);
+static void host_serve_load(FILE *out, char *path);
+static void host_serve_call(FILE *out, char *area, char *name, char *args);
+
+/**
+ * @brief Remember where our own binary is, so hosts can be started from
+ *        it.  /proc/self/exe if we can, whatever we were started as if not.
+ *
+ * @param argv0 argv[0]
+ */
+void host_set_self(const char *argv0)
+{
+        ssize_t len;
+
+        len = readlink("/proc/self/exe", host_self, sizeof(host_self) - 1);
+
+        if (len > 0)
+                host_self[len] = '\0';
+        else
+                strfcpy(host_self, argv0, sizeof(host_self));
+}
+
+/**
+ * @brief See if a module is to be kept out of donky.  isolate = <group> in
+ *        its section puts it in that group's host, isolate = yes gives it
+ *        one of its own.
+ *
+ * @param name Module's section name
+ *
+ * @return Group name, NULL if it gets loaded in here like usual
+ */
+const char *host_isolated(const char *name)
+{
+        const char *group = get_char_key(name, "isolate", NULL);
+
+        if (group == NULL || *group == '\0' ||
+            !strcasecmp(group, "no") || !strcasecmp(group, "false") ||
+            !strcmp(group, "0"))
+                return NULL;
+
+        if (!strcasecmp(group, "yes") || !strcasecmp(group, "true") ||
+            !strcmp(group, "1"))
+                return name;
+
+        return group;
+}
+
+/**
+ * @brief Load a module in its group's host and register the variables it
+ *        has over here.  Starts the host if it isn't already.
+ *
+ * @param path Path to the module
+ * @param group Host group
+ *
+ * @return 1 for success, 0 for failure
+ */
+int host_register(const char *path, const char *group)
+{
+        struct module_host *h;
+        int ret;
+
+        h = host_get(group);
+
+        if (h->npaths == HOST_MAX_MODULES) {
+                fprintf(stderr, "%s: Host %s is full, skipping!\n",
+                        path, h->name);
+                return 0;
+        }
+
+        if (h->pid == -1 && host_spawn(h) == -1) {
+                fprintf(stderr, "%s: Couldn't start host %s!\n",
+                        path, h->name);
+                return 0;
+        }
+
+        if ((ret = host_load(h, path, 1))) {
+                fprintf(stderr, "%s: Host %s couldn't load it!\n",
+                        path, h->name);
+
+                /* Don't leave it half way through something. */
+                if (ret == -1)
+                        host_reap(h);
+
+                return 0;
+        }
+
+        h->paths[h->npaths++] = strdup(path);
+
+        return 1;
+}
+
+/**
+ * @brief Call a variable's method in its host, on a worker.  A hung call
+ *        comes back once host_kill() has killed the host.
+ *
+ * @param h Host
+ * @param mv Module var
+ * @param args Arguments, NULL for none
+ * @param str Where STR results get copied, realloc'd to fit
+ * @param size Size of *str
+ * @param num Where BAR and GRAPH results go
+ *
+ * @return 0 on success, -1 if there's nothing to show for it
+ */
+int host_call(struct module_host *h,
+              struct module_var *mv,
+              const char *args,
+              char **str,
+              size_t *size,
+              unsigned int *num)
+{
+        char line[HOST_MAX_LINE];
+        size_t len;
+        int n;
+        int ret = -1;
+
+        pthread_mutex_lock(&h->lock);
+
+        if (args)
+                n = snprintf(line, sizeof(line), "call\t%s\t%s\n",
+                             mv->name, args);
+        else
+                n = snprintf(line, sizeof(line), "call\t%s\n", mv->name);
+
+        if (n < 0 || (size_t) n >= sizeof(line) || host_ensure(h) == -1) {
+                /* Nothing to do with the host itself. */
+        } else if (host_send(h, line, n) == -1 ||
+                   host_read_line(h, line, sizeof(line), -1) == -1) {
+                host_down(h);
+        } else if (!strncmp(line, "s\t", 2)) {
+                len = strtoul(line + 2, NULL, 10);
+
+                if (len < HOST_AREA_SIZE) {
+                        if (len + 1 > *size) {
+                                *size = len + 1;
+                                *str = realloc(*str, *size);
+                        }
+                        memcpy(*str, h->area, len);
+                        (*str)[len] = '\0';
+                        ret = 0;
+                } else {
+                        host_down(h);
+                }
+        } else if (!strncmp(line, "i\t", 2)) {
+                *num = strtoul(line + 2, NULL, 10);
+                ret = 0;
+        }
+
+        pthread_mutex_unlock(&h->lock);
+
+        return ret;
+}
+
+/**
+ * @brief Run a cron job in its host, on a worker.
+ *
+ * @param h Host
+ * @param mv Module var of the cron
+ *
+ * @return 0 on success, -1 on failure
+ */
+int host_cron(struct module_host *h, struct module_var *mv)
+{
+        char line[HOST_MAX_LINE];
+        int n;
+        int ret = -1;
+
+        pthread_mutex_lock(&h->lock);
+
+        n = snprintf(line, sizeof(line), "cron\t%s\n", mv->name);
+
+        if (host_ensure(h) == -1) {
+                /* Still waiting to come back. */
+        } else if (host_send(h, line, n) == -1 ||
+                   host_read_line(h, line, sizeof(line), -1) == -1) {
+                host_down(h);
+        } else if (!strcmp(line, "ok")) {
+                ret = 0;
+        }
+
+        pthread_mutex_unlock(&h->lock);
+
+        return ret;
+}
+
+/**
+ * @brief Stop a host so it starts over with a freshly parsed config the
+ *        next time it's needed.  Left alone if it's in the middle of a call.
+ *
+ * @param h Host
+ */
+void host_restart(struct module_host *h)
+{
+        if (pthread_mutex_trylock(&h->lock)) {
+                fprintf(stderr, "Host %s: Stuck in a hung call, not "
+                        "restarting it.\n", h->name);
+                return;
+        }
+
+        DEBUGF(("Restarting host %s.\n", h->name));
+
+        host_reap(h);
+        h->backoff = 0;
+        h->restart_at = 0;
+
+        pthread_mutex_unlock(&h->lock);
+}
+
+/**
+ * @brief A call in a host blew its deadline.  Kill the host, so the worker
+ *        stuck waiting on it gets an error and cleans up after it like any
+ *        other crash.  If nobody's in a call anymore it's too late to
+ *        matter, and it's left alone.
+ *
+ * @param h Host
+ */
+void host_kill(struct module_host *h)
+{
+        if (pthread_mutex_trylock(&h->lock) == 0) {
+                pthread_mutex_unlock(&h->lock);
+                return;
+        }
+
+        /* It can't be reaped while the caller has the lock. */
+        if (h->pid != -1)
+                kill(h->pid, SIGKILL);
+}
+
+/**
+ * @brief Stop every host.  Call once the workers are gone.  The nodes stay
+ *        around for the next round of module_load_all.
+ */
+void host_stop_all(void)
+{
+        struct module_host *h;
+        int i;
+
+        for (h = host_start; h; h = h->next) {
+                /* A hung worker still has it, killing it is all we can do. */
+                if (pthread_mutex_trylock(&h->lock)) {
+                        if (h->pid != -1)
+                                kill(h->pid, SIGKILL);
+                        continue;
+                }
+
+                host_reap(h);
+
+                for (i = 0; i < h->npaths; i++)
+                        free(h->paths[i]);
+
+                h->npaths = 0;
+                h->backoff = 0;
+                h->restart_at = 0;
+
+                pthread_mutex_unlock(&h->lock);
+        }
+}
+
+/**
+ * @brief Find a group's host, adding it if it's new.
+ *
+ * @param group Host group
+ *
+ * @return Host
+ */
+static struct module_host *host_get(const char *group)
+{
+        struct module_host *h;
+
+        for (h = host_start; h; h = h->next)
+                if (!strcmp(h->name, group))
+                        return h;
+
+        h = malloc(sizeof(struct module_host));
+
+        strfcpy(h->name, group, sizeof(h->name));
+        h->pid = -1;
+        h->sock = -1;
+        h->area = NULL;
+        h->in_len = 0;
+        h->npaths = 0;
+        h->started = 0;
+        h->backoff = 0;
+        h->restart_at = 0;
+        pthread_mutex_init(&h->lock, NULL);
+
+        h->next = host_start;
+        host_start = h;
+
+        return h;
+}
+
+/**
+ * @brief Start a host process.  Everything it needs is set up before the
+ *        fork, since only exec is safe in the child of a threaded program.
+ *
+ * @param h Host
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int host_spawn(struct module_host *h)
+{
+        char path[] = "/tmp/donky-host-XXXXXX";
+        char *argv[3];
+        int sv[2];
+        int area_fd;
+        int sock_fd;
+        int fd;
+        long max;
+        pid_t pid;
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+                perror("socketpair");
+                return -1;
+        }
+
+        if ((fd = mkstemp(path)) == -1) {
+                perror("mkstemp");
+                close(sv[0]);
+                close(sv[1]);
+                return -1;
+        }
+
+        /* Nobody else needs to see it. */
+        unlink(path);
+
+        /* Keep the child's ends clear of the numbers they're dup2'd to. */
+        area_fd = fcntl(fd, F_DUPFD, HOST_AREA_FD + 1);
+        sock_fd = fcntl(sv[1], F_DUPFD, HOST_AREA_FD + 1);
+        close(fd);
+        close(sv[1]);
+
+        if (area_fd == -1 || sock_fd == -1 ||
+            ftruncate(area_fd, HOST_AREA_SIZE) == -1 ||
+            (h->area = mmap(NULL, HOST_AREA_SIZE, PROT_READ, MAP_SHARED,
+                            area_fd, 0)) == MAP_FAILED) {
+                perror("host_spawn");
+                h->area = NULL;
+                close(sv[0]);
+                if (area_fd != -1)
+                        close(area_fd);
+                if (sock_fd != -1)
+                        close(sock_fd);
+                return -1;
+        }
+
+        argv[0] = host_self;
+        argv[1] = "--module-host";
+        argv[2] = NULL;
+
+        if ((max = sysconf(_SC_OPEN_MAX)) < 0 || max > 65536)
+                max = 65536;
+
+        if ((pid = fork()) == 0) {
+                dup2(sock_fd, HOST_SOCK_FD);
+                dup2(area_fd, HOST_AREA_FD);
+
+                /* Our listeners and clients are none of its business. */
+                for (fd = HOST_AREA_FD + 1; fd < max; fd++)
+                        close(fd);
+
+                execv(host_self, argv);
+                _exit(127);
+        }
+
+        close(sock_fd);
+        close(area_fd);
+
+        if (pid == -1) {
+                perror("fork");
+                munmap(h->area, HOST_AREA_SIZE);
+                h->area = NULL;
+                close(sv[0]);
+                return -1;
+        }
+
+        DEBUGF(("Started host %s as %d.\n", h->name, (int) pid));
+
+        h->pid = pid;
+        h->sock = sv[0];
+        h->in_len = 0;
+        h->started = get_mono_time();
+
+        return 0;
+}
+
+/**
+ * @brief Make sure a host is up, starting it again with its modules if it
+ *        went away and has waited long enough.  Call with its lock held.
+ *
+ * @param h Host
+ *
+ * @return 0 if it's up, -1 if not
+ */
+static int host_ensure(struct module_host *h)
+{
+        int i;
+
+        if (h->pid != -1)
+                return 0;
+
+        if (get_mono_time() < h->restart_at || host_spawn(h) == -1)
+                return -1;
+
+        for (i = 0; i < h->npaths; i++) {
+                /* One that stopped loading just stays offline. */
+                if (host_load(h, h->paths[i], 0) == -1) {
+                        host_down(h);
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Have a host load a module.
+ *
+ * @param h Host
+ * @param path Path to the module
+ * @param announce Register the module and its variables over here (bool)
+ *
+ * @return 0 on success, 1 if the module wouldn't load, -1 if the host
+ *         is in trouble
+ */
+static int host_load(struct module_host *h, const char *path, int announce)
+{
+        char line[HOST_MAX_LINE];
+        struct module *m = NULL;
+        char *name;
+        char *method;
+        char *timeout;
+        char *type;
+        char *align;
+        int n;
+
+        n = snprintf(line, sizeof(line), "load\t%s\n", path);
+        if (n < 0 || (size_t) n >= sizeof(line) ||
+            host_send(h, line, n) == -1)
+                return -1;
+
+        while (host_read_line(h, line, sizeof(line), HOST_LOAD_TIMEOUT) == 0) {
+                if (!strcmp(line, "ok"))
+                        return 0;
+                if (!strcmp(line, "err"))
+                        return 1;
+
+                name = host_next(line);
+
+                if (!announce || name == NULL)
+                        continue;
+
+                if (!strcmp(line, "module")) {
+                        m = module_add_hosted(name, path, h);
+                } else if (!strcmp(line, "var") && m) {
+                        method = host_next(name);
+                        timeout = host_next(method);
+                        type = host_next(timeout);
+                        align = host_next(type);
+
+                        if (type)
+                                module_var_add(m, name, method,
+                                               strtod(timeout, NULL),
+                                               atoi(type));
+                        if (type && align && atoi(align))
+                                module_var_align(m, name);
+                }
+        }
+
+        return -1;
+}
+
+/**
+ * @brief Kill a host and clean up after it.
+ *
+ * @param h Host
+ */
+static void host_reap(struct module_host *h)
+{
+        if (h->pid == -1)
+                return;
+
+        kill(h->pid, SIGKILL);
+        while (waitpid(h->pid, NULL, 0) == -1 && errno == EINTR)
+                ;
+
+        close(h->sock);
+        munmap(h->area, HOST_AREA_SIZE);
+
+        h->pid = -1;
+        h->sock = -1;
+        h->area = NULL;
+        h->in_len = 0;
+}
+
+/**
+ * @brief A host crashed or stopped making sense.  It gets started again
+ *        after a second, doubling every time it goes away soon after.
+ *
+ * @param h Host
+ */
+static void host_down(struct module_host *h)
+{
+        double now = get_mono_time();
+
+        host_reap(h);
+
+        if (h->backoff > 0 && now - h->started < h->backoff * 4)
+                h->backoff *= 2;
+        else
+                h->backoff = 1;
+
+        if (h->backoff > HOST_BACKOFF_MAX)
+                h->backoff = HOST_BACKOFF_MAX;
+
+        h->restart_at = now + h->backoff;
+
+        fprintf(stderr, "Host %s: Went away, starting it again in %.1fs.\n",
+                h->name, h->backoff);
+}
+
+/**
+ * @brief Write all of a command to a host.
+ *
+ * @param h Host
+ * @param buf Command
+ * @param len Its length
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int host_send(struct module_host *h, const char *buf, size_t len)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                n = write(h->sock, buf, len);
+
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return -1;
+
+                buf += n;
+                len -= n;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Read a reply line from a host, without its newline.
+ *
+ * @param h Host
+ * @param line Where it goes
+ * @param size Size of line
+ * @param timeout Milliseconds to wait, -1 for forever
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int host_read_line(struct module_host *h,
+                          char *line,
+                          size_t size,
+                          int timeout)
+{
+        struct pollfd pfd;
+        char *nl;
+        ssize_t n;
+        size_t len;
+
+        while ((nl = memchr(h->in, '\n', h->in_len)) == NULL) {
+                if (h->in_len == sizeof(h->in))
+                        return -1;
+
+                if (timeout >= 0) {
+                        pfd.fd = h->sock;
+                        pfd.events = POLLIN;
+
+                        if (poll(&pfd, 1, timeout) <= 0)
+                                return -1;
+                }
+
+                n = read(h->sock, h->in + h->in_len,
+                         sizeof(h->in) - h->in_len);
+
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return -1;
+
+                h->in_len += n;
+        }
+
+        len = nl - h->in;
+        if (len >= size)
+                return -1;
+
+        memcpy(line, h->in, len);
+        line[len] = '\0';
+
+        h->in_len -= len + 1;
+        memmove(h->in, nl + 1, h->in_len);
+
+        return 0;
+}
+
+/**
+ * @brief Split a line at its next tab.
+ *
+ * @param s Field, NULL is fine
+ *
+ * @return The field after it, NULL if it was the last one
+ */
+static char *host_next(char *s)
+{
+        char *tab;
+
+        if (s == NULL || (tab = strchr(s, '\t')) == NULL)
+                return NULL;
+
+        *tab = '\0';
+
+        return tab + 1;
+}
+
+/**
+ * @brief Entry point of a host process, donky --module-host.  It does
+ *        what donky tells it to until donky goes away.
+ *
+ * @return Exit status
+ */
+int host_main(void)
+{
+        char line[HOST_MAX_LINE];
+        struct module_var *mv;
+        sigset_t none;
+        FILE *in;
+        FILE *out;
+        char *area;
+        char *name;
+        char *nl;
+
+        /* Whichever thread started us had these blocked. */
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        signal(SIGPIPE, SIG_IGN);
+
+        /* killall -HUP donky is meant for donky, it restarts us itself. */
+        signal(SIGHUP, SIG_IGN);
+
+        area = mmap(NULL, HOST_AREA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    HOST_AREA_FD, 0);
+        close(HOST_AREA_FD);
+
+        in = fdopen(HOST_SOCK_FD, "r");
+        out = fdopen(dup(HOST_SOCK_FD), "w");
+
+        if (area == MAP_FAILED || in == NULL || out == NULL) {
+                fprintf(stderr, "donky --module-host is only for donky to "
+                        "use.\n");
+                return EXIT_FAILURE;
+        }
+
+        parse_cfg();
+
+        while (fgets(line, sizeof(line), in)) {
+                if ((nl = strchr(line, '\n')))
+                        *nl = '\0';
+
+                name = host_next(line);
+
+                if (!strcmp(line, "load") && name) {
+                        host_serve_load(out, name);
+                } else if (!strcmp(line, "call") && name) {
+                        host_serve_call(out, area, name, host_next(name));
+                } else if (!strcmp(line, "cron") && name &&
+                           (mv = module_var_find_by_name(name)) &&
+                           mv->loaded && mv->syms.f_void) {
+                        mv->syms.f_void();
+                        fputs("ok\n", out);
+                } else {
+                        fputs("err\n", out);
+                }
+
+                mem_list_clear();
+                fflush(out);
+        }
+
+        /* donky's gone, so are we. */
+        clear_module();
+        clear_cfg();
+
+        return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Load a module for good, run its crons and tell donky what it has.
+ *
+ * @param out Reply stream
+ * @param path Path to the module
+ */
+static void host_serve_load(FILE *out, char *path)
+{
+        struct module *m;
+        struct module_var *mv;
+
+        if ((m = module_load_kept(path)) == NULL) {
+                fputs("err\n", out);
+                return;
+        }
+
+        fprintf(out, "module\t%s\n", m->name);
+
+        /* Published values can't get back from here yet, so push-only
+         * variables are left out. */
+        for (mv = mv_start; mv; mv = mv->next)
+                if (mv->parent == m && !mv->is_push)
+                        fprintf(out, "var\t%s\t%s\t%f\t%d\t%d\n",
+                                mv->name, mv->method, mv->default_timeout,
+                                mv->type, mv->is_aligned);
+
+        module_var_cron_init(m);
+
+        /* Crons fill in what its variables show, so when we're starting
+         * over they go before anything gets called. */
+        for (mv = mv_start; mv; mv = mv->next)
+                if (mv->parent == m && mv->type == VARIABLE_CRON &&
+                    mv->syms.f_void)
+                        mv->syms.f_void();
+
+        fputs("ok\n", out);
+}
+
+/**
+ * @brief Call a variable's method.  Strings go in the shared area, cut
+ *        short if they don't fit.
+ *
+ * @param out Reply stream
+ * @param area Shared result area
+ * @param name Variable name
+ * @param args Arguments, NULL for none
+ */
+static void host_serve_call(FILE *out, char *area, char *name, char *args)
+{
+        struct module_var *mv;
+        const char *str;
+        size_t len;
+
+        mv = module_var_find_by_name(name);
+
+        if (mv == NULL || !mv->loaded || mv->syms.f_void == NULL) {
+                fputs("err\n", out);
+        } else if (mv->type & VARIABLE_STR) {
+                if ((str = module_var_call_str(mv, args)) == NULL)
+                        str = "";
+
+                if ((len = strlen(str)) >= HOST_AREA_SIZE)
+                        len = HOST_AREA_SIZE - 1;
+
+                memcpy(area, str, len);
+                area[len] = '\0';
+
+                fprintf(out, "s\t%lu\n", (unsigned long) len);
+        } else if (mv->type & VARIABLE_BAR || mv->type & VARIABLE_GRAPH) {
+                fprintf(out, "i\t%u\n", module_var_call_int(mv, args));
+        } else {
+                fputs("err\n", out);
+        }
+}
@@ -0,0 +1,67 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#ifndef HOST_H
+#define HOST_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "module.h"
+
+#define HOST_MAX_MODULES 32     /* Modules sharing one host */
+#define HOST_AREA_SIZE 65536    /* Shared result area, longest string + 1 */
+#define HOST_MAX_LINE 8192
+#define HOST_SOCK_FD 3          /* What the host gets its end as */
+#define HOST_AREA_FD 4
+#define HOST_LOAD_TIMEOUT 10000 /* ms a module_init in a host gets */
+#define HOST_BACKOFF_MAX 60.0   /* Longest wait before restarting one */
+
+/**
+ * A child process running isolated modules, so they can crash or hang
+ * without taking donky with them.
+ */
+struct module_host {
+        char name[64];          /* isolate = group it's for */
+        pid_t pid;              /* -1 when it isn't running */
+        int sock;               /* Commands and replies, line at a time */
+        char *area;             /* String results land here */
+        char in[HOST_MAX_LINE];
+        size_t in_len;
+
+        char *paths[HOST_MAX_MODULES];
+        int npaths;
+
+        pthread_mutex_t lock;   /* One call at a time */
+        double started;
+        double backoff;
+        double restart_at;      /* Not started again before this */
+
+        struct module_host *next;
+};
+
+void host_set_self(const char *argv0);
+const char *host_isolated(const char *name);
+int host_register(const char *path, const char *group);
+int host_call(struct module_host *h,
+              struct module_var *mv,
+              const char *args,
+              char **str,
+              size_t *size,
+              unsigned int *num);
+int host_cron(struct module_host *h, struct module_var *mv);
+void host_restart(struct module_host *h);
+void host_kill(struct module_host *h);
+void host_stop_all(void);
+int host_main(void);
+
+#endif /* HOST_H */
@@ -10,13 +10,16 @@
  * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
  */
 
+#include <fcntl.h>
 #include <getopt.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "cfg.h"
 #include "daemon.h"
+#include "host.h"
 #include "main.h"
 #include "module.h"
 #include "request.h"
@@ -36,6 +39,8 @@ static void clean_up_everything(void);
 static void sigterm_handler(int signum);
 static void sighup_handler(int signum);
 static void sigint_handler(int signum);
+static void signal_pipe_open(void);
+static void signal_pipe_poke(void);
 static void donky_greet(void);
 static void donky_farewell(void);
 static void print_random_message(const char **messages);
@@ -43,6 +48,8 @@ static void print_random_message(const char **messages);
 /* Globals. */
 int donky_reload;
 int donky_exit;
+int donky_signal_fd = -1;
+static int signal_pipe_w = -1;
 
 /**
  * @brief Program entry point.
@@ -59,6 +66,8 @@ int main(int argc, char **argv)
                 { "help",    no_argument,       NULL, 'h' },
                 { "config",  required_argument, NULL, 'c' },
                 { "debug",   no_argument,       NULL, 'd' },
+                /* What donky starts isolated modules in, not for people. */
+                { "module-host", no_argument,   NULL, 'M' },
                 { NULL,      0,                 NULL,  0  }
         };
 
@@ -68,6 +77,8 @@ int main(int argc, char **argv)
         donky_reload = 0;
         donky_exit = 0;
 
+        host_set_self(argv[0]);
+
         while (1) {
                 c = getopt_long(argc,
                                 argv,
@@ -88,13 +99,17 @@ int main(int argc, char **argv)
                 case 'c':
                         printf("Using alternate config file: %s\n", optarg);
                         break;
+                case 'M':
+                        exit(host_main());
                 default:
                         printf("\n" HELP);
                         exit(EXIT_FAILURE);
                 }
         }
 
-        /* Set signal handlers. */
+        /* Set signal handlers.  They poke the pipe so the donky loop hears
+         * about them right away. */
+        signal_pipe_open();
         signal(SIGTERM, sigterm_handler);
         signal(SIGHUP, sighup_handler);
         signal(SIGINT, sigint_handler);
@@ -160,15 +175,17 @@ static void sigterm_handler(int signum)
 {
         donky_farewell();
         donky_exit = 1;
+        signal_pipe_poke();
 }
 
 /**
- * @brief Handles SIGHUP signal.
+ * @brief Handles SIGHUP signal.  The config gets reloaded in place, nobody
+ *        gets disconnected.
  */
 static void sighup_handler(int signum)
 {
-        donky_farewell();
         donky_reload = 1;
+        signal_pipe_poke();
 }
 
 /**
@@ -178,6 +195,41 @@ static void sigint_handler(int signum)
 {
         donky_farewell();
         donky_exit = 1;
+        signal_pipe_poke();
+}
+
+/**
+ * @brief Open the self-pipe signal handlers use to wake the donky loop.
+ *        donky_signal_fd is the end to watch.
+ */
+static void signal_pipe_open(void)
+{
+        int fds[2];
+
+        if (pipe(fds) == -1) {
+                perror("pipe");
+                return;
+        }
+
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+        donky_signal_fd = fds[0];
+        signal_pipe_w = fds[1];
+}
+
+/**
+ * @brief Wake up the donky loop from a signal handler.
+ */
+static void signal_pipe_poke(void)
+{
+        char c = 0;
+
+        /* A full pipe means the loop has a wakeup coming already. */
+        if (signal_pipe_w != -1 && write(signal_pipe_w, &c, 1) == -1)
+                return;
 }
 
 /** 
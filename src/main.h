@@ -15,5 +15,6 @@
 
 extern int donky_reload;
 extern int donky_exit;
+extern int donky_signal_fd;
 
 #endif /* DONKYMAIN_H */
@@ -0,0 +1,370 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../config.h"
+#include "cfg.h"
+#include "frame.h"
+#include "mcast.h"
+#include "module.h"
+#include "net.h"
+#include "request.h"
+#include "util.h"
+
+/**
+ * What we know about each variable we publish.  The id is the index.
+ */
+struct mcast_var {
+        int is_used;            /* Configured (bool) */
+        int type;
+        char *name;             /* "var args", for snapshots */
+
+        int have;               /* Got a value yet (bool) */
+        int dirty;              /* Changed since the last datagram (bool) */
+        int is_int;             /* num instead of str (bool) */
+        char *str;
+        unsigned long num;
+};
+
+/* Globals. */
+static struct mcast_var mcast_vars[MCAST_MAX_VARS];
+static int mcast_sock = -1;
+static struct sockaddr_in mcast_dest;
+static double mcast_interval;
+static double mcast_snapshot;
+static double mcast_next_tick;
+static double mcast_next_snap;
+static unsigned long mcast_boot;
+static unsigned long mcast_seq;
+static char mcast_host[64];
+
+static unsigned char mcast_dgram[MCAST_MAX_DGRAM];
+static size_t mcast_len;
+static size_t mcast_head_len;
+
+/* Function prototypes. */
+static void mcast_begin(int kind);
+static void mcast_add(int kind, char *frame, size_t len);
+static void mcast_send(void);
+static void mcast_add_value(int kind, unsigned int id);
+static void mcast_flush(int kind);
+
+/**
+ * @brief Start publishing, if [multicast] has a group.  Each var<N> setting
+ *        subscribes id N to a variable, the same as "var N:..." from a
+ *        client.  Call with the request list locked.
+ *
+ * @return 0 on success or if it's turned off, -1 on failure
+ */
+int mcast_start(void)
+{
+        const char *group = get_char_key("multicast", "group", NULL);
+        const char *iface = get_char_key("multicast", "interface", NULL);
+        int port = get_int_key("multicast", "port", 7001);
+        int ttl = get_int_key("multicast", "ttl", 1);
+        const char *val;
+        char key[16];
+        char buf[256];
+        char *space;
+        struct module_var *mv;
+        unsigned int i;
+
+        if (group == NULL)
+                return 0;
+
+        mcast_sock = create_udp_sender(group, port, ttl, iface, &mcast_dest);
+        if (mcast_sock == -1)
+                return -1;
+
+        sock_set_nonblock(mcast_sock, 1);
+
+        val = get_char_key("multicast", "name", NULL);
+        if (val)
+                strfcpy(mcast_host, val, sizeof(mcast_host));
+        else if (gethostname(mcast_host, sizeof(mcast_host)) == -1)
+                strfcpy(mcast_host, "donky", sizeof(mcast_host));
+        mcast_host[sizeof(mcast_host) - 1] = '\0';
+
+        mcast_interval = get_double_key("multicast", "interval", 1.0);
+        mcast_snapshot = get_double_key("multicast", "snapshot", 10.0);
+        mcast_boot = (unsigned long) get_time();
+        mcast_seq = 0;
+
+        /* First pass sends a snapshot, so listeners know what's what. */
+        mcast_next_tick = 0;
+        mcast_next_snap = 0;
+
+        for (i = 0; i < MCAST_MAX_VARS; i++) {
+                sprintf(key, "var%u", i);
+                if ((val = get_char_key("multicast", key, NULL)) == NULL)
+                        continue;
+
+                strfcpy(buf, val, sizeof(buf));
+                if ((space = strchr(buf, ' ')))
+                        *space = '\0';
+
+                if ((mv = module_var_find_by_name(buf)) == NULL) {
+                        fprintf(stderr, "multicast: no such variable %s\n",
+                                buf);
+                        continue;
+                }
+
+                memset(&mcast_vars[i], 0, sizeof(mcast_vars[i]));
+                mcast_vars[i].is_used = 1;
+                mcast_vars[i].type = mv->type;
+                mcast_vars[i].name = strdup(val);
+
+                snprintf(buf, sizeof(buf), "%u:%s", i, val);
+                request_list_add(NULL, buf, 0);
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Stop publishing and drop our subscriptions.  Call with the request
+ *        list locked.
+ */
+void mcast_stop(void)
+{
+        unsigned int i;
+
+        if (mcast_sock == -1)
+                return;
+
+        for (i = 0; i < MCAST_MAX_VARS; i++) {
+                request_list_remove_id(NULL, i);
+                free(mcast_vars[i].name);
+                free(mcast_vars[i].str);
+                memset(&mcast_vars[i], 0, sizeof(mcast_vars[i]));
+        }
+
+        close(mcast_sock);
+        mcast_sock = -1;
+}
+
+/**
+ * @brief The request handler collected a string value for us.
+ *
+ * @param id Our subscription id
+ * @param type Variable type
+ * @param str Value
+ */
+void mcast_update_str(unsigned int id, int type, const char *str)
+{
+        struct mcast_var *mv;
+        size_t len;
+
+        if (id >= MCAST_MAX_VARS || !mcast_vars[id].is_used)
+                return;
+
+        mv = &mcast_vars[id];
+        len = strlen(str);
+        if (len >= MCAST_MAX_VALUE)
+                len = MCAST_MAX_VALUE - 1;
+
+        if (mv->have && !strncmp(mv->str, str, len) && mv->str[len] == '\0')
+                return;
+
+        free(mv->str);
+        mv->str = malloc(len + 1);
+        memcpy(mv->str, str, len);
+        mv->str[len] = '\0';
+
+        mv->type = type;
+        mv->is_int = 0;
+        mv->have = 1;
+        mv->dirty = 1;
+}
+
+/**
+ * @brief The request handler collected a BAR or GRAPH value for us.
+ *
+ * @param id Our subscription id
+ * @param type Variable type
+ * @param num Value
+ */
+void mcast_update_int(unsigned int id, int type, unsigned long num)
+{
+        struct mcast_var *mv;
+
+        if (id >= MCAST_MAX_VARS || !mcast_vars[id].is_used)
+                return;
+
+        mv = &mcast_vars[id];
+        if (mv->have && mv->num == num)
+                return;
+
+        mv->type = type;
+        mv->num = num;
+        mv->is_int = 1;
+        mv->have = 1;
+        mv->dirty = 1;
+}
+
+/**
+ * @brief Send whatever's due.  The request handler calls this at the end
+ *        of every pass, and wakes up for mcast_next_due().
+ */
+void mcast_tick(void)
+{
+        double now;
+
+        if (mcast_sock == -1)
+                return;
+
+        now = get_mono_time();
+
+        if (now >= mcast_next_snap) {
+                mcast_flush(MCAST_SNAPSHOT);
+                mcast_next_snap = now + mcast_snapshot;
+                mcast_next_tick = now + mcast_interval;
+        } else if (now >= mcast_next_tick) {
+                mcast_flush(MCAST_DELTA);
+                mcast_next_tick = now + mcast_interval;
+        }
+}
+
+/**
+ * @brief When mcast_tick() next has something to do.
+ *
+ * @return CLOCK_MONOTONIC time, 0 if we're not publishing
+ */
+double mcast_next_due(void)
+{
+        if (mcast_sock == -1)
+                return 0;
+
+        return (mcast_next_tick < mcast_next_snap) ?
+               mcast_next_tick : mcast_next_snap;
+}
+
+/**
+ * @brief Send the changed values, or all names and values for a snapshot.
+ *        Nothing goes out for a delta if nothing changed.
+ *
+ * @param kind MCAST_DELTA or MCAST_SNAPSHOT
+ */
+static void mcast_flush(int kind)
+{
+        char *frame;
+        size_t len;
+        unsigned int i;
+
+        mcast_begin(kind);
+
+        for (i = 0; i < MCAST_MAX_VARS; i++) {
+                if (!mcast_vars[i].is_used)
+                        continue;
+
+                if (kind == MCAST_SNAPSHOT) {
+                        frame = frame_name(i, mcast_vars[i].type,
+                                           mcast_vars[i].name, &len);
+                        mcast_add(kind, frame, len);
+                }
+
+                if (mcast_vars[i].have &&
+                    (mcast_vars[i].dirty || kind == MCAST_SNAPSHOT))
+                        mcast_add_value(kind, i);
+
+                mcast_vars[i].dirty = 0;
+        }
+
+        if (mcast_len > mcast_head_len)
+                mcast_send();
+}
+
+/**
+ * @brief Add a variable's value to the datagram.
+ *
+ * @param kind MCAST_DELTA or MCAST_SNAPSHOT
+ * @param id Which
+ */
+static void mcast_add_value(int kind, unsigned int id)
+{
+        struct mcast_var *mv = &mcast_vars[id];
+        char *frame;
+        size_t len;
+
+        if (mv->is_int)
+                frame = frame_u64(id, mv->type, mv->num, &len);
+        else
+                frame = frame_str(id, mv->type, mv->str, &len);
+
+        mcast_add(kind, frame, len);
+}
+
+/**
+ * @brief Start a new datagram.
+ *
+ * @param kind MCAST_DELTA or MCAST_SNAPSHOT
+ */
+static void mcast_begin(int kind)
+{
+        size_t hlen = strlen(mcast_host);
+
+        memcpy(mcast_dgram, MCAST_MAGIC, 4);
+        mcast_dgram[4] = MCAST_VERSION;
+        mcast_dgram[5] = kind;
+        mcast_len = 6;
+        mcast_len += frame_varint(mcast_dgram + mcast_len, mcast_boot);
+        mcast_len += frame_varint(mcast_dgram + mcast_len, mcast_seq);
+        mcast_len += frame_varint(mcast_dgram + mcast_len, hlen);
+        memcpy(mcast_dgram + mcast_len, mcast_host, hlen);
+        mcast_len += hlen;
+
+        mcast_head_len = mcast_len;
+}
+
+/**
+ * @brief Add a frame to the datagram, sending it off and starting another
+ *        one first if it won't fit.
+ *
+ * @param kind MCAST_DELTA or MCAST_SNAPSHOT, for the next datagram
+ * @param frame Malloc'd frame, we free it
+ * @param len Frame length
+ */
+static void mcast_add(int kind, char *frame, size_t len)
+{
+        if (mcast_len + len > MCAST_MAX_DGRAM && mcast_len > mcast_head_len) {
+                mcast_send();
+                mcast_begin(kind);
+        }
+
+        /* MCAST_MAX_VALUE makes sure one frame always fits. */
+        if (mcast_len + len <= MCAST_MAX_DGRAM) {
+                memcpy(mcast_dgram + mcast_len, frame, len);
+                mcast_len += len;
+        }
+
+        free(frame);
+}
+
+/**
+ * @brief Send the datagram.  It's UDP, if it doesn't go it doesn't go.
+ */
+static void mcast_send(void)
+{
+        if (sendto(mcast_sock, mcast_dgram, mcast_len, 0,
+                   (struct sockaddr *) &mcast_dest,
+                   sizeof(mcast_dest)) == -1) {
+                DEBUGF(("multicast sendto failed\n"));
+        }
+
+        mcast_seq++;
+}
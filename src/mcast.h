@@ -0,0 +1,42 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#ifndef MCAST_H
+#define MCAST_H
+
+/**
+ * Multicast datagrams.  Every one starts with this header, then has any
+ * number of complete binary protocol frames back to back:
+ *
+ *      "dnky", 1 byte version, 1 byte kind, varint boot, varint seq,
+ *      varint host name length, host name
+ *
+ * seq goes up by one for every datagram, boot is when the sender started
+ * so a listener can tell a restart from lost packets.
+ */
+#define MCAST_MAGIC "dnky"
+#define MCAST_VERSION 1
+#define MCAST_DELTA 0           /* Values that changed since the last one */
+#define MCAST_SNAPSHOT 1        /* Names and values of everything */
+
+#define MCAST_MAX_VARS 64       /* var0 through var63 */
+#define MCAST_MAX_DGRAM 1400    /* Stay under a typical MTU. */
+#define MCAST_MAX_VALUE 1024    /* Longer strings get cut off. */
+
+int mcast_start(void);
+void mcast_stop(void);
+void mcast_update_str(unsigned int id, int type, const char *str);
+void mcast_update_int(unsigned int id, int type, unsigned long num);
+void mcast_tick(void);
+double mcast_next_due(void);
+
+#endif /* MCAST_H */
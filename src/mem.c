@@ -10,6 +10,7 @@
  * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
  */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,12 +22,21 @@ struct mem_data {
         struct mem_data *next;
 };
 
+/* Module methods run on more than one thread, so each has its own list. */
+struct mem_list {
+        struct mem_data *start;
+        struct mem_data *end;
+};
+
 /* internal prototypes */
+static void mem_key_init(void);
+static void mem_key_free(void *arg);
+static struct mem_list *mem_list_get(void);
 static void mem_list_add(void *ptr);
 
 /* Globals. */
-static struct mem_data *mem_start = NULL;
-static struct mem_data *mem_end = NULL;
+static pthread_key_t mem_key;
+static pthread_once_t mem_once = PTHREAD_ONCE_INIT;
 
 /**
  * @brief Malloc wrapper.
@@ -96,6 +106,73 @@ void *m_freelater(void *ptr)
         return ptr;
 }
 
+/**
+ * @brief Make the key for the per-thread lists, once.
+ */
+static void mem_key_init(void)
+{
+        pthread_key_create(&mem_key, &mem_key_free);
+}
+
+/**
+ * @brief A thread's going away, free whatever it left behind.
+ *
+ * @param arg Its list
+ */
+static void mem_key_free(void *arg)
+{
+        struct mem_list *list = arg;
+        struct mem_data *cur;
+        struct mem_data *next;
+
+        for (cur = list->start; cur != NULL; cur = next) {
+                next = cur->next;
+                free(cur->ptr);
+                free(cur);
+        }
+
+        free(list);
+}
+
+/**
+ * @brief Get this thread's list, making it if it's the first time.
+ *
+ * @return List
+ */
+static struct mem_list *mem_list_get(void)
+{
+        struct mem_list *list;
+
+        pthread_once(&mem_once, &mem_key_init);
+
+        if ((list = pthread_getspecific(mem_key)) == NULL) {
+                list = calloc(1, sizeof(struct mem_list));
+                pthread_setspecific(mem_key, list);
+        }
+
+        return list;
+}
+
+/**
+ * @brief Make another list the calling thread's.  For the worker fibers,
+ *        which take turns on one thread but each clear their own.
+ *
+ * @param list List to use, NULL to get a new one on first use
+ *
+ * @return The list that was in use, NULL if there wasn't one yet
+ */
+void *mem_list_swap(void *list)
+{
+        void *old;
+
+        pthread_once(&mem_once, &mem_key_init);
+
+        old = pthread_getspecific(mem_key);
+        pthread_setspecific(mem_key, list);
+
+        return old;
+}
+
 /**
  * @brief Add pointer to linked list.
  *
@@ -103,6 +180,7 @@ void *m_freelater(void *ptr)
  */
 static void mem_list_add(void *ptr)
 {
+        struct mem_list *list = mem_list_get();
         struct mem_data *n;
 
         n = malloc(sizeof(struct mem_data));
@@ -111,24 +189,25 @@ static void mem_list_add(void *ptr)
         n->next = NULL;
 
         /* Add to linked list. */
-        if (mem_end == NULL) {
-                mem_start = n;
-                mem_end = n;
+        if (list->end == NULL) {
+                list->start = n;
+                list->end = n;
         } else {
-                mem_end->next = n;
-                mem_end = n;
+                list->end->next = n;
+                list->end = n;
         }
 }
 
 /**
- * @brief Free all nodes and data within the linked list.
+ * @brief Free all nodes and data within this thread's linked list.
  */
 void mem_list_clear(void)
 {
+        struct mem_list *list = mem_list_get();
         struct mem_data *cur;
         struct mem_data *next;
 
-        cur = mem_start;
+        cur = list->start;
 
         while (cur != NULL) {
                 next = cur->next;
@@ -137,6 +216,6 @@ void mem_list_clear(void)
                 cur = next;
         }
 
-        mem_start = NULL;
-        mem_end = NULL;
+        list->start = NULL;
+        list->end = NULL;
 }
@@ -25,8 +25,11 @@ void *m_calloc(size_t nelem, size_t size);
 char *m_strdup(char *str);
 void *m_freelater(void *ptr);
 
-/* Free and clear the memory list. */
+/* Free and clear the memory list of the calling thread. */
 void mem_list_clear(void);
 
+/* Switch the calling thread to another list, for donky itself. */
+void *mem_list_swap(void *list);
+
 #endif /* MEM_H */
 
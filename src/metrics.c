@@ -0,0 +1,631 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "../config.h"
+#include "cfg.h"
+#include "metrics.h"
+#include "module.h"
+#include "net.h"
+#include "request.h"
+#include "util.h"
+
+#define METRICS_TYPE "application/openmetrics-text; version=1.0.0; " \
+                     "charset=utf-8"
+
+/**
+ * Latest value of a variable with some particular args.  All the series of
+ * one variable are kept next to each other, they make up one family.
+ */
+struct metrics_series {
+        struct module_var *mv;
+        char *args;             /* NULL for none */
+
+        int is_int;             /* num instead of str (bool) */
+        char *str;
+        unsigned long num;
+        double stamp;           /* When it was collected. */
+
+        struct metrics_series *prev;
+        struct metrics_series *next;
+};
+
+/* Globals. */
+static struct metrics_series *ms_start = NULL;
+static struct metrics_series *ms_end = NULL;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t metrics_thread;
+static int metrics_is_launched = 0;     /* bool */
+static int metrics_sock = -1;
+
+static int metrics_dirty = 0;           /* Something changed this pass. */
+static unsigned long metrics_gen = 1;   /* Bumped after passes that did. */
+static unsigned long metrics_renders = 0;
+static unsigned long wakeups_total = 0; /* Request handler's, last minute */
+static double wakeups_per_minute = 0;
+
+static char *cache_buf = NULL;
+static size_t cache_len = 0;
+static size_t cache_size = 0;
+static unsigned long cache_gen = 0;
+
+/* Function prototypes. */
+static struct metrics_series *metrics_series_get(struct module_var *mv,
+                                                 const char *args);
+static void *metrics_run(void *arg);
+static void metrics_close(void *arg);
+static void metrics_serve(int sock);
+static int metrics_send(int sock, const char *buf, size_t len);
+static void metrics_render(void);
+static void metrics_append(const char *fmt, ...);
+static void metrics_append_name(const char *name);
+static void metrics_append_label(const char *label, const char *value);
+
+/**
+ * @brief Start the HTTP listener, if [metrics] has a port, and subscribe
+ *        to the var<N> settings so they're collected even with no clients
+ *        around.  Call with signals blocked, the thread inherits that.
+ *
+ * @return 0 on success or if it's turned off, -1 on failure
+ */
+int metrics_start(void)
+{
+        const char *host = get_char_key("metrics", "host", "localhost");
+        int port = get_int_key("metrics", "port", 0);
+        const char *val;
+        char key[16];
+        char buf[256];
+        int i;
+
+        if (port <= 0)
+                return 0;
+
+        if ((metrics_sock = create_tcp_listener(host, port, 0, 16)) == -1)
+                return -1;
+
+        request_list_lock();
+        for (i = 0; i < METRICS_MAX_VARS; i++) {
+                sprintf(key, "var%d", i);
+                if ((val = get_char_key("metrics", key, NULL)) == NULL)
+                        continue;
+
+                snprintf(buf, sizeof(buf), "%d:%s", METRICS_ID_BASE + i, val);
+                if (!request_list_add(NULL, buf, 0))
+                        fprintf(stderr, "metrics: no such variable [%s]\n",
+                                val);
+        }
+        request_list_unlock();
+
+        if (pthread_create(&metrics_thread, NULL, &metrics_run, NULL) != 0)
+                return -1;
+
+        metrics_is_launched = 1;
+
+        return 0;
+}
+
+/**
+ * @brief Stop serving and forget everything.
+ */
+void metrics_stop(void)
+{
+        struct metrics_series *next;
+        int i;
+
+        if (metrics_is_launched) {
+                pthread_cancel(metrics_thread);
+                pthread_join(metrics_thread, NULL);
+                metrics_is_launched = 0;
+        }
+
+        if (metrics_sock == -1)
+                return;
+
+        close(metrics_sock);
+        metrics_sock = -1;
+
+        request_list_lock();
+        for (i = 0; i < METRICS_MAX_VARS; i++)
+                request_list_remove_id(NULL, METRICS_ID_BASE + i);
+        request_list_unlock();
+
+        pthread_mutex_lock(&metrics_lock);
+        while (ms_start) {
+                next = ms_start->next;
+                free(ms_start->args);
+                free(ms_start->str);
+                free(ms_start);
+                ms_start = next;
+        }
+        ms_end = NULL;
+
+        free(cache_buf);
+        cache_buf = NULL;
+        cache_len = cache_size = 0;
+        cache_gen = 0;
+        pthread_mutex_unlock(&metrics_lock);
+}
+
+/**
+ * @brief The request handler collected a string value.
+ *
+ * @param mv Variable
+ * @param args Arguments it was collected with
+ * @param str Value
+ * @param stamp When it was collected, seconds since epoch
+ */
+void metrics_publish_str(struct module_var *mv,
+                         const char *args,
+                         const char *str,
+                         double stamp)
+{
+        struct metrics_series *ms;
+
+        if (metrics_sock == -1)
+                return;
+
+        pthread_mutex_lock(&metrics_lock);
+
+        ms = metrics_series_get(mv, args);
+        ms->stamp = stamp;
+
+        if (ms->is_int || ms->str == NULL || strcmp(ms->str, str)) {
+                free(ms->str);
+                ms->str = strdup(str);
+                ms->is_int = 0;
+                metrics_dirty = 1;
+        }
+
+        pthread_mutex_unlock(&metrics_lock);
+}
+
+/**
+ * @brief The request handler collected a BAR or GRAPH value.
+ *
+ * @param mv Variable
+ * @param args Arguments it was collected with
+ * @param num Value
+ * @param stamp When it was collected, seconds since epoch
+ */
+void metrics_publish_int(struct module_var *mv,
+                         const char *args,
+                         unsigned long num,
+                         double stamp)
+{
+        struct metrics_series *ms;
+
+        if (metrics_sock == -1)
+                return;
+
+        pthread_mutex_lock(&metrics_lock);
+
+        ms = metrics_series_get(mv, args);
+        ms->stamp = stamp;
+
+        if (!ms->is_int || ms->num != num) {
+                ms->num = num;
+                ms->is_int = 1;
+                metrics_dirty = 1;
+        }
+
+        pthread_mutex_unlock(&metrics_lock);
+}
+
+/**
+ * @brief Nobody's collecting a variable with these args anymore, so stop
+ *        reporting it.
+ *
+ * @param mv Variable
+ * @param args Arguments it was collected with
+ */
+void metrics_forget(struct module_var *mv, const char *args)
+{
+        struct metrics_series *cur;
+
+        if (metrics_sock == -1)
+                return;
+
+        pthread_mutex_lock(&metrics_lock);
+
+        for (cur = ms_start; cur; cur = cur->next) {
+                if (cur->mv != mv)
+                        continue;
+
+                if ((args == NULL && cur->args == NULL) ||
+                    (args && cur->args && !strcmp(args, cur->args)))
+                        break;
+        }
+
+        if (cur) {
+                if (cur->prev)
+                        cur->prev->next = cur->next;
+                if (cur->next)
+                        cur->next->prev = cur->prev;
+                if (cur == ms_start)
+                        ms_start = cur->next;
+                if (cur == ms_end)
+                        ms_end = cur->prev;
+
+                free(cur->args);
+                free(cur->str);
+                free(cur);
+                metrics_dirty = 1;
+        }
+
+        pthread_mutex_unlock(&metrics_lock);
+}
+
+/**
+ * @brief A collection pass is done.  If anything changed the next scrape
+ *        renders again, otherwise it gets the same body as last time.
+ */
+void metrics_tick(void)
+{
+        if (metrics_sock == -1)
+                return;
+
+        pthread_mutex_lock(&metrics_lock);
+        if (metrics_dirty) {
+                metrics_gen++;
+                metrics_dirty = 0;
+        }
+        pthread_mutex_unlock(&metrics_lock);
+}
+
+/**
+ * @brief How often the request handler has been waking up, once a minute.
+ *
+ * @param total Wakeups since it started
+ * @param per_minute Wakeups in the last minute
+ */
+void metrics_wakeups(unsigned long total, double per_minute)
+{
+        if (metrics_sock == -1)
+                return;
+
+        pthread_mutex_lock(&metrics_lock);
+        wakeups_total = total;
+        wakeups_per_minute = per_minute;
+        metrics_dirty = 1;
+        pthread_mutex_unlock(&metrics_lock);
+}
+
+/**
+ * @brief Find a series, or make a new one next to the rest of its family.
+ *        Call with metrics_lock held.
+ *
+ * @param mv Variable
+ * @param args Arguments
+ *
+ * @return Series
+ */
+static struct metrics_series *metrics_series_get(struct module_var *mv,
+                                                 const char *args)
+{
+        struct metrics_series *cur;
+        struct metrics_series *last = NULL;
+        struct metrics_series *n;
+
+        for (cur = ms_start; cur; cur = cur->next) {
+                if (cur->mv != mv)
+                        continue;
+
+                if ((args == NULL && cur->args == NULL) ||
+                    (args && cur->args && !strcmp(args, cur->args)))
+                        return cur;
+
+                last = cur;
+        }
+
+        n = calloc(1, sizeof(struct metrics_series));
+        n->mv = mv;
+        n->args = (args) ? strdup(args) : NULL;
+
+        if (last == NULL)
+                last = ms_end;
+
+        /* Add after the last one of the family, or at the end. */
+        n->prev = last;
+        n->next = (last) ? last->next : NULL;
+        if (n->next)
+                n->next->prev = n;
+        else
+                ms_end = n;
+        if (last)
+                last->next = n;
+        else
+                ms_start = n;
+
+        return n;
+}
+
+/**
+ * @brief Scrape serving thread.  One at a time, they're quick.
+ *
+ * @param arg Unused
+ *
+ * @return NULL
+ */
+static void *metrics_run(void *arg)
+{
+        struct timeval tv;
+        int sock;
+
+        tv.tv_sec = METRICS_TIMEOUT;
+        tv.tv_usec = 0;
+
+        while (1) {
+                if ((sock = accept(metrics_sock, NULL, NULL)) == -1) {
+                        if (errno != EINTR && errno != ECONNABORTED)
+                                perror("metrics accept");
+                        continue;
+                }
+
+                /* Nobody gets to hang on to us. */
+                setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+                pthread_cleanup_push(metrics_close, &sock);
+                metrics_serve(sock);
+                pthread_cleanup_pop(1);
+        }
+
+        return NULL;
+}
+
+/**
+ * @brief Close a scraper's socket, even if we're cancelled talking to it.
+ *
+ * @param arg Pointer to the socket
+ */
+static void metrics_close(void *arg)
+{
+        close(*(int *) arg);
+}
+
+/**
+ * @brief Read a request and answer it.  Only GET and HEAD of /metrics.
+ *
+ * @param sock Scraper
+ */
+static void metrics_serve(int sock)
+{
+        char req[METRICS_MAX_REQUEST];
+        const char *reply = NULL;
+        char head[256];
+        char method[16];
+        char path[256];
+        char *body = NULL;
+        size_t len = 0;
+        size_t got = 0;
+        int n;
+
+        /* We only need the request line, but read the whole head so the
+         * scraper isn't told off for sending it. */
+        while (got < sizeof(req) - 1) {
+                n = recv(sock, req + got, sizeof(req) - 1 - got, 0);
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return;
+
+                got += n;
+                req[got] = '\0';
+                if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+                        break;
+        }
+
+        if (sscanf(req, "%15s %255s", method, path) != 2)
+                reply = "HTTP/1.0 400 Bad Request\r\n";
+        else if (strcmp(method, "GET") && strcmp(method, "HEAD"))
+                reply = "HTTP/1.0 405 Method Not Allowed\r\n"
+                        "Allow: GET, HEAD\r\n";
+        else if (strncmp(path, "/metrics", 8) ||
+                 (path[8] != '\0' && path[8] != '?'))
+                reply = "HTTP/1.0 404 Not Found\r\n";
+
+        if (reply) {
+                if (metrics_send(sock, reply, strlen(reply)) == 0)
+                        metrics_send(sock, "Connection: close\r\n\r\n", 21);
+                return;
+        }
+
+        /* Render only if a pass changed something since the last time,
+         * then send a copy so collection doesn't wait on a slow scraper. */
+        pthread_mutex_lock(&metrics_lock);
+        if (cache_buf == NULL || cache_gen != metrics_gen) {
+                metrics_render();
+                cache_gen = metrics_gen;
+        }
+
+        len = cache_len;
+        if (!strcmp(method, "GET")) {
+                body = malloc(len);
+                memcpy(body, cache_buf, len);
+        }
+        pthread_mutex_unlock(&metrics_lock);
+
+        n = sprintf(head, "HTTP/1.0 200 OK\r\n"
+                    "Content-Type: " METRICS_TYPE "\r\n"
+                    "Content-Length: %lu\r\n"
+                    "Connection: close\r\n\r\n", (unsigned long) len);
+
+        if (metrics_send(sock, head, n) == 0 && body)
+                metrics_send(sock, body, len);
+
+        free(body);
+}
+
+/**
+ * @brief Send all of a buffer.
+ *
+ * @param sock Socket
+ * @param buf What
+ * @param len How much
+ *
+ * @return 0 if it all went, -1 if not
+ */
+static int metrics_send(int sock, const char *buf, size_t len)
+{
+        int n;
+
+        while (len) {
+                n = send(sock, buf, len, 0);
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return -1;
+
+                buf += n;
+                len -= n;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Render every series into the cache.  BAR and GRAPH variables are
+ *        gauges, STR variables are info metrics with the string as a
+ *        label.  Series that haven't been collected in a while (nobody's
+ *        asking anymore) are left out.  Call with metrics_lock held.
+ */
+static void metrics_render(void)
+{
+        struct metrics_series *cur;
+        struct module_var *family = NULL;
+        double now = get_time();
+
+        cache_len = 0;
+        metrics_renders++;
+
+        for (cur = ms_start; cur; cur = cur->next) {
+                if (!cur->mv->is_push &&
+                    now - cur->stamp > 2 * cur->mv->timeout + 60)
+                        continue;
+
+                if (cur->mv != family) {
+                        family = cur->mv;
+                        metrics_append("# TYPE ");
+                        metrics_append_name(family->name);
+                        metrics_append(" %s\n", (cur->is_int) ?
+                                       "gauge" : "info");
+                }
+
+                metrics_append_name(family->name);
+
+                if (cur->is_int) {
+                        if (cur->args) {
+                                metrics_append("{");
+                                metrics_append_label("args", cur->args);
+                                metrics_append("}");
+                        }
+                        metrics_append(" %lu\n", cur->num);
+                } else {
+                        metrics_append("_info{");
+                        if (cur->args) {
+                                metrics_append_label("args", cur->args);
+                                metrics_append(",");
+                        }
+                        metrics_append_label("value", cur->str);
+                        metrics_append("} 1\n");
+                }
+        }
+
+        metrics_append("# TYPE donky_wakeups counter\n"
+                       "donky_wakeups_total %lu\n"
+                       "# TYPE donky_wakeups_per_minute gauge\n"
+                       "donky_wakeups_per_minute %.1f\n",
+                       wakeups_total, wakeups_per_minute);
+        metrics_append("# TYPE donky_metrics_renders counter\n"
+                       "donky_metrics_renders_total %lu\n"
+                       "# EOF\n", metrics_renders);
+}
+
+/**
+ * @brief Append to the cache.
+ *
+ * @param fmt Format
+ */
+static void metrics_append(const char *fmt, ...)
+{
+        va_list ap;
+        int n;
+
+        while (1) {
+                va_start(ap, fmt);
+                n = vsnprintf(cache_buf + cache_len, cache_size - cache_len,
+                              fmt, ap);
+                va_end(ap);
+
+                if (n >= 0 && (size_t) n < cache_size - cache_len)
+                        break;
+
+                cache_size = (cache_size) ? cache_size * 2 : 4096;
+                cache_buf = realloc(cache_buf, cache_size);
+        }
+
+        cache_len += n;
+}
+
+/**
+ * @brief Append a metric name.  It's donky_ and the variable name, with
+ *        anything OpenMetrics doesn't like turned into _.
+ *
+ * @param name Variable name
+ */
+static void metrics_append_name(const char *name)
+{
+        char buf[80];
+        size_t i;
+
+        strfcpy(buf, name, sizeof(buf));
+        for (i = 0; buf[i]; i++)
+                if (!((buf[i] >= 'a' && buf[i] <= 'z') ||
+                      (buf[i] >= 'A' && buf[i] <= 'Z') ||
+                      (buf[i] >= '0' && buf[i] <= '9')))
+                        buf[i] = '_';
+
+        metrics_append("donky_%s", buf);
+}
+
+/**
+ * @brief Append a label, escaping the value.
+ *
+ * @param label Label name
+ * @param value Label value
+ */
+static void metrics_append_label(const char *label, const char *value)
+{
+        metrics_append("%s=\"", label);
+
+        for (; *value; value++) {
+                if (*value == '\\')
+                        metrics_append("\\\\");
+                else if (*value == '"')
+                        metrics_append("\\\"");
+                else if (*value == '\n')
+                        metrics_append("\\n");
+                else
+                        metrics_append("%c", *value);
+        }
+
+        metrics_append("\"");
+}
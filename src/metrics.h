@@ -0,0 +1,37 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "module.h"
+
+#define METRICS_MAX_VARS 64     /* var0 through var63 */
+#define METRICS_ID_BASE 65536   /* Our request ids, out of multicast's way */
+#define METRICS_MAX_REQUEST 4096
+#define METRICS_TIMEOUT 2       /* Seconds a scraper gets to talk to us */
+
+int metrics_start(void);
+void metrics_stop(void);
+void metrics_publish_str(struct module_var *mv,
+                         const char *args,
+                         const char *str,
+                         double stamp);
+void metrics_publish_int(struct module_var *mv,
+                         const char *args,
+                         unsigned long num,
+                         double stamp);
+void metrics_forget(struct module_var *mv, const char *args);
+void metrics_tick(void);
+void metrics_wakeups(unsigned long total, double per_minute);
+
+#endif /* METRICS_H */
@@ -12,6 +12,8 @@
 
 #include <dirent.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,9 +21,42 @@
 
 #include "../config.h"
 #include "cfg.h"
+#include "default_settings.h"
+#include "host.h"
+#include "mem.h"
 #include "module.h"
+#include "request.h"
+#include "sampler.h"
 #include "util.h"
 
+/* The module_var a cron heap node is in. */
+#define MV_OF(n) ((struct module_var *) ((char *) (n) - \
+                  offsetof(struct module_var, sched)))
+
+/**
+ * A descriptor a module asked to be told about.  Its callback runs on a
+ * worker, on the module's strand, so never alongside the module's own
+ * methods.  Everything but io is under the fd lock.
+ */
+struct module_fd {
+        struct pool_io io;      /* Has to be first, see module_fd_ready() */
+        void (*func)(int fd, int fired, void *data);
+        void *data;
+        struct module *parent;
+        struct pool_job job;    /* The callback on a worker */
+
+        int fired;              /* Since the callback last went out */
+        int job_fired;          /* What the one on a worker got */
+        int is_queued;          /* On the ready list (bool) */
+        int is_busy;            /* Callback out on a worker (bool) */
+        int is_closing;         /* Being unregistered (bool) */
+        int is_dead;            /* Unregistered, free once back (bool) */
+        struct module_fd *ready_next;
+
+        struct module_fd *next;
+        struct module_fd *prev;
+};
+
 /* Globals. */
 struct module *m_start = NULL;
 struct module *m_end = NULL;
@@ -29,7 +64,24 @@ struct module *m_end = NULL;
 struct module_var *mv_start = NULL;
 struct module_var *mv_end = NULL;
 
+static struct deadline_heap cron_heap;     /* Crons of loaded modules */
+static double cron_fallback;            /* Period for crons without one */
+
 static int first_load = 1; /* bool */
+static int low_wakeup = 0; /* bool, [daemon] low_wakeup */
+
+/* Published values waiting for the request handler.  Its own lock, so a
+ * module thread can publish without caring what donky is up to. */
+static pthread_mutex_t push_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct module_var *push_start = NULL;
+static struct module_var *push_end = NULL;
+
+/* Descriptors modules are watching, and the ones that fired. */
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct module_fd *fd_start = NULL;
+static struct module_fd *fd_end = NULL;
+static struct module_fd *fd_ready_start = NULL;
+static struct module_fd *fd_ready_end = NULL;
 
 /* Function prototypes. */
 static struct module *module_add(const char *name,
@@ -37,6 +89,30 @@ static struct module *module_add(const char *name,
                                  void *handle,
                                  void *destroy);
 static struct module *module_find_by_name(const char *name);
+static struct module *module_find_by_path(const char *path);
+static int module_reload(struct module *cur);
+static void module_var_cron_work(struct pool_job *job);
+static void module_var_cron_done(struct pool_job *job);
+static void module_var_cron_overdue(struct pool_job *job);
+static double module_var_deadline(const char *name, unsigned char type);
+static int module_var_aligned(const char *name,
+                              unsigned char type,
+                              int otherwise);
+static double module_var_slack(struct module_var *mv, double period);
+static void module_var_push_queue(struct module_var *mv);
+static void module_var_push_copy(struct module_var *mv,
+                                 char **str,
+                                 size_t *size,
+                                 unsigned int *num,
+                                 double *stamp);
+static struct module_fd *module_fd_find(const struct module *mod, int fd);
+static void module_fd_drop(struct module_fd *mf);
+static void module_fd_drop_all(struct module *cur);
+static void module_fd_queue(struct module_fd *mf);
+static void module_fd_ready(struct pool_io *io, int fired);
+static void module_fd_work(struct pool_job *job);
+static void module_fd_done(struct pool_job *job);
+static void module_fd_overdue(struct pool_job *job);
 
 /**
  * @brief Add a module_var link.
@@ -56,6 +132,7 @@ int module_var_add(const struct module *parent,
                    unsigned char type)
 {
         double user_timeout;
+        char key[80];
         struct module_var *find;
         struct module_var *n;
 
@@ -70,10 +147,24 @@ int module_var_add(const struct module *parent,
         strfcpy(n->method, method, sizeof(n->method));
         n->type = type;
         n->loaded = 0;
+        n->is_push = 0;
+        n->is_sampleable = 0;
 
         if (!find) {
                 n->prev = NULL;
                 n->next = NULL;
+                n->shm_slot = -1;
+                n->push_have = 0;
+                n->push_dirty = 0;
+                n->push_str = NULL;
+                n->push_size = 0;
+                n->push_num = 0;
+                n->push_next = NULL;
+                n->sched.slot = -1;
+                n->job.work = &module_var_cron_work;
+                n->job.done = &module_var_cron_done;
+                n->job.overdue = &module_var_cron_overdue;
+                n->job.data = n;
         }
 
         /* Set the timeout.  User configured timeouts take precedence over
@@ -86,24 +177,688 @@ int module_var_add(const struct module *parent,
         /*printf("Adding [%s] with timeout [%f]\n", name, user_timeout);*/
         
         n->timeout = user_timeout;
+        n->default_timeout = timeout;
+        n->deadline = module_var_deadline(name, type);
+        n->is_aligned = module_var_aligned(name, type, 0);
+        sprintf(key, "%.64s_slack", name);
+        n->slack = get_double_key((type == VARIABLE_CRON) ? "cron" : "timeout",
+                                  key, -1.0);
+        sprintf(key, "%.64s_sample", name);
+        n->sample_rate = get_double_key("timeout", key, 0.0);
         n->last_update = 0.0;
-        n->sum = 0;
         n->parent = (struct module *) parent;
 
         if (find)
                 return 1;
 
-        /* Add node to linked list. */
-        if (mv_end == NULL) {
-                mv_start = n;
-                mv_end = n;
-        } else {
-                mv_end->next = n;
-                n->prev = mv_end;
-                mv_end = n;
-        }
-        
-        return 1;
+        /* Add node to linked list. */
+        if (mv_end == NULL) {
+                mv_start = n;
+                mv_end = n;
+        } else {
+                mv_end->next = n;
+                n->prev = mv_end;
+                mv_end = n;
+        }
+        
+        return 1;
+}
+
+/**
+ * @brief Add a push-only module_var.  It has no method and is never
+ *        polled, subscribers only get what the module hands to
+ *        module_var_publish().
+ *
+ * @param parent Parent module
+ * @param name Unique name of this var
+ * @param type VARIABLE_STR, VARIABLE_BAR or VARIABLE_GRAPH
+ *
+ * @return The variable, to publish to, NULL for failure
+ */
+struct module_var *module_var_add_push(const struct module *parent,
+                                       char *name,
+                                       unsigned char type)
+{
+        struct module_var *mv;
+
+        if (!module_var_add(parent, name, "", 0.0, type))
+                return NULL;
+
+        mv = module_var_find_by_name(name);
+        mv->is_push = 1;
+
+        return mv;
+}
+
+/**
+ * @brief Publish a new value for a STR variable, from any thread.  Its
+ *        subscribers get it on the request handler's next pass, which is
+ *        right away.  Works on polled variables too, they just get polled
+ *        as well.
+ *
+ * @param mv Variable
+ * @param value New value, copied
+ */
+void module_var_publish(struct module_var *mv, const char *value)
+{
+        size_t len;
+
+        if (mv == NULL || value == NULL)
+                return;
+
+        len = strlen(value) + 1;
+
+        pthread_mutex_lock(&push_lock);
+
+        if (len > mv->push_size) {
+                mv->push_size = len;
+                mv->push_str = realloc(mv->push_str, len);
+        }
+        memcpy(mv->push_str, value, len);
+        module_var_push_queue(mv);
+
+        pthread_mutex_unlock(&push_lock);
+
+        request_handler_poke();
+}
+
+/**
+ * @brief Publish a new value for a BAR or GRAPH variable, from any thread.
+ *
+ * @param mv Variable
+ * @param value New value
+ */
+void module_var_publish_int(struct module_var *mv, unsigned int value)
+{
+        if (mv == NULL)
+                return;
+
+        pthread_mutex_lock(&push_lock);
+
+        mv->push_num = value;
+        module_var_push_queue(mv);
+
+        pthread_mutex_unlock(&push_lock);
+
+        request_handler_poke();
+}
+
+/**
+ * @brief Queue a variable for the request handler, once no matter how many
+ *        times it's published before it looks.  Push lock held.
+ *
+ * @param mv Variable
+ */
+static void module_var_push_queue(struct module_var *mv)
+{
+        mv->push_have = 1;
+        mv->push_stamp = get_time();
+
+        if (mv->push_dirty)
+                return;
+
+        mv->push_dirty = 1;
+        mv->push_next = NULL;
+
+        if (push_end == NULL) {
+                push_start = mv;
+                push_end = mv;
+        } else {
+                push_end->push_next = mv;
+                push_end = mv;
+        }
+}
+
+/**
+ * @brief Copy out what was published for a variable.  Push lock held.
+ *
+ * @param mv Variable
+ * @param str Buffer for STR values, grown as needed
+ * @param size Size of it
+ * @param num BAR and GRAPH values
+ * @param stamp When it was published
+ */
+static void module_var_push_copy(struct module_var *mv,
+                                 char **str,
+                                 size_t *size,
+                                 unsigned int *num,
+                                 double *stamp)
+{
+        const char *value = (mv->push_str) ? mv->push_str : "";
+        size_t len = strlen(value) + 1;
+
+        if (len > *size) {
+                *size = len;
+                *str = realloc(*str, len);
+        }
+        memcpy(*str, value, len);
+        *num = mv->push_num;
+        *stamp = mv->push_stamp;
+}
+
+/**
+ * @brief Take the next published variable off the queue, for the request
+ *        handler.  The value's copied out while it can't change.
+ *
+ * @param str Buffer for STR values, grown as needed
+ * @param size Size of it
+ * @param num BAR and GRAPH values
+ * @param stamp When it was published
+ *
+ * @return Variable, NULL once there's nothing left
+ */
+struct module_var *module_var_push_take(char **str,
+                                        size_t *size,
+                                        unsigned int *num,
+                                        double *stamp)
+{
+        struct module_var *mv;
+
+        pthread_mutex_lock(&push_lock);
+
+        /* Ones whose module went away since don't count. */
+        while ((mv = push_start)) {
+                push_start = mv->push_next;
+                if (push_start == NULL)
+                        push_end = NULL;
+
+                mv->push_dirty = 0;
+                mv->push_next = NULL;
+
+                if (mv->push_have) {
+                        module_var_push_copy(mv, str, size, num, stamp);
+                        break;
+                }
+        }
+
+        pthread_mutex_unlock(&push_lock);
+
+        return mv;
+}
+
+/**
+ * @brief Copy out the latest value published for a variable, for somebody
+ *        that just subscribed to it.
+ *
+ * @param mv Variable
+ * @param str Buffer for STR values, grown as needed
+ * @param size Size of it
+ * @param num BAR and GRAPH values
+ * @param stamp When it was published
+ *
+ * @return 1 if there was one, 0 if nothing's been published
+ */
+int module_var_push_peek(struct module_var *mv,
+                         char **str,
+                         size_t *size,
+                         unsigned int *num,
+                         double *stamp)
+{
+        int have;
+
+        pthread_mutex_lock(&push_lock);
+
+        if ((have = mv->push_have))
+                module_var_push_copy(mv, str, size, num, stamp);
+
+        pthread_mutex_unlock(&push_lock);
+
+        return have;
+}
+
+/**
+ * @brief Have a variable run when the wall clock is on a multiple of its
+ *        timeout, instead of somewhere in between like the rest, so a
+ *        clock ticks over with the real second.  <variable>_align in
+ *        [timeout] (or [cron]) can still turn it off.
+ *
+ * @param parent Parent module
+ * @param name Variable, already added
+ *
+ * @return 1 success, 0 fail
+ */
+int module_var_align(const struct module *parent, const char *name)
+{
+        struct module_var *mv;
+
+        if ((mv = module_var_find_by_name(name)) == NULL ||
+            mv->parent != parent)
+                return 0;
+
+        mv->is_aligned = module_var_aligned(name, mv->type, 1);
+
+        return 1;
+}
+
+/**
+ * @brief Let a BAR or GRAPH variable be sampled, when <variable>_sample in
+ *        [timeout] asks for it.  The sampler thread then calls its method
+ *        up to that many times a second, whatever else the module's doing,
+ *        so it has to be quick, never block, and not trip over the
+ *        module's other methods.
+ *
+ * @param parent Parent module
+ * @param name Variable, already added
+ *
+ * @return 1 success, 0 fail
+ */
+int module_var_sample(const struct module *parent, const char *name)
+{
+        struct module_var *mv;
+
+        if ((mv = module_var_find_by_name(name)) == NULL ||
+            mv->parent != parent ||
+            !(mv->type & (VARIABLE_BAR | VARIABLE_GRAPH)))
+                return 0;
+
+        mv->is_sampleable = 1;
+
+        return 1;
+}
+
+/**
+ * @brief See if a variable gets sampled instead of called at its timeout.
+ *        Isolated ones never are, a round trip to their host each sample
+ *        is what the sampler is trying to avoid.
+ *
+ * @param mv Variable
+ *
+ * @return 1 if it does, 0 if not
+ */
+int module_var_sampled(struct module_var *mv)
+{
+        return mv->is_sampleable && mv->sample_rate > 0 &&
+               mv->parent->host == NULL;
+}
+
+/**
+ * @brief When a variable runs next, from now.
+ *
+ * @param mv Variable
+ * @param period Its period
+ * @param phase Where in its period it runs, unless it's aligned
+ *
+ * @return CLOCK_MONOTONIC time
+ */
+double module_var_next(struct module_var *mv, double period, double phase)
+{
+        double next;
+
+        if (mv->is_aligned)
+                next = deadline_aligned(get_mono_time(), get_time(), period);
+        else
+                next = deadline_next(get_mono_time(), period, phase);
+
+        return deadline_coalesce(next, module_var_slack(mv, period));
+}
+
+/**
+ * @brief How late a variable may run so it can share a wakeup.
+ *        <variable>_slack in [timeout] (or [cron]) if it's set, otherwise a
+ *        bit of its period in low_wakeup mode, except for aligned ones,
+ *        which would be late for what they're aligned to.
+ *
+ * @param mv Variable
+ * @param period Its period
+ *
+ * @return Seconds
+ */
+static double module_var_slack(struct module_var *mv, double period)
+{
+        if (mv->slack >= 0)
+                return mv->slack;
+        if (!low_wakeup || mv->is_aligned)
+                return 0;
+
+        return period * DEFAULT_SLACK;
+}
+
+/**
+ * @brief Turn low_wakeup mode on or off, from the request handler.
+ *
+ * @param on 1 for on, 0 for off
+ */
+void module_var_low_wakeup(int on)
+{
+        low_wakeup = on;
+}
+
+/**
+ * @brief Have a module's callback run whenever a descriptor is ready,
+ *        instead of the module polling it or keeping a thread around to
+ *        block on it.  The callback runs on a worker like the module's
+ *        methods, never at the same time as them, and should read or
+ *        write until EAGAIN since it's only told when something changes.
+ *        Registering the same descriptor again replaces what it's watched
+ *        for.  Whatever's left is unregistered when the module unloads.
+ *
+ * @param mod Module
+ * @param fd Descriptor, nonblocking
+ * @param mask EVENT_READ and/or EVENT_WRITE
+ * @param func Callback, gets the descriptor, the EVENT_* flags that fired
+ *             and data
+ * @param data Handed to func
+ *
+ * @return 0 on success, -1 on failure
+ */
+int module_fd_add(const struct module *mod,
+                  int fd,
+                  int mask,
+                  void (*func)(int fd, int fired, void *data),
+                  void *data)
+{
+        struct module_fd *mf;
+
+        if (mod == NULL || fd < 0 || func == NULL)
+                return -1;
+
+        module_fd_del(mod, fd);
+
+        if ((mf = calloc(1, sizeof(struct module_fd))) == NULL)
+                return -1;
+
+        mf->io.fd = fd;
+        mf->io.mask = mask;
+        mf->io.ready = &module_fd_ready;
+        mf->func = func;
+        mf->data = data;
+        mf->parent = (struct module *) mod;
+        mf->job.work = &module_fd_work;
+        mf->job.done = &module_fd_done;
+        mf->job.overdue = &module_fd_overdue;
+        mf->job.data = mf;
+
+        /* Callbacks get what the module's own variables get by default,
+         * <module>_deadline in [timeout]. */
+        mf->job.limit = module_var_deadline(mod->name, VARIABLE_STR);
+
+        pthread_mutex_lock(&fd_lock);
+
+        if (fd_end == NULL) {
+                fd_start = mf;
+                fd_end = mf;
+        } else {
+                fd_end->next = mf;
+                mf->prev = fd_end;
+                fd_end = mf;
+        }
+
+        pthread_mutex_unlock(&fd_lock);
+
+        if (pool_io_add(&mf->io) == -1) {
+                module_fd_drop(mf);
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Stop watching a descriptor.  The callback isn't called for it
+ *        after this, unless it's the one calling.
+ *
+ * @param mod Module
+ * @param fd Descriptor
+ */
+void module_fd_del(const struct module *mod, int fd)
+{
+        struct module_fd *mf;
+
+        pthread_mutex_lock(&fd_lock);
+        if ((mf = module_fd_find(mod, fd)))
+                mf->is_closing = 1;
+        pthread_mutex_unlock(&fd_lock);
+
+        if (mf)
+                module_fd_drop(mf);
+}
+
+/**
+ * @brief Find a module's watch on a descriptor.  Fd lock held.
+ *
+ * @param mod Module
+ * @param fd Descriptor
+ *
+ * @return Watch, NULL for none
+ */
+static struct module_fd *module_fd_find(const struct module *mod, int fd)
+{
+        struct module_fd *mf;
+
+        for (mf = fd_start; mf; mf = mf->next)
+                if (mf->parent == mod && mf->io.fd == fd && !mf->is_closing)
+                        return mf;
+
+        return NULL;
+}
+
+/**
+ * @brief Unregister a watch that's been marked closing.  The event loop
+ *        lets go of it first, then it's freed, or once its callback is back
+ *        if that's out.
+ *
+ * @param mf Watch
+ */
+static void module_fd_drop(struct module_fd *mf)
+{
+        struct module_fd *cur;
+        struct module_fd *prev = NULL;
+        int is_busy;
+
+        pool_io_del(&mf->io);
+
+        pthread_mutex_lock(&fd_lock);
+
+        if (mf->prev)
+                mf->prev->next = mf->next;
+        if (mf->next)
+                mf->next->prev = mf->prev;
+        if (mf == fd_start)
+                fd_start = mf->next;
+        if (mf == fd_end)
+                fd_end = mf->prev;
+
+        if (mf->is_queued) {
+                for (cur = fd_ready_start; cur != mf; cur = cur->ready_next)
+                        prev = cur;
+
+                if (prev)
+                        prev->ready_next = mf->ready_next;
+                else
+                        fd_ready_start = mf->ready_next;
+                if (mf == fd_ready_end)
+                        fd_ready_end = prev;
+        }
+
+        if ((is_busy = mf->is_busy))
+                mf->is_dead = 1;
+
+        pthread_mutex_unlock(&fd_lock);
+
+        if (!is_busy)
+                free(mf);
+}
+
+/**
+ * @brief Unregister everything a module is watching.
+ *
+ * @param cur Module
+ */
+static void module_fd_drop_all(struct module *cur)
+{
+        struct module_fd *mf;
+
+        while (1) {
+                pthread_mutex_lock(&fd_lock);
+                for (mf = fd_start; mf; mf = mf->next)
+                        if (mf->parent == cur && !mf->is_closing)
+                                break;
+                if (mf)
+                        mf->is_closing = 1;
+                pthread_mutex_unlock(&fd_lock);
+
+                if (mf == NULL)
+                        break;
+
+                module_fd_drop(mf);
+        }
+}
+
+/**
+ * @brief Put a watch on the ready list, once.  Fd lock held.
+ *
+ * @param mf Watch
+ */
+static void module_fd_queue(struct module_fd *mf)
+{
+        if (mf->is_queued || mf->is_closing)
+                return;
+
+        mf->is_queued = 1;
+        mf->ready_next = NULL;
+
+        if (fd_ready_end)
+                fd_ready_end->ready_next = mf;
+        else
+                fd_ready_start = mf;
+        fd_ready_end = mf;
+}
+
+/**
+ * @brief A watched descriptor fired, from the event loop.  Just take note
+ *        and wake the request handler, it hands the callback out.
+ *
+ * @param io The watch's pool_io
+ * @param fired EVENT_* flags
+ */
+static void module_fd_ready(struct pool_io *io, int fired)
+{
+        struct module_fd *mf = (struct module_fd *) io;
+
+        pthread_mutex_lock(&fd_lock);
+
+        mf->fired |= fired;
+        if (!mf->is_busy)
+                module_fd_queue(mf);
+
+        pthread_mutex_unlock(&fd_lock);
+
+        request_handler_poke();
+}
+
+/**
+ * @brief Hand the callbacks of descriptors that fired to the workers.
+ *        Called with the request list locked.
+ *
+ * @param now Current time
+ */
+void module_fd_exec(double now)
+{
+        struct module_fd *mf;
+        struct module_fd *go = NULL;
+        struct module_fd *wait = NULL;
+        struct module_fd *next;
+
+        pthread_mutex_lock(&fd_lock);
+
+        mf = fd_ready_start;
+        fd_ready_start = NULL;
+        fd_ready_end = NULL;
+
+        for (; mf; mf = next) {
+                next = mf->ready_next;
+                mf->is_queued = 0;
+
+                /* Try again once its module is out of the doghouse. */
+                if (module_is_quarantined(mf->parent, now)) {
+                        mf->ready_next = wait;
+                        wait = mf;
+                        continue;
+                }
+
+                mf->job_fired = mf->fired;
+                mf->fired = 0;
+                mf->is_busy = 1;
+                mf->ready_next = go;
+                go = mf;
+        }
+
+        for (mf = wait; mf; mf = next) {
+                next = mf->ready_next;
+                module_fd_queue(mf);
+        }
+
+        pthread_mutex_unlock(&fd_lock);
+
+        /* The module stays loaded until they're back. */
+        for (mf = go; mf; mf = next) {
+                next = mf->ready_next;
+
+                mf->parent->clients++;
+                pool_submit(&mf->parent->strand, &mf->job);
+        }
+}
+
+/**
+ * @brief Run a descriptor's callback, on a worker.
+ *
+ * @param job Job of the watch
+ */
+static void module_fd_work(struct pool_job *job)
+{
+        struct module_fd *mf = job->data;
+        int is_closing;
+
+        pthread_mutex_lock(&fd_lock);
+        is_closing = mf->is_closing;
+        pthread_mutex_unlock(&fd_lock);
+
+        if (!is_closing)
+                mf->func(mf->io.fd, mf->job_fired, mf->data);
+
+        mem_list_clear();
+}
+
+/**
+ * @brief A descriptor's callback is back.  If it fired again meanwhile it
+ *        goes out again.  Called with the request list locked.
+ *
+ * @param job Job of the watch
+ */
+static void module_fd_done(struct pool_job *job)
+{
+        struct module_fd *mf = job->data;
+        struct module *parent = mf->parent;
+        int is_dead;
+
+        pthread_mutex_lock(&fd_lock);
+
+        mf->is_busy = 0;
+        if (!(is_dead = mf->is_dead) && mf->fired)
+                module_fd_queue(mf);
+
+        pthread_mutex_unlock(&fd_lock);
+
+        if (is_dead)
+                free(mf);
+
+        if (--parent->clients == 0)
+                module_unload(parent);
+}
+
+/**
+ * @brief A descriptor's callback blew its deadline.  Called with the
+ *        request list locked.
+ *
+ * @param job Job of the watch
+ */
+static void module_fd_overdue(struct pool_job *job)
+{
+        struct module_fd *mf = job->data;
+
+        fprintf(stderr, "%s: Descriptor callback took longer than %.1fs, "
+                "giving up on it.\n", mf->parent->name, job->limit);
+        module_quarantine(mf->parent);
 }
 
 /**
@@ -136,6 +891,22 @@ struct module_var *module_var_find_by_name(const char *name)
  */
 void module_var_loadsym(struct module_var *mv)
 {
+        /* Its host has the symbols. */
+        if (mv->parent->host) {
+                mv->loaded = 1;
+                return;
+        }
+
+        /* Module failed to come back from a reload. */
+        if (mv->parent->handle == NULL)
+                return;
+
+        /* Nothing to call, the module hands us its values. */
+        if (mv->is_push) {
+                mv->loaded = 1;
+                return;
+        }
+
         /* VARIABLE_STR */
         if (mv->type & VARIABLE_STR) {
                 if (mv->type & ARGSTR)
@@ -177,27 +948,164 @@ void module_var_loadsym(struct module_var *mv)
 }
 
 /**
- * @brief Run cron jobs.
+ * @brief Call a STR variable's method according to its argument type.
+ *
+ * @param mv Module var
+ * @param args Arguments, NULL for none
+ *
+ * @return String
+ */
+char *module_var_call_str(struct module_var *mv, char *args)
+{
+        if (mv->type & ARGSTR)
+                return mv->syms.f_str_str(args);
+        else if (mv->type & ARGINT)
+                return mv->syms.f_str_int((args) ? atoi(args) : -1);
+        else if (mv->type & ARGDOUBLE)
+                return mv->syms.f_str_double((args) ?
+                                             strtod(args, NULL) : -1.0);
+
+        return mv->syms.f_str();
+}
+
+/**
+ * @brief Call a BAR or GRAPH variable's method according to its argument
+ *        type.
+ *
+ * @param mv Module var
+ * @param args Arguments, NULL for none
+ *
+ * @return Integer
+ */
+unsigned int module_var_call_int(struct module_var *mv, char *args)
+{
+        if (mv->type & ARGSTR)
+                return mv->syms.f_int_str(args);
+        else if (mv->type & ARGINT)
+                return mv->syms.f_int_int((args) ? atoi(args) : -1);
+        else if (mv->type & ARGDOUBLE)
+                return mv->syms.f_int_double((args) ?
+                                             strtod(args, NULL) : -1.0);
+
+        return mv->syms.f_int();
+}
+
+/**
+ * @brief Hand the cron jobs that are due to the workers.  Each one goes
+ *        on its module's strand, ahead of anything the request handler
+ *        hands out after, so variables see what it filled in.
+ *
+ * @param now Current CLOCK_MONOTONIC time
+ * @param fallback Period for crons without a timeout of their own
  */
-void module_var_cron_exec(void)
+void module_var_cron_exec(double now, double fallback)
 {
+        struct deadline *n;
         struct module_var *cur;
 
-        cur = mv_start;
+        cron_fallback = fallback;
 
-        while (cur) {
-                if (cur->type == VARIABLE_CRON &&
-                    (get_time() - cur->last_update) >= cur->timeout) {
-                        if (cur->loaded) {
-                                cur->syms.f_void();
-                                cur->last_update = get_time();
-                        }
+        while ((n = deadline_top(&cron_heap)) && n->due <= now) {
+                cur = MV_OF(n);
+
+                /* Try again once its module is out of the doghouse. */
+                if (module_is_quarantined(cur->parent, now)) {
+                        deadline_set(&cron_heap, n,
+                                     cur->parent->quarantine_until);
+                        continue;
                 }
-                
-                cur = cur->next;
+
+                deadline_del(&cron_heap, n);
+
+                /* The module stays loaded until it's back. */
+                cur->parent->clients++;
+                cur->job.limit = cur->deadline;
+                pool_submit(&cur->parent->strand, &cur->job);
         }
 }
 
+/**
+ * @brief Run a cron job, on a worker.
+ *
+ * @param job Job of the cron's module_var
+ */
+static void module_var_cron_work(struct pool_job *job)
+{
+        struct module_var *mv = job->data;
+
+        if (mv->parent->host)
+                host_cron(mv->parent->host, mv);
+        else if (mv->loaded)
+                mv->syms.f_void();
+
+        mem_list_clear();
+}
+
+/**
+ * @brief A cron job is back, work out when it goes next.  Called with the
+ *        request list locked.
+ *
+ * @param job Job of the cron's module_var
+ */
+static void module_var_cron_done(struct pool_job *job)
+{
+        struct module_var *mv = job->data;
+        struct module *parent = mv->parent;
+
+        mv->last_update = get_time();
+
+        deadline_set(&cron_heap, &mv->sched,
+                     module_var_next(mv, (mv->timeout > 0) ?
+                                     mv->timeout : cron_fallback, mv->phase));
+
+        if (--parent->clients == 0)
+                module_unload(parent);
+}
+
+/**
+ * @brief A cron job blew its deadline.  Called with the request list
+ *        locked.
+ *
+ * @param job Job of the cron's module_var
+ */
+static void module_var_cron_overdue(struct pool_job *job)
+{
+        struct module_var *mv = job->data;
+
+        fprintf(stderr, "%s: Took longer than %.1fs, giving up on it.\n",
+                mv->name, job->limit);
+        module_quarantine(mv->parent);
+}
+
+/**
+ * @brief Somebody set the clock, so the aligned crons that are waiting
+ *        are due at the wrong time.  Called with the request list locked.
+ */
+void module_var_cron_realign(void)
+{
+        struct module_var *mv;
+
+        for (mv = mv_start; mv; mv = mv->next)
+                if (mv->is_aligned && mv->sched.slot != -1)
+                        deadline_set(&cron_heap, &mv->sched,
+                                     module_var_next(mv, (mv->timeout > 0) ?
+                                                     mv->timeout :
+                                                     cron_fallback,
+                                                     mv->phase));
+}
+
+/**
+ * @brief When the next cron job is due.
+ *
+ * @return CLOCK_MONOTONIC time, 0 if there aren't any
+ */
+double module_var_cron_next(void)
+{
+        struct deadline *n = deadline_top(&cron_heap);
+
+        return (n) ? n->due : 0;
+}
+
 /**
  * @brief Load up the symbol pointer for crons.
  *
@@ -211,11 +1119,20 @@ void module_var_cron_init(struct module *parent)
 
         while (cur) {
                 if (cur->parent == parent) {
-                        cur->syms.f_void =
-                                module_get_sym(parent->handle, cur->method);
+                        if (parent->host == NULL && !cur->is_push)
+                                cur->syms.f_void =
+                                        module_get_sym(parent->handle,
+                                                       cur->method);
 
                         /* Loaded flag. */
                         cur->loaded = 1;
+
+                        /* Crons go right away, then on their own grid. */
+                        if (cur->type == VARIABLE_CRON) {
+                                cur->phase = deadline_phase(cur->name, NULL);
+                                deadline_set(&cron_heap, &cur->sched,
+                                          get_mono_time());
+                        }
                 }
                 
                 cur = cur->next;
@@ -250,10 +1167,15 @@ static struct module *module_add(const char *name,
         n->handle = handle;
         n->destroy = destroy;
         n->clients = 0;
+        n->host = NULL;
 
         if (!find) {
                 n->prev = NULL;
                 n->next = NULL;
+                pool_strand_init(&n->strand);
+                n->quarantine_until = 0;
+                n->backoff = 0;
+                n->is_reload_pending = 0;
         }
 
         if (find)
@@ -297,6 +1219,24 @@ static struct module *module_find_by_name(const char *name)
         return NULL;
 }
 
+/**
+ * @brief Find module by path.
+ *
+ * @param path Path to the module
+ *
+ * @return Module, NULL if it isn't there
+ */
+static struct module *module_find_by_path(const char *path)
+{
+        struct module *cur;
+
+        for (cur = m_start; cur; cur = cur->next)
+                if (!strcmp(cur->path, path))
+                        return cur;
+
+        return NULL;
+}
+
 /**
  * @brief Unload a module.
  *
@@ -312,24 +1252,39 @@ void module_unload(struct module *cur)
 
         DEBUGF(("Unloading module %s... ", cur->name));
 
-        destroy = cur->destroy;
-        destroy();
-        dlclose(cur->handle);
+        module_fd_drop_all(cur);
+
+        /* A module that failed to reload has nothing to tear down.  The
+         * sampler has to keep out until its variables are marked. */
+        sampler_hold();
+        if ((destroy = cur->destroy))
+                destroy();
+        if (cur->handle)
+                dlclose(cur->handle);
 
         cur->destroy = NULL;
         cur->handle = NULL;
         cur->clients = 0;
 
-        /* Set all module_var loaded flags to 0. */
+        /* Set all module_var loaded flags to 0, and crons are done. */
         mv = mv_start;
 
         while (mv) {
-                if (mv->parent == cur)
+                if (mv->parent == cur) {
                         mv->loaded = 0;
+                        deadline_del(&cron_heap, &mv->sched);
+
+                        /* It'll publish again once it's back. */
+                        pthread_mutex_lock(&push_lock);
+                        mv->push_have = 0;
+                        pthread_mutex_unlock(&push_lock);
+                }
                 
                 mv = mv->next;
         }
 
+        sampler_release();
+
         DEBUGF(("done.\n"));
 }
 
@@ -348,6 +1303,10 @@ int module_load(char *path)
         void *module_destroy;
         struct module *cur;
 
+        /* Isolated modules stay loaded over in their host. */
+        if ((cur = module_find_by_path(path)) && cur->host)
+                return 1;
+
         if ((handle = dlopen(path, RTLD_LAZY)) == NULL) {
                 fprintf(stderr, "%s: Could not open: %s\n", path, dlerror());
                 return 0;
@@ -377,6 +1336,296 @@ int module_load(char *path)
         return 1;
 }
 
+/**
+ * @brief Load a module and leave it loaded for good, for a module host.
+ *
+ * @param path Path to the module
+ *
+ * @return Module, NULL on failure
+ */
+struct module *module_load_kept(char *path)
+{
+        first_load = 0;
+
+        if (!module_load(path))
+                return NULL;
+
+        return module_find_by_path(path);
+}
+
+/**
+ * @brief Add a module that lives in a module host.  Its variables get
+ *        added as the host reports them.
+ *
+ * @param name Module name
+ * @param path Path to the module
+ * @param host Its host
+ *
+ * @return Module just added
+ */
+struct module *module_add_hosted(const char *name,
+                                 const char *path,
+                                 struct module_host *host)
+{
+        struct module *cur;
+
+        cur = module_add(name, path, NULL, NULL);
+        cur->host = host;
+
+        return cur;
+}
+
+/**
+ * @brief Bring modules in line with a freshly parsed config.  Loaded
+ *        modules whose section changed get reloaded, everything else is
+ *        left alone.  The module_var nodes themselves stay put, so requests
+ *        pointing at them stay good.  Call with the request list locked.
+ *
+ * @param old The config we were running with
+ */
+void module_reconfigure(struct mod_ls *old)
+{
+        struct module *m;
+        struct module_var *mv;
+
+        for (m = m_start; m; m = m->next) {
+                /* A host starts over with the new config when it's next
+                 * needed. */
+                if (m->host) {
+                        if (cfg_mod_changed(old, m->name))
+                                host_restart(m->host);
+                        continue;
+                }
+
+                if (m->handle == NULL ||
+                    (!m->is_reload_pending && !cfg_mod_changed(old, m->name)))
+                        continue;
+
+                /* Pulling the module out from under it would be worse, so
+                 * module_reconfigure_pending() gets it once it's back. */
+                if (pool_strand_busy(&m->strand)) {
+                        fprintf(stderr, "%s: Stuck in a call, reloading it "
+                                "once it's back.\n", m->name);
+                        m->is_reload_pending = 1;
+                        continue;
+                }
+
+                DEBUGF(("Settings for %s changed, reloading.\n", m->name));
+                m->is_reload_pending = 0;
+                if (!module_reload(m))
+                        fprintf(stderr, "%s: Reload failed, its variables "
+                                "are offline.\n", m->name);
+        }
+
+        /* Timeouts come straight from the config, no reload needed. */
+        for (mv = mv_start; mv; mv = mv->next) {
+                mv->timeout = get_double_key((mv->type == VARIABLE_CRON) ?
+                                             "cron" : "timeout",
+                                             mv->name, mv->default_timeout);
+                mv->deadline = module_var_deadline(mv->name, mv->type);
+        }
+}
+
+/**
+ * @brief Reload the modules module_reconfigure() had to skip, once their
+ *        calls are back.  The request handler tries every pass.  Call with
+ *        the request list locked.
+ */
+void module_reconfigure_pending(void)
+{
+        struct module *m;
+        int is_paused = 0;
+
+        for (m = m_start; m; m = m->next) {
+                if (!m->is_reload_pending || pool_strand_busy(&m->strand))
+                        continue;
+
+                if (!is_paused) {
+                        pool_pause();
+                        is_paused = 1;
+                }
+
+                /* Might have started on another one before the pause. */
+                if (pool_strand_busy(&m->strand))
+                        continue;
+
+                m->is_reload_pending = 0;
+                if (m->handle == NULL)
+                        continue;
+
+                DEBUGF(("%s is back, reloading it.\n", m->name));
+                if (!module_reload(m))
+                        fprintf(stderr, "%s: Reload failed, its variables "
+                                "are offline.\n", m->name);
+        }
+
+        if (is_paused)
+                pool_resume();
+}
+
+/**
+ * @brief Say which modules are in the middle of a call, before waiting
+ *        on them.
+ */
+void module_report_busy(void)
+{
+        struct module *m;
+
+        for (m = m_start; m; m = m->next)
+                if (pool_strand_busy(&m->strand))
+                        fprintf(stderr, "%s: In the middle of a call, "
+                                "waiting on it.\n", m->name);
+}
+
+/**
+ * @brief How long a call of a variable's method gets before we give up on
+ *        it, <name>_deadline next to its timeout.
+ *
+ * @param name Variable name
+ * @param type Variable type
+ *
+ * @return Seconds, 0 for forever
+ */
+static double module_var_deadline(const char *name, unsigned char type)
+{
+        char key[80];
+
+        sprintf(key, "%.64s_deadline", name);
+
+        return get_double_key((type == VARIABLE_CRON) ? "cron" : "timeout",
+                              key, DEFAULT_DEADLINE);
+}
+
+/**
+ * @brief Whether a variable runs on wall clock multiples of its timeout,
+ *        <variable>_align in [timeout], or [cron] for crons.
+ *
+ * @param name Variable
+ * @param type Its type
+ * @param otherwise What the module wants
+ *
+ * @return 1 if it does, 0 if not
+ */
+static int module_var_aligned(const char *name,
+                              unsigned char type,
+                              int otherwise)
+{
+        char key[80];
+
+        sprintf(key, "%.64s_align", name);
+
+        return get_bool_key((type == VARIABLE_CRON) ? "cron" : "timeout",
+                            key, otherwise);
+}
+
+/**
+ * @brief One of a module's methods hung, so leave the module alone for a
+ *        while.  That doubles every time it hangs again soon after, and
+ *        starts over once it's behaved for a good while.
+ *
+ * @param cur Module
+ */
+void module_quarantine(struct module *cur)
+{
+        double base;
+        double now = get_mono_time();
+
+        base = get_double_key("daemon", "quarantine", DEFAULT_QUARANTINE);
+
+        if (cur->backoff > 0 &&
+            now - cur->quarantine_until < cur->backoff * 4)
+                cur->backoff *= 2;
+        else
+                cur->backoff = base;
+
+        if (cur->backoff > base * 64)
+                cur->backoff = base * 64;
+
+        cur->quarantine_until = now + cur->backoff;
+
+        fprintf(stderr, "%s: Hung, leaving it alone for %.1fs.\n",
+                cur->name, cur->backoff);
+
+        /* Its worker's waiting on the host, this gets it back. */
+        if (cur->host)
+                host_kill(cur->host);
+}
+
+/**
+ * @brief See if a module is being left alone.
+ *
+ * @param cur Module
+ * @param now Current CLOCK_MONOTONIC time
+ *
+ * @return 1 if it is, 0 if not
+ */
+int module_is_quarantined(struct module *cur, double now)
+{
+        return now < cur->quarantine_until;
+}
+
+/**
+ * @brief Reload a loaded module in place, keeping its clients.  It gets a
+ *        fresh start, so it picks up its new settings from module_init.
+ *
+ * @param cur Module
+ *
+ * @return 1 for success, 0 for failure
+ */
+static int module_reload(struct module *cur)
+{
+        void *(*destroy)(void);
+        void (*module_init)(struct module *);
+        struct module_var *mv;
+        void *handle;
+
+        module_fd_drop_all(cur);
+
+        /* Keep the sampler out until there are symbols to call again. */
+        sampler_hold();
+
+        destroy = cur->destroy;
+        destroy();
+        dlclose(cur->handle);
+
+        cur->handle = NULL;
+        cur->destroy = NULL;
+
+        /* Nothing gets called until we have symbols again. */
+        for (mv = mv_start; mv; mv = mv->next)
+                if (mv->parent == cur)
+                        mv->loaded = 0;
+
+        if ((handle = dlopen(cur->path, RTLD_LAZY)) == NULL) {
+                fprintf(stderr, "%s: Could not open: %s\n",
+                        cur->path, dlerror());
+                sampler_release();
+                return 0;
+        }
+
+        module_init = module_get_sym(handle, "module_init");
+        cur->destroy = module_get_sym(handle, "module_destroy");
+
+        if (module_init == NULL || cur->destroy == NULL) {
+                dlclose(handle);
+                cur->destroy = NULL;
+                sampler_release();
+                return 0;
+        }
+
+        cur->handle = handle;
+        module_init(cur);
+
+        /* Same nodes as before, they just need their symbols back. */
+        for (mv = mv_start; mv; mv = mv->next)
+                if (mv->parent == cur)
+                        module_var_loadsym(mv);
+
+        sampler_release();
+
+        return 1;
+}
+
 /**
  * @brief Load all modules in the main lib directory.
  */
@@ -385,6 +1634,8 @@ void module_load_all(void)
         DIR *d;
         struct dirent *dir;
         char full_path[MAXPATHLEN];
+        char name[64];
+        const char *group;
         char *sptr;
 
         if ((d = opendir(LIBDIR)) == NULL) {
@@ -408,8 +1659,16 @@ void module_load_all(void)
                         strfcat(full_path, "/", sizeof(full_path));
                         strfcat(full_path, dir->d_name, sizeof(full_path));
 
+                        /* Sections are named after the file. */
+                        strfcpy(name, dir->d_name, sizeof(name));
+                        if ((size_t) (sptr - dir->d_name) < sizeof(name))
+                                name[sptr - dir->d_name] = '\0';
+
                         DEBUGF(("Attempting to load: %s\n", full_path));
-                        module_load(full_path);
+                        if ((group = host_isolated(name)))
+                                host_register(full_path, group);
+                        else
+                                module_load(full_path);
                 }
         }
 
@@ -462,10 +1721,15 @@ void clear_module(void)
                 mn = m->next;
 
                 free(m->path);
-                if ((destroy = m->destroy))
-                        destroy();
-                if (m->handle)
-                        dlclose(m->handle);
+                module_fd_drop_all(m);
+
+                /* Something's still stuck in there, leave it be. */
+                if (!pool_strand_busy(&m->strand)) {
+                        if ((destroy = m->destroy))
+                                destroy();
+                        if (m->handle)
+                                dlclose(m->handle);
+                }
                 free(m);
                 
                 m = mn;
@@ -476,13 +1740,17 @@ void clear_module(void)
         while (mv) {
                 mvn = mv->next;
 
+                free(mv->push_str);
                 free(mv);
                 
                 mv = mvn;
         }
 
+        deadline_clear(&cron_heap);
+
         m_start = m_end = NULL;
         mv_start = mv_end = NULL;
+        push_start = push_end = NULL;
 
         first_load = 1;
 }
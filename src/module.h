@@ -13,6 +13,11 @@
 #ifndef MODULE_H
 #define MODULE_H
 
+#include "cfg.h"
+#include "deadline.h"
+#include "event.h"
+#include "pool.h"
+
 #define VARIABLE_STR 1   /* Function should return char * */
 #define VARIABLE_BAR 2   /* Function should return int between 0 and 100 */
 #define VARIABLE_GRAPH 4 /* Function should return int between 0 and 100 */
@@ -20,6 +25,10 @@
 #define ARGSTR 16        /* Function takes a char * argument */
 #define ARGINT 32        /* Function takes an int argument */
 #define ARGDOUBLE 64     /* Function takes a double argument */
+#define VARIABLE_STALE 128 /* Not a type, sent with n/a when a method hung */
+#define VARIABLE_SAMPLED 256 /* Not a type, sent with sampled min/max/mean */
+
+struct module_host;
 
 struct module {
         char name[64];  /* Unique identifier, value really doesn't matter. */
@@ -27,6 +36,11 @@ struct module {
         void *handle;   /* Handle to the code in memory. */
         void *destroy;  /* Pointer to the module_destroy function. */
         int clients;    /* How many clients are using this module? */
+        struct pool_strand strand;      /* Its methods run one at a time. */
+        double quarantine_until;        /* Left alone until then, it hung. */
+        double backoff;                 /* How long it was left alone. */
+        struct module_host *host;       /* Runs over there, NULL for here. */
+        int is_reload_pending;  /* Changed while it was stuck (bool) */
 
         struct module *next;
         struct module *prev;
@@ -54,12 +68,33 @@ struct module_var {
         
         int loaded;              /* Loaded (bool) */
         double timeout;          /* Used for cron jobs */
+        double default_timeout;  /* What the module asked for. */
+        double deadline;         /* How long a call gets, 0 for forever. */
         double last_update;      /* Ditto */
 
-        unsigned int sum;        /* Sum of chars or what have you. */
+        int shm_slot;            /* Shared memory slot, -1 for none. */
+
+        struct deadline sched;   /* When the cron runs next. */
+        double phase;            /* Where in its period it runs. */
+        int is_aligned;          /* On wall clock multiples of timeout. */
+        double slack;            /* How late it may run, -1 for default. */
+        int is_sampleable;       /* Method's fine with the sampler (bool) */
+        double sample_rate;      /* Samples a second, 0 for not sampled. */
+        struct pool_job job;     /* The cron run on a worker. */
 
         struct module *parent;   /* Parent of this module. */
 
+        /* module_var_publish() leaves the latest value here, under the push
+         * lock, until the request handler picks it up. */
+        int is_push;             /* Only ever published, never polled. */
+        int push_have;           /* Something was published (bool) */
+        int push_dirty;          /* Not picked up yet (bool) */
+        double push_stamp;       /* When, seconds since epoch */
+        char *push_str;          /* Value of STR variables */
+        size_t push_size;
+        unsigned int push_num;   /* Value of BAR and GRAPH variables */
+        struct module_var *push_next;
+
         struct module_var *next;
         struct module_var *prev;
 };
@@ -70,15 +105,54 @@ int module_var_add(const struct module *parent,
                    const char *method,
                    double timeout,
                    unsigned char type);
+struct module_var *module_var_add_push(const struct module *parent,
+                                       char *name,
+                                       unsigned char type);
+void module_var_publish(struct module_var *mv, const char *value);
+void module_var_publish_int(struct module_var *mv, unsigned int value);
+struct module_var *module_var_push_take(char **str,
+                                        size_t *size,
+                                        unsigned int *num,
+                                        double *stamp);
+int module_var_push_peek(struct module_var *mv,
+                         char **str,
+                         size_t *size,
+                         unsigned int *num,
+                         double *stamp);
+int module_var_align(const struct module *parent, const char *name);
+int module_var_sample(const struct module *parent, const char *name);
+int module_var_sampled(struct module_var *mv);
+double module_var_next(struct module_var *mv, double period, double phase);
+void module_var_cron_realign(void);
+void module_var_low_wakeup(int on);
+int module_fd_add(const struct module *mod,
+                  int fd,
+                  int mask,
+                  void (*func)(int fd, int fired, void *data),
+                  void *data);
+void module_fd_del(const struct module *mod, int fd);
+void module_fd_exec(double now);
 void module_load_all(void);
 void clear_module(void);
-void module_var_cron_exec(void);
+void module_var_cron_exec(double now, double fallback);
+double module_var_cron_next(void);
 void *module_get_sym(void *handle, char *name);
 struct module_var *module_var_find_by_name(const char *name);
 void module_var_loadsym(struct module_var *mv);
+char *module_var_call_str(struct module_var *mv, char *args);
+unsigned int module_var_call_int(struct module_var *mv, char *args);
 int module_load(char *path);
+struct module *module_load_kept(char *path);
+struct module *module_add_hosted(const char *name,
+                                 const char *path,
+                                 struct module_host *host);
 void module_unload(struct module *cur);
 void module_var_cron_init(struct module *parent);
+void module_reconfigure(struct mod_ls *old);
+void module_reconfigure_pending(void);
+void module_report_busy(void);
+void module_quarantine(struct module *cur);
+int module_is_quarantined(struct module *cur, double now);
 
 #endif /* MODULE_H */
 
@@ -32,6 +32,8 @@
 
 char module_name[] = "mpd";
 
+#define MPD_WAIT 5.0    /* Seconds we wait on mpd before giving up */
+
 /* My function prototypes. */
 static int start_connection(void);
 static void mpd_free_everythang(void);
@@ -189,7 +191,11 @@ static void pop_status(void)
                         break;
         }
 
-        i = recv(mpd_sock, buffer, sizeof(buffer), 0);
+        /* The worker gets on with other modules while mpd thinks. */
+        if (donky_await_readable(mpd_sock, MPD_WAIT) != 1)
+                i = -1;
+        else
+                i = recv(mpd_sock, buffer, sizeof(buffer) - 1, 0);
         if (i <= 0) {
                 fprintf(stderr, "Motha effin' prob reading from mpd!\n");
                 return;
@@ -231,7 +237,11 @@ static void pop_currentsong(void)
                         break;
         }
 
-        i = recv(mpd_sock, buffer, sizeof(buffer), 0);
+        /* The worker gets on with other modules while mpd thinks. */
+        if (donky_await_readable(mpd_sock, MPD_WAIT) != 1)
+                i = -1;
+        else
+                i = recv(mpd_sock, buffer, sizeof(buffer) - 1, 0);
         if (i <= 0) {
                 fprintf(stderr, "Motha effin' prob reading from mpd!\n");
                 return;
@@ -356,7 +366,8 @@ static int start_connection(void)
                 return 0;
         }
 
-        if ((connect(mpd_sock, (struct sockaddr *) &server, sizeof(server)) == -1)) {
+        if (sock_connect(mpd_sock, (struct sockaddr *) &server,
+                         sizeof(server), MPD_WAIT) == -1) {
                 fprintf(stderr, "Could not connect to mpd socket: %s\n",
                         strerror(errno));
                 close(mpd_sock);
@@ -365,7 +376,9 @@ static int start_connection(void)
         }
 
         /* Wait for OK */
-        bytes = recv(mpd_sock, data, 32, 0);
+        if (donky_await_readable(mpd_sock, MPD_WAIT) != 1 ||
+            (bytes = recv(mpd_sock, data, sizeof(data) - 1, 0)) <= 0)
+                return 0;
         data[bytes] = '\0';
 
         if (strstr(data, "OK MPD"))
@@ -31,6 +31,7 @@
 #define SCROB_CLIENT "tst"
 #define SCROB_VERSION "1.0"
 #define SCROB_RETRIES 3
+#define SCROB_WAIT 10.0        /* Seconds we wait on the server */
 
 /* Reminder: implement the caching feature while local/remote network connection
  * is down.  Most clients seem to write to a cache file, might be better for
@@ -213,7 +214,10 @@ static int scrob_handshake(int sock)
                  utm_md5,
                  scrob_host);
 
-        n = recv(sock, buf, sizeof(buf), 0);
+        if (donky_await_readable(sock, SCROB_WAIT) != 1)
+                n = -1;
+        else
+                n = recv(sock, buf, sizeof(buf) - 1, 0);
         if (n <= 0) {
                 fprintf(stderr, "mpdscrob: Socket disconnected!\n");
                 return -1;
@@ -431,7 +435,10 @@ static void scrob_send_submission(int sock, const char *snd, const char *url)
                 sendx(sock, "\r\n");
                 sendx(sock, snd);
 
-                n = recv(sock, buf, sizeof(buf), 0);
+                if (donky_await_readable(sock, SCROB_WAIT) != 1)
+                        return;
+
+                n = recv(sock, buf, sizeof(buf) - 1, 0);
                 if (n <= 0)
                         return;
 
@@ -531,7 +538,8 @@ static int scrob_connect(void)
                 return -1;
         }
 
-        if ((connect(sock, (struct sockaddr *) &server, sizeof(server)) == -1)) {
+        if (sock_connect(sock, (struct sockaddr *) &server,
+                         sizeof(server), SCROB_WAIT) == -1) {
                 fprintf(stderr, "Could not connect to scrob socket: %s\n",
                         strerror(errno));
                 close(sock);
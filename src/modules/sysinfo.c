@@ -10,6 +10,7 @@
  * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
  */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/sysinfo.h>
 
@@ -24,6 +25,13 @@ char module_name[] = "sysinfo"; /* Up to 63 characters, any more and it will
 /* Globals. */
 static char *ret = NULL;
 static struct sysinfo info;
+/* Jiffies as of the last cpubar.  It takes no args, so there's only ever
+ * the one series and this is its baseline.  The lock's for the odd reload
+ * that moves it between the sampler and the workers mid-call. */
+static unsigned long cpu_busy = 0;
+static unsigned long cpu_total = 0;
+static unsigned int cpu_last = 0;
+static pthread_mutex_t cpu_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /**
  * @brief This is run on module initialization.
@@ -44,6 +52,10 @@ void module_init(struct module *mod)
         module_var_add(mod, "totalhigh", "get_totalhigh", 0.0, VARIABLE_STR);
         module_var_add(mod, "freehigh", "get_freehigh", 15.0, VARIABLE_STR);
         module_var_add(mod, "usedhigh", "get_usedhigh", 15.0, VARIABLE_STR);
+        module_var_add(mod, "cpubar", "get_cpubar", 1.0, VARIABLE_BAR);
+
+        /* cpubar only touches its own stuff, so it can be sampled. */
+        module_var_sample(mod, "cpubar");
 }
 
 /**
@@ -198,3 +210,51 @@ char *get_usedhigh(void)
         
         return m_freelater(bytes_to_bigger((info.totalhigh - info.freehigh) * info.mem_unit));
 }
+
+/**
+ * @brief How busy all the CPUs were since the last time this was called,
+ *        out of /proc/stat.
+ *
+ * @return Percent
+ */
+unsigned int get_cpubar(void)
+{
+        FILE *f;
+        unsigned long v[8];
+        unsigned long busy, total;
+        unsigned int pct;
+        int i, n;
+
+        if ((f = fopen("/proc/stat", "r")) == NULL)
+                return 0;
+
+        for (i = 0; i < 8; i++)
+                v[i] = 0;
+
+        /* user nice system idle iowait irq softirq steal */
+        n = fscanf(f, "cpu %lu %lu %lu %lu %lu %lu %lu %lu",
+                   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+        fclose(f);
+
+        if (n < 4)
+                return 0;
+
+        for (total = 0, i = 0; i < 8; i++)
+                total += v[i];
+        busy = total - v[3] - v[4];
+
+        pthread_mutex_lock(&cpu_lock);
+
+        /* Not a single tick since last time, nothing new to say.  The
+         * first time around it's since boot. */
+        if (total != cpu_total) {
+                cpu_last = (busy - cpu_busy) * 100 / (total - cpu_total);
+                cpu_busy = busy;
+                cpu_total = total;
+        }
+        pct = cpu_last;
+
+        pthread_mutex_unlock(&cpu_lock);
+
+        return pct;
+}
@@ -19,7 +19,7 @@
 #include "../mem.h"
 #include "../module.h"
 
-char module_name[] = "wifi_pwn_edition";
+char module_name[] = "wifi"; /* Same as the config section, for reloads. */
 
 /* Globals */
 static const char *interface;
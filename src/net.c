@@ -10,17 +10,25 @@
  * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <arpa/inet.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
+#include "event.h"
 #include "net.h"
+#include "pool.h"
+#include "util.h"
 
 /**
  * @brief Send sprintf formatted string to socket, CR-LF appended.
@@ -70,10 +78,12 @@ int sendx(int sock, const char *format, ...)
  *
  * @param host Hostname
  * @param port Port to listen on
+ * @param reuseport Set SO_REUSEPORT so several sockets can share the port
+ * @param backlog How many connections may wait to be accepted
  *
  * @return Socket!
  */
-int create_tcp_listener(const char *host, int port)
+int create_tcp_listener(const char *host, int port, int reuseport, int backlog)
 {
         int sfd;
         struct sockaddr_in server;
@@ -95,27 +105,263 @@ int create_tcp_listener(const char *host, int port)
         server.sin_port = htons((short) port);
         server.sin_addr.s_addr = INADDR_ANY;
 
+        /* Allow this to be reused (needed for reloads and such).  This only
+         * does anything if it's set before bind(). */
+        if ((setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR,
+                        &opt, sizeof(opt)) == -1)) {
+                perror("setsockopt");
+                close(sfd);
+                return -1;
+        }
+
+#ifdef SO_REUSEPORT
+        /* Every I/O thread binds its own socket, the kernel balances. */
+        if (reuseport && (setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT,
+                                     &opt, sizeof(opt)) == -1)) {
+                perror("setsockopt");
+                close(sfd);
+                return -1;
+        }
+#endif
+
         if ((bind(sfd, (struct sockaddr *) &server, sizeof(server)) == -1)) {
                 perror("bind");
                 close(sfd);
                 return -1;
         }
 
-        /* Allow this to be reused (needed for reloads and such) */
-        if ((setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR,
-                        &opt, sizeof(opt)) == -1)) {
-                perror("setsockopt");
+        /* Start listening. */
+        if ((listen(sfd, backlog) == -1)) {
+                perror("listen");
+                close(sfd);
+                return -1;
+        }
+
+        return sfd;
+}
+
+/**
+ * @brief Create a Unix domain listening socket.  A stale socket file left
+ *        behind by a previous run is removed first.
+ *
+ * @param path Filesystem path of the socket
+ * @param type SOCK_STREAM or SOCK_SEQPACKET
+ * @param backlog How many connections may wait to be accepted
+ *
+ * @return Socket!
+ */
+int create_unix_listener(const char *path, int type, int backlog)
+{
+        int sfd;
+        struct sockaddr_un server;
+        struct stat st;
+
+        if (strlen(path) >= sizeof(server.sun_path)) {
+                fprintf(stderr, "Unix socket path too long: %s\n", path);
+                return -1;
+        }
+
+        if ((sfd = socket(AF_UNIX, type, 0)) == -1) {
+                perror("socket");
+                return -1;
+        }
+
+        /* Only ever remove sockets, never some random file. */
+        if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+                unlink(path);
+
+        memset(&server, 0, sizeof(server));
+        server.sun_family = AF_UNIX;
+        strfcpy(server.sun_path, path, sizeof(server.sun_path));
+
+        if ((bind(sfd, (struct sockaddr *) &server, sizeof(server)) == -1)) {
+                perror("bind");
                 close(sfd);
                 return -1;
         }
 
         /* Start listening. */
-        if ((listen(sfd, 10) == -1)) {
+        if ((listen(sfd, backlog) == -1)) {
                 perror("listen");
                 close(sfd);
+                unlink(path);
                 return -1;
         }
 
         return sfd;
 }
 
+/**
+ * @brief Turn O_NONBLOCK on or off for a socket.
+ *
+ * @param sock Socket
+ * @param on 1 for non-blocking, 0 for blocking
+ *
+ * @return 0 on success, -1 on failure
+ */
+int sock_set_nonblock(int sock, int on)
+{
+        int flags;
+
+        if ((flags = fcntl(sock, F_GETFL, 0)) == -1) {
+                perror("fcntl");
+                return -1;
+        }
+
+        flags = (on) ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+
+        if (fcntl(sock, F_SETFL, flags) == -1) {
+                perror("fcntl");
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Wait for a descriptor to be readable, from a module.  Other
+ *        modules get the worker in the meantime instead of it sitting
+ *        there blocked.
+ *
+ * @param fd Descriptor
+ * @param timeout Seconds to wait at most, negative for no limit
+ *
+ * @return 1 if it's readable, 0 if it timed out, -1 on error
+ */
+int donky_await_readable(int fd, double timeout)
+{
+        return pool_await(fd, EVENT_READ, timeout);
+}
+
+/**
+ * @brief Wait for a descriptor to be writable, from a module.
+ *
+ * @param fd Descriptor
+ * @param timeout Seconds to wait at most, negative for no limit
+ *
+ * @return 1 if it's writable, 0 if it timed out, -1 on error
+ */
+int donky_await_writable(int fd, double timeout)
+{
+        return pool_await(fd, EVENT_WRITE, timeout);
+}
+
+/**
+ * @brief connect() that waits with donky_await_writable() instead of
+ *        blocking.  The socket's left blocking, like it was.
+ *
+ * @param sock Socket
+ * @param addr Address to connect to
+ * @param len Size of addr
+ * @param timeout Seconds to wait at most, negative for no limit
+ *
+ * @return 0 on success, -1 on failure (errno is set)
+ */
+int sock_connect(int sock,
+                 const struct sockaddr *addr,
+                 socklen_t len,
+                 double timeout)
+{
+        socklen_t errlen = sizeof(int);
+        int err = 0;
+
+        if (sock_set_nonblock(sock, 1) == -1)
+                return -1;
+
+        if (connect(sock, addr, len) == -1) {
+                if (errno != EINPROGRESS)
+                        err = errno;
+                else if (donky_await_writable(sock, timeout) != 1)
+                        err = ETIMEDOUT;
+                else if (getsockopt(sock, SOL_SOCKET, SO_ERROR,
+                                    &err, &errlen) == -1)
+                        err = errno;
+        }
+
+        sock_set_nonblock(sock, 0);
+
+        if (err) {
+                errno = err;
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Create a UDP socket for sending to a multicast group.  If addr
+ *        isn't a multicast address it's taken to be a broadcast (or plain
+ *        unicast) address and SO_BROADCAST is turned on instead.
+ *
+ * @param addr Group or broadcast address
+ * @param port Destination port
+ * @param ttl Multicast TTL, 1 keeps it on the local network
+ * @param iface Local address to send multicast from, NULL for the default
+ * @param dest Filled in with the destination for sendto()
+ *
+ * @return Socket!
+ */
+int create_udp_sender(const char *addr,
+                      int port,
+                      int ttl,
+                      const char *iface,
+                      struct sockaddr_in *dest)
+{
+        int sfd;
+        struct hostent *hptr;
+        struct in_addr local;
+        unsigned char mttl = ttl;
+        int opt = 1;
+
+        if ((hptr = gethostbyname(addr)) == NULL) {
+                fprintf(stderr, "Could not gethostbyname(%s)\n", addr);
+                return -1;
+        }
+
+        memset(dest, 0, sizeof(*dest));
+        memcpy(&dest->sin_addr, hptr->h_addr_list[0], hptr->h_length);
+        dest->sin_family = AF_INET;
+        dest->sin_port = htons((short) port);
+
+        if ((sfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+                perror("socket");
+                return -1;
+        }
+
+        if (!IN_MULTICAST(ntohl(dest->sin_addr.s_addr))) {
+                if (setsockopt(sfd, SOL_SOCKET, SO_BROADCAST,
+                               &opt, sizeof(opt)) == -1) {
+                        perror("setsockopt");
+                        close(sfd);
+                        return -1;
+                }
+
+                return sfd;
+        }
+
+        if (setsockopt(sfd, IPPROTO_IP, IP_MULTICAST_TTL,
+                       &mttl, sizeof(mttl)) == -1) {
+                perror("setsockopt");
+                close(sfd);
+                return -1;
+        }
+
+        if (iface) {
+                if ((hptr = gethostbyname(iface)) == NULL) {
+                        fprintf(stderr, "Could not gethostbyname(%s)\n",
+                                iface);
+                        close(sfd);
+                        return -1;
+                }
+
+                memcpy(&local, hptr->h_addr_list[0], sizeof(local));
+                if (setsockopt(sfd, IPPROTO_IP, IP_MULTICAST_IF,
+                               &local, sizeof(local)) == -1) {
+                        perror("setsockopt");
+                        close(sfd);
+                        return -1;
+                }
+        }
+
+        return sfd;
+}
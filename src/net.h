@@ -13,8 +13,24 @@
 #ifndef NET_H
 #define NET_H
 
+#include <netinet/in.h>
+#include <sys/socket.h>
+
 int sendcrlf(int sock, const char *format, ...);
 int sendx(int sock, const char *format, ...);
-int create_tcp_listener(const char *host, int port);
+int create_tcp_listener(const char *host, int port, int reuseport, int backlog);
+int create_unix_listener(const char *path, int type, int backlog);
+int sock_set_nonblock(int sock, int on);
+int donky_await_readable(int fd, double timeout);
+int donky_await_writable(int fd, double timeout);
+int sock_connect(int sock,
+                 const struct sockaddr *addr,
+                 socklen_t len,
+                 double timeout);
+int create_udp_sender(const char *addr,
+                      int port,
+                      int ttl,
+                      const char *iface,
+                      struct sockaddr_in *dest);
 
 #endif /* NET_H */
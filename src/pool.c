@@ -0,0 +1,1176 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "../config.h"
+#include "cfg.h"
+#include "deadline.h"
+#include "default_settings.h"
+#include "event.h"
+#include "mem.h"
+#include "pool.h"
+#include "util.h"
+
+/* The fiber a deadline heap node is in. */
+#define FIBER_OF(n) ((struct pool_fiber *) ((char *) (n) - \
+                     offsetof(struct pool_fiber, sched)))
+
+/**
+ * Jobs run on fibers of their own, so one waiting on a socket in
+ * pool_await() can step aside and let its worker get on with other
+ * modules.  A fiber comes back on the worker it started on, unless that
+ * one's been given up on, then it goes to whoever its strand goes to.  So
+ * nothing per thread (errno and the like) survives pool_await().
+ */
+struct pool_fiber {
+        int is_io;              /* Always 0, see struct pool_io */
+        ucontext_t ctx;
+        char *stack;            /* mmap'd, guard page at the bottom */
+        struct pool_worker *w;
+        struct pool_strand *strand;
+        struct pool_job *job;
+        void *mem;              /* Its m_malloc list */
+
+        int fd;                 /* What it's waiting on */
+        int mask;
+        int fired;              /* What it got, 0 if it timed out */
+        int is_parked;          /* bool */
+        int is_done;            /* Finished its job (bool) */
+        struct deadline sched;  /* When it stops waiting */
+
+        struct pool_fiber *prev;        /* Only on the parked list */
+        struct pool_fiber *next;
+};
+
+/**
+ * Each worker has a deque of strands.  It takes from the front of its own,
+ * and when that's empty it steals from the back of somebody else's.
+ */
+struct pool_worker {
+        int num;
+        pthread_t thread;
+        int is_launched;        /* bool */
+        int is_wedged;          /* Given up on, leaves after its job (bool) */
+
+        struct pool_strand *strand;     /* What it's running */
+        struct pool_job *job;
+
+        struct pool_strand *head;
+        struct pool_strand *tail;
+
+        ucontext_t home;                /* Where fibers switch back to */
+        struct pool_fiber *spare;       /* Done with, stacks and all */
+        struct pool_fiber *ready_start; /* Done waiting, want back on */
+        struct pool_fiber *ready_end;
+};
+
+/* Globals. */
+static struct pool_worker pool_workers[POOL_MAX_WORKERS];
+static int pool_count = 0;             /* Slots that have been used */
+static int pool_next = 0;               /* Home for the next new strand */
+static int pool_queued = 0;             /* Strands waiting in deques */
+static int pool_running = 0;            /* Jobs on workers right now */
+static int pool_paused = 0;             /* bool */
+static int pool_stopping = 0;           /* bool */
+static struct pool_job *done_start = NULL;
+static struct pool_job *done_end = NULL;
+static void (*pool_poke)(void) = NULL;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;
+static struct event_loop *await_loop = NULL;   /* Parked fibers' fds */
+static struct deadline_heap await_heap;         /* And when they give up */
+static struct pool_fiber *parked_start = NULL;  /* In pool_await() */
+static pthread_t await_thread;
+static int await_launched = 0;                  /* bool */
+static int await_is_waiting = 0;                /* bool, in event_wait() */
+static unsigned long await_rounds = 0;          /* event_wait()s handled */
+static pthread_cond_t await_done = PTHREAD_COND_INITIALIZER;
+static pthread_key_t fiber_key;                 /* Fiber a thread's in */
+static pthread_once_t fiber_once = PTHREAD_ONCE_INIT;
+
+/* Function prototypes. */
+static int pool_spawn(int i);
+static void *pool_worker_run(void *arg);
+static int pool_finish(struct pool_worker *w);
+static int pool_give_up(double now, struct pool_job **late);
+static double pool_soonest(void);
+static struct pool_worker *pool_home(struct pool_strand *s);
+static void pool_push(struct pool_worker *w, struct pool_strand *s);
+static struct pool_strand *pool_take(struct pool_worker *w);
+static void pool_fiber_key_init(void);
+static struct pool_fiber *pool_fiber_get(struct pool_worker *w);
+static void pool_fiber_run(void);
+static void pool_fiber_switch(struct pool_worker *w, struct pool_fiber *f);
+static void pool_fiber_ready(struct pool_fiber *f);
+static void pool_fiber_queue(struct pool_fiber *f);
+static void pool_fiber_free(struct pool_fiber *f);
+static void *pool_await_run(void *arg);
+static int pool_await_poll(int fd, int mask, double timeout);
+
+/**
+ * @brief Start the workers, [daemon] workers of them.  If none of them
+ *        start, submitted jobs just run right there.
+ *
+ * @param poke Called by a worker when finished jobs are waiting for
+ *             pool_collect(), with no locks of ours held
+ *
+ * @return 0 on success, -1 on failure
+ */
+int pool_start(void (*poke)(void))
+{
+        int count;
+        int i;
+
+        count = get_int_key("daemon", "workers", DEFAULT_WORKERS);
+        if (count < 1)
+                count = 1;
+        if (count > POOL_MAX_WORKERS)
+                count = POOL_MAX_WORKERS;
+
+        pool_poke = poke;
+        pool_stopping = 0;
+        pool_paused = 0;
+
+        pthread_mutex_lock(&pool_lock);
+
+        for (i = 0; i < count; i++)
+                if (pool_spawn(i) == -1)
+                        break;
+
+        pool_count = i;
+        pthread_mutex_unlock(&pool_lock);
+
+        /* Without it, pool_await() just blocks. */
+        if ((await_loop = event_loop_new()) &&
+            pthread_create(&await_thread, NULL, &pool_await_run, NULL) == 0) {
+                await_launched = 1;
+        } else if (await_loop) {
+                event_loop_free(await_loop);
+                await_loop = NULL;
+        }
+
+        return (i == count) ? 0 : -1;
+}
+
+/**
+ * @brief Start a worker in a slot.  Call with the pool locked.
+ *
+ * @param i Slot
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int pool_spawn(int i)
+{
+        struct pool_worker *w = &pool_workers[i];
+
+        w->num = i;
+        w->is_wedged = 0;
+        w->strand = NULL;
+        w->job = NULL;
+        w->ready_start = NULL;
+        w->ready_end = NULL;
+
+        if (pthread_create(&w->thread, NULL, &pool_worker_run, w) != 0)
+                return -1;
+
+        w->is_launched = 1;
+
+        return 0;
+}
+
+/**
+ * @brief Stop the workers.  Whatever they're in the middle of gets to
+ *        finish, anything still queued is dropped.
+ */
+void pool_stop(void)
+{
+        struct pool_fiber *f;
+        int i;
+
+        pthread_mutex_lock(&pool_lock);
+        pool_stopping = 1;
+        pthread_cond_broadcast(&pool_cond);
+        pthread_mutex_unlock(&pool_lock);
+
+        if (await_launched) {
+                event_wake(await_loop);
+                pthread_join(await_thread, NULL);
+                await_launched = 0;
+        }
+
+        /* Wedged ones are detached and might never come back. */
+        for (i = 0; i < POOL_MAX_WORKERS; i++) {
+                if (!pool_workers[i].is_launched ||
+                    pool_workers[i].is_wedged)
+                        continue;
+
+                pthread_join(pool_workers[i].thread, NULL);
+                pool_workers[i].is_launched = 0;
+        }
+
+        /* Fibers still waiting on something, or done waiting but never
+         * got back on, don't get to finish.  Ones on a wedged worker are
+         * still running on their stacks, so those are left be. */
+        for (i = 0; i < POOL_MAX_WORKERS; i++) {
+                while ((f = pool_workers[i].spare)) {
+                        pool_workers[i].spare = f->next;
+                        pool_fiber_free(f);
+                }
+                while ((f = pool_workers[i].ready_start)) {
+                        pool_workers[i].ready_start = f->next;
+                        pool_fiber_free(f);
+                }
+                pool_workers[i].ready_end = NULL;
+        }
+
+        while ((f = parked_start)) {
+                parked_start = f->next;
+                pool_fiber_free(f);
+        }
+
+        if (await_loop) {
+                event_loop_free(await_loop);
+                await_loop = NULL;
+        }
+        deadline_clear(&await_heap);
+
+        pthread_mutex_lock(&pool_lock);
+        pool_count = 0;
+        pool_queued = 0;
+        done_start = NULL;
+        done_end = NULL;
+        pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @brief Set up a strand that hasn't been used yet.
+ *
+ * @param strand Strand
+ */
+void pool_strand_init(struct pool_strand *strand)
+{
+        strand->job_start = NULL;
+        strand->job_end = NULL;
+        strand->state = POOL_IDLE;
+        strand->home = -1;
+        strand->prev = NULL;
+        strand->next = NULL;
+}
+
+/**
+ * @brief Queue a job on a strand.  Its done callback gets called from
+ *        pool_collect() once it's run, or right away if there aren't any
+ *        workers.
+ *
+ * @param strand Strand, so it doesn't run alongside its siblings
+ * @param job Job
+ */
+void pool_submit(struct pool_strand *strand, struct pool_job *job)
+{
+        job->next = NULL;
+
+        pthread_mutex_lock(&pool_lock);
+
+        if (pool_count == 0) {
+                pthread_mutex_unlock(&pool_lock);
+                job->work(job);
+                job->done(job);
+                return;
+        }
+
+        if (strand->job_end == NULL) {
+                strand->job_start = job;
+                strand->job_end = job;
+        } else {
+                strand->job_end->next = job;
+                strand->job_end = job;
+        }
+
+        /* Running or queued strands get to it on their own. */
+        if (strand->state == POOL_IDLE) {
+                pool_push(pool_home(strand), strand);
+                pthread_cond_signal(&pool_cond);
+        }
+
+        pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @brief Call the done callbacks of everything the workers finished.
+ *
+ * @return How many there were
+ */
+int pool_collect(void)
+{
+        struct pool_job *job;
+        struct pool_job *next;
+        int count = 0;
+
+        pthread_mutex_lock(&pool_lock);
+        job = done_start;
+        done_start = NULL;
+        done_end = NULL;
+        pthread_mutex_unlock(&pool_lock);
+
+        while (job) {
+                next = job->next;
+                job->done(job);
+                job = next;
+                count++;
+        }
+
+        return count;
+}
+
+/**
+ * @brief Give up on jobs that blew their limit.  Their workers are left
+ *        to finish whenever they do and then go away, and somebody new
+ *        takes their place.  Cancelling them instead would leave the
+ *        module with half of whatever it was doing (files, children,
+ *        sockets), so the strand stays put until the job's back, and the
+ *        done callbacks know not to trust what it got.  The overdue
+ *        callbacks get called here.
+ *
+ * @param now Current CLOCK_MONOTONIC time
+ *
+ * @return How many jobs were given up on
+ */
+int pool_watch(double now)
+{
+        struct pool_job *late[POOL_MAX_WORKERS];
+        int count;
+        int i;
+
+        pthread_mutex_lock(&pool_lock);
+        count = pool_give_up(now, late);
+        if (pool_paused && !pool_running)
+                pthread_cond_broadcast(&pool_idle);
+        pthread_mutex_unlock(&pool_lock);
+
+        for (i = 0; i < count; i++)
+                if (late[i]->overdue)
+                        late[i]->overdue(late[i]);
+
+        return count;
+}
+
+/**
+ * @brief The guts of pool_watch(), without the overdue callbacks, those
+ *        are for the caller to make once the pool's unlocked.  Call with
+ *        the pool locked.
+ *
+ * @param now Current CLOCK_MONOTONIC time
+ * @param late Filled in with the jobs given up on, room for
+ *             POOL_MAX_WORKERS
+ *
+ * @return How many jobs were given up on
+ */
+static int pool_give_up(double now, struct pool_job **late)
+{
+        struct pool_worker *w;
+        struct pool_fiber *f;
+        struct pool_fiber *next;
+        int count = 0;
+        int i;
+        int j;
+
+        for (i = 0; i < pool_count; i++) {
+                w = &pool_workers[i];
+                if (!w->is_launched || w->is_wedged || w->job == NULL ||
+                    w->job->limit <= 0 || now < w->job->started + w->job->limit)
+                        continue;
+
+                w->job->is_overdue = 1;
+                late[count++] = w->job;
+
+                /* It doesn't count towards pool_pause() anymore. */
+                w->is_wedged = 1;
+                pool_running--;
+                pthread_detach(w->thread);
+
+                for (j = 0; j < POOL_MAX_WORKERS; j++)
+                        if (!pool_workers[j].is_launched)
+                                break;
+
+                if (j == POOL_MAX_WORKERS || pool_spawn(j) == -1)
+                        fprintf(stderr, "Couldn't replace a hung worker.\n");
+                else if (j >= pool_count)
+                        pool_count = j + 1;
+
+                /* Fibers that were waiting for it go to somebody else. */
+                f = w->ready_start;
+                w->ready_start = NULL;
+                w->ready_end = NULL;
+                while (f) {
+                        next = f->next;
+                        pool_fiber_queue(f);
+                        f = next;
+                }
+        }
+
+        return count;
+}
+
+/**
+ * @brief When the next running job blows its limit, if it doesn't finish
+ *        first.
+ *
+ * @return CLOCK_MONOTONIC time, 0 for no running jobs with limits
+ */
+double pool_next_overdue(void)
+{
+        double next;
+
+        pthread_mutex_lock(&pool_lock);
+        next = pool_soonest();
+        pthread_mutex_unlock(&pool_lock);
+
+        return next;
+}
+
+/**
+ * @brief pool_next_overdue(), with the pool already locked.
+ *
+ * @return CLOCK_MONOTONIC time, 0 for no running jobs with limits
+ */
+static double pool_soonest(void)
+{
+        struct pool_worker *w;
+        double next = 0;
+        double due;
+        int i;
+
+        for (i = 0; i < pool_count; i++) {
+                w = &pool_workers[i];
+                if (!w->is_launched || w->is_wedged || w->job == NULL ||
+                    w->job->limit <= 0)
+                        continue;
+
+                due = w->job->started + w->job->limit;
+                if (next == 0 || due < next)
+                        next = due;
+        }
+
+        return next;
+}
+
+/**
+ * @brief See if a strand has a job on a worker right now.  After
+ *        pool_pause() that can only be one that was given up on, or one
+ *        with no limit that pool_pause() got tired of waiting for.
+ *
+ * @param strand Strand
+ *
+ * @return 1 if it does, 0 if not
+ */
+int pool_strand_busy(struct pool_strand *strand)
+{
+        int ret;
+
+        pthread_mutex_lock(&pool_lock);
+        ret = (strand->state == POOL_RUNNING);
+        pthread_mutex_unlock(&pool_lock);
+
+        return ret;
+}
+
+/**
+ * @brief Wait for the running jobs to finish and don't start any more
+ *        until pool_resume().  Finished jobs still go to pool_collect().
+ *        Whoever pauses usually has pool_watch()'s caller locked out, so
+ *        jobs that blow their limit in the meantime are given up on right
+ *        here, overdue callbacks and all.  Jobs with no limit could take
+ *        forever, they only get POOL_PAUSE_WAIT, then they're left running
+ *        and their strands stay busy.
+ *
+ * @return How many jobs are still running
+ */
+int pool_pause(void)
+{
+        struct pool_job *late[POOL_MAX_WORKERS];
+        struct timespec ts;
+        double start = get_mono_time();
+        double now;
+        double next;
+        int count;
+        int i;
+
+        pthread_mutex_lock(&pool_lock);
+
+        pool_paused = 1;
+        while (pool_running) {
+                now = get_mono_time();
+
+                if ((count = pool_give_up(now, late))) {
+                        pthread_mutex_unlock(&pool_lock);
+                        for (i = 0; i < count; i++)
+                                if (late[i]->overdue)
+                                        late[i]->overdue(late[i]);
+                        pthread_mutex_lock(&pool_lock);
+                        continue;
+                }
+
+                /* Only ones with no limit left, and they've had long
+                 * enough. */
+                if ((next = pool_soonest()) == 0) {
+                        if (now >= start + POOL_PAUSE_WAIT)
+                                break;
+                        next = start + POOL_PAUSE_WAIT;
+                }
+
+                /* pool_idle is on the wall clock. */
+                next += get_time() - now;
+                ts.tv_sec = (time_t) next;
+                ts.tv_nsec = (long) ((next - (double) ts.tv_sec) * 1000000000);
+                pthread_cond_timedwait(&pool_idle, &pool_lock, &ts);
+        }
+
+        count = pool_running;
+        pthread_mutex_unlock(&pool_lock);
+
+        return count;
+}
+
+/**
+ * @brief Let the workers go again after pool_pause().
+ */
+void pool_resume(void)
+{
+        pthread_mutex_lock(&pool_lock);
+        pool_paused = 0;
+        pthread_cond_broadcast(&pool_cond);
+        pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @brief Worker thread.  One job at a time, and a strand with more to do
+ *        goes to the back of the line so a busy module can't hog us.  Jobs
+ *        that are done waiting in pool_await() go before new ones.
+ *
+ * @param arg Worker
+ */
+static void *pool_worker_run(void *arg)
+{
+        struct pool_worker *w = arg;
+        struct pool_strand *s;
+        struct pool_fiber *f;
+        struct pool_job *job;
+        int ret = 0;
+
+        pthread_mutex_lock(&pool_lock);
+
+        while (!(ret & 2)) {
+                while (!pool_stopping &&
+                       (pool_paused || (!w->ready_start && !pool_queued)))
+                        pthread_cond_wait(&pool_cond, &pool_lock);
+
+                if (pool_stopping)
+                        break;
+
+                if ((f = w->ready_start)) {
+                        w->ready_start = f->next;
+                        if (w->ready_start == NULL)
+                                w->ready_end = NULL;
+                        job = f->job;
+                        s = f->strand;
+                } else {
+                        s = pool_take(w);
+                        job = s->job_start;
+                        s->job_start = job->next;
+                        if (s->job_start == NULL)
+                                s->job_end = NULL;
+
+                        s->state = POOL_RUNNING;
+                        job->started = get_mono_time();
+                        job->is_overdue = 0;
+
+                        /* No fiber, no stepping aside. */
+                        if ((f = pool_fiber_get(w))) {
+                                f->strand = s;
+                                f->job = job;
+                        }
+                }
+
+                pool_running++;
+                w->strand = s;
+                w->job = job;
+                pthread_mutex_unlock(&pool_lock);
+
+                if (f)
+                        pool_fiber_switch(w, f);
+                else
+                        job->work(job);
+
+                pthread_mutex_lock(&pool_lock);
+
+                /* It's waiting on something, the strand stays running. */
+                if (f && !f->is_done) {
+                        w->strand = NULL;
+                        w->job = NULL;
+                        pool_running--;
+                        if (pool_paused && !pool_running)
+                                pthread_cond_broadcast(&pool_idle);
+                        ret = 0;
+                        continue;
+                }
+
+                if (f) {
+                        f->next = w->spare;
+                        w->spare = f;
+                }
+
+                ret = pool_finish(w);
+
+                /* Only the first one needs to say so, the rest get picked
+                 * up along with it. */
+                if ((ret & 1) && pool_poke) {
+                        pthread_mutex_unlock(&pool_lock);
+                        pool_poke();
+                        pthread_mutex_lock(&pool_lock);
+                }
+        }
+
+        pthread_mutex_unlock(&pool_lock);
+
+        return NULL;
+}
+
+/**
+ * @brief A worker's out of its job, one way or the other.  The strand
+ *        goes back in line if there's more for it, the job goes on the done
+ *        list.  Call with the pool locked.
+ *
+ * @param w Worker
+ *
+ * @return 1 if the done list needs a poke, plus 2 if the worker was
+ *         given up on and has to go
+ */
+static int pool_finish(struct pool_worker *w)
+{
+        struct pool_strand *s = w->strand;
+        struct pool_job *job = w->job;
+        int ret = 0;
+
+        w->strand = NULL;
+        w->job = NULL;
+
+        if (w->is_wedged) {
+                w->is_launched = 0;
+                w->is_wedged = 0;
+                ret |= 2;
+        } else {
+                pool_running--;
+
+                /* It's warm here, so it stays with us. */
+                s->home = w->num;
+        }
+
+        if (s->job_start) {
+                pool_push(pool_home(s), s);
+                pthread_cond_signal(&pool_cond);
+        } else {
+                s->state = POOL_IDLE;
+        }
+
+        if (done_start == NULL)
+                ret |= 1;
+
+        job->next = NULL;
+        if (done_end == NULL) {
+                done_start = job;
+                done_end = job;
+        } else {
+                done_end->next = job;
+                done_end = job;
+        }
+
+        if (pool_paused && !pool_running)
+                pthread_cond_broadcast(&pool_idle);
+
+        return ret;
+}
+
+/**
+ * @brief Which worker's deque a strand goes in.  Its home if that one's
+ *        still good, otherwise the next live one in turn.  Call with the
+ *        pool locked.
+ *
+ * @param s Strand
+ *
+ * @return Worker
+ */
+static struct pool_worker *pool_home(struct pool_strand *s)
+{
+        struct pool_worker *w;
+        int i;
+
+        if (s->home >= 0 && s->home < pool_count) {
+                w = &pool_workers[s->home];
+                if (w->is_launched && !w->is_wedged)
+                        return w;
+        }
+
+        /* If they're all wedged it waits for a replacement to steal it. */
+        w = &pool_workers[0];
+
+        for (i = 0; i < pool_count; i++) {
+                w = &pool_workers[pool_next++ % pool_count];
+                if (w->is_launched && !w->is_wedged)
+                        break;
+        }
+
+        s->home = w->num;
+
+        return w;
+}
+
+/**
+ * @brief Put a strand at the back of a worker's deque.  Call with the
+ *        pool locked.
+ *
+ * @param w Worker
+ * @param s Strand
+ */
+static void pool_push(struct pool_worker *w, struct pool_strand *s)
+{
+        s->state = POOL_QUEUED;
+        s->next = NULL;
+        s->prev = w->tail;
+
+        if (w->tail)
+                w->tail->next = s;
+        else
+                w->head = s;
+        w->tail = s;
+
+        pool_queued++;
+}
+
+/**
+ * @brief Take a strand, from the front of our own deque if there's one,
+ *        otherwise from the back of somebody else's.  Call with the pool
+ *        locked, and only when pool_queued says there's something.
+ *
+ * @param w Worker
+ *
+ * @return Strand
+ */
+static struct pool_strand *pool_take(struct pool_worker *w)
+{
+        struct pool_worker *victim;
+        struct pool_strand *s;
+        int i;
+
+        pool_queued--;
+
+        if ((s = w->head)) {
+                w->head = s->next;
+                if (w->head)
+                        w->head->prev = NULL;
+                else
+                        w->tail = NULL;
+                return s;
+        }
+
+        for (i = 1; i < pool_count; i++) {
+                victim = &pool_workers[(w->num + i) % pool_count];
+                if ((s = victim->tail) == NULL)
+                        continue;
+
+                victim->tail = s->prev;
+                if (victim->tail)
+                        victim->tail->next = NULL;
+                else
+                        victim->head = NULL;
+                return s;
+        }
+
+        /* pool_queued said there was one. */
+        return NULL;
+}
+
+/**
+ * @brief Make the key for the fiber a thread's in, once.
+ */
+static void pool_fiber_key_init(void)
+{
+        pthread_key_create(&fiber_key, NULL);
+}
+
+/**
+ * @brief A fiber to run a job on, one of the worker's spares if it has
+ *        any.  Call with the pool locked.
+ *
+ * @param w Worker
+ *
+ * @return Fiber, NULL if there's no memory for one
+ */
+static struct pool_fiber *pool_fiber_get(struct pool_worker *w)
+{
+        struct pool_fiber *f;
+        long page;
+
+        if ((f = w->spare)) {
+                w->spare = f->next;
+                f->is_done = 0;
+                return f;
+        }
+
+        if ((f = malloc(sizeof(struct pool_fiber))) == NULL)
+                return NULL;
+
+        f->stack = mmap(NULL, POOL_FIBER_STACK, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (f->stack == MAP_FAILED) {
+                free(f);
+                return NULL;
+        }
+
+        /* Running off the end faults instead of trashing something. */
+        if ((page = sysconf(_SC_PAGESIZE)) > 0)
+                mprotect(f->stack, page, PROT_NONE);
+
+        getcontext(&f->ctx);
+        f->ctx.uc_stack.ss_sp = f->stack;
+        f->ctx.uc_stack.ss_size = POOL_FIBER_STACK;
+        f->ctx.uc_link = NULL;
+        makecontext(&f->ctx, &pool_fiber_run, 0);
+
+        f->is_io = 0;
+        f->w = w;
+        f->mem = NULL;
+        f->is_parked = 0;
+        f->is_done = 0;
+        f->sched.slot = -1;
+
+        return f;
+}
+
+/**
+ * @brief What a fiber runs, one job after another for as long as it's
+ *        around.
+ */
+static void pool_fiber_run(void)
+{
+        struct pool_fiber *f;
+
+        while (1) {
+                f = pthread_getspecific(fiber_key);
+                f->job->work(f->job);
+
+                f->is_done = 1;
+                swapcontext(&f->ctx, &f->w->home);
+        }
+}
+
+/**
+ * @brief Run a fiber on a worker until its job's done or it's waiting on
+ *        something.
+ *
+ * @param w Worker
+ * @param f Fiber
+ */
+static void pool_fiber_switch(struct pool_worker *w, struct pool_fiber *f)
+{
+        void *mem;
+
+        pthread_once(&fiber_once, &pool_fiber_key_init);
+
+        f->w = w;
+        mem = mem_list_swap(f->mem);
+        pthread_setspecific(fiber_key, f);
+
+        swapcontext(&w->home, &f->ctx);
+
+        pthread_setspecific(fiber_key, NULL);
+        f->mem = mem_list_swap(mem);
+}
+
+/**
+ * @brief A parked fiber's done waiting.  Call with the pool locked.
+ *
+ * @param f Fiber
+ */
+static void pool_fiber_ready(struct pool_fiber *f)
+{
+        event_del(await_loop, f->fd);
+        deadline_del(&await_heap, &f->sched);
+        f->is_parked = 0;
+
+        if (f->prev)
+                f->prev->next = f->next;
+        else
+                parked_start = f->next;
+        if (f->next)
+                f->next->prev = f->prev;
+
+        pool_fiber_queue(f);
+}
+
+/**
+ * @brief Put a fiber back in line on its worker, or a live one if that's
+ *        been given up on.  Call with the pool locked.
+ *
+ * @param f Fiber
+ */
+static void pool_fiber_queue(struct pool_fiber *f)
+{
+        struct pool_worker *w = f->w;
+
+        if (!w->is_launched || w->is_wedged)
+                w = pool_home(f->strand);
+
+        f->w = w;
+        f->next = NULL;
+        if (w->ready_end)
+                w->ready_end->next = f;
+        else
+                w->ready_start = f;
+        w->ready_end = f;
+
+        /* It has to be that one, so everybody checks. */
+        pthread_cond_broadcast(&pool_cond);
+}
+
+/**
+ * @brief Free a fiber and its stack.
+ *
+ * @param f Fiber
+ */
+static void pool_fiber_free(struct pool_fiber *f)
+{
+        munmap(f->stack, POOL_FIBER_STACK);
+        free(f->mem);
+        free(f);
+}
+
+/**
+ * @brief Wait for a descriptor, from a module method.  On a worker, the
+ *        job steps aside and the worker runs other things until it's
+ *        ready.  Anywhere else it just blocks.  Don't hold any locks while
+ *        waiting, whatever the worker runs next might want them.
+ *
+ * @param fd Descriptor
+ * @param mask EVENT_READ and/or EVENT_WRITE
+ * @param timeout Seconds to wait at most, negative for no limit
+ *
+ * @return 1 if it's ready, 0 if it timed out, -1 on error
+ */
+int pool_await(int fd, int mask, double timeout)
+{
+        struct pool_fiber *f;
+        double due = 0;
+        double now;
+
+        pthread_once(&fiber_once, &pool_fiber_key_init);
+
+        if ((f = pthread_getspecific(fiber_key)) == NULL ||
+            await_loop == NULL)
+                return pool_await_poll(fd, mask, timeout);
+
+        now = get_mono_time();
+        if (timeout >= 0)
+                due = now + timeout;
+
+        /* The job's deadline is as long as anybody waits. */
+        if (f->job->limit > 0 &&
+            (due == 0 || due > f->job->started + f->job->limit))
+                due = f->job->started + f->job->limit;
+
+        if (due != 0 && due <= now)
+                return 0;
+
+        pthread_mutex_lock(&pool_lock);
+
+        if (event_add(await_loop, fd, mask, f) == -1) {
+                pthread_mutex_unlock(&pool_lock);
+                return pool_await_poll(fd, mask, timeout);
+        }
+
+        f->fd = fd;
+        f->mask = mask;
+        f->fired = 0;
+        f->is_parked = 1;
+        if (due != 0)
+                deadline_set(&await_heap, &f->sched, due);
+
+        f->prev = NULL;
+        f->next = parked_start;
+        if (parked_start)
+                parked_start->prev = f;
+        parked_start = f;
+
+        pthread_mutex_unlock(&pool_lock);
+        event_wake(await_loop);
+
+        swapcontext(&f->ctx, &f->w->home);
+
+        return (f->fired & (mask | EVENT_ERROR)) ? 1 : 0;
+}
+
+/**
+ * @brief Thread that watches parked fibers' descriptors and deadlines, and
+ *        puts them back in line when they're done waiting.
+ *
+ * @param arg Unused
+ */
+static void *pool_await_run(void *arg)
+{
+        struct event_fired fired[64];
+        struct pool_io *io;
+        struct pool_fiber *f;
+        struct deadline *n;
+        double now;
+        int timeout;
+        int count;
+        int i;
+
+        while (1) {
+                pthread_mutex_lock(&pool_lock);
+
+                if (pool_stopping) {
+                        pthread_mutex_unlock(&pool_lock);
+                        break;
+                }
+
+                timeout = -1;
+                if ((n = deadline_top(&await_heap))) {
+                        now = get_mono_time();
+                        timeout = (n->due > now) ?
+                                (int) ((n->due - now) * 1000) + 1 : 0;
+                }
+
+                await_is_waiting = 1;
+                pthread_mutex_unlock(&pool_lock);
+
+                count = event_wait(await_loop, fired, 64, timeout);
+
+                pthread_mutex_lock(&pool_lock);
+
+                for (i = 0; i < count; i++) {
+                        /* Watched descriptors and parked fibers both
+                         * start with is_io. */
+                        if (*(int *) fired[i].data) {
+                                io = fired[i].data;
+                                io->ready(io, fired[i].mask);
+                                continue;
+                        }
+
+                        f = fired[i].data;
+                        if (!f->is_parked)
+                                continue;
+
+                        f->fired = fired[i].mask;
+                        pool_fiber_ready(f);
+                }
+
+                now = get_mono_time();
+                while ((n = deadline_top(&await_heap)) && n->due <= now)
+                        pool_fiber_ready(FIBER_OF(n));
+
+                await_is_waiting = 0;
+                await_rounds++;
+                pthread_cond_broadcast(&await_done);
+
+                pthread_mutex_unlock(&pool_lock);
+        }
+
+        return NULL;
+}
+
+/**
+ * @brief Start watching a descriptor.  Fill in everything but is_io
+ *        first.  Readiness is edge-triggered like the rest of the event
+ *        loop, so whoever's told should read or write until EAGAIN.
+ *
+ * @param io Watch, has to stay put until pool_io_del()
+ *
+ * @return 0 on success, -1 if there's no event loop or it won't take it
+ */
+int pool_io_add(struct pool_io *io)
+{
+        int ret;
+
+        io->is_io = 1;
+
+        pthread_mutex_lock(&pool_lock);
+        ret = (await_loop) ? event_add(await_loop, io->fd, io->mask, io) : -1;
+        pthread_mutex_unlock(&pool_lock);
+
+        if (ret == 0)
+                event_wake(await_loop);
+
+        return ret;
+}
+
+/**
+ * @brief Stop watching a descriptor.  Once this is back ready won't be
+ *        called again and the watch can be freed, so it waits out whatever
+ *        the event loop already had in hand.  Don't call it from ready.
+ *
+ * @param io Watch
+ */
+void pool_io_del(struct pool_io *io)
+{
+        unsigned long round;
+
+        pthread_mutex_lock(&pool_lock);
+
+        if (await_loop) {
+                event_del(await_loop, io->fd);
+
+                round = await_rounds;
+                while (await_is_waiting && await_launched &&
+                       round == await_rounds) {
+                        event_wake(await_loop);
+                        pthread_cond_wait(&await_done, &pool_lock);
+                }
+        }
+
+        pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @brief pool_await() for when there's no fiber to park, plain poll().
+ *
+ * @param fd Descriptor
+ * @param mask EVENT_READ and/or EVENT_WRITE
+ * @param timeout Seconds to wait at most, negative for no limit
+ *
+ * @return 1 if it's ready, 0 if it timed out, -1 on error
+ */
+static int pool_await_poll(int fd, int mask, double timeout)
+{
+        struct pollfd pfd;
+        int n;
+
+        pfd.fd = fd;
+        pfd.events = 0;
+        if (mask & EVENT_READ)
+                pfd.events |= POLLIN;
+        if (mask & EVENT_WRITE)
+                pfd.events |= POLLOUT;
+
+        n = poll(&pfd, 1, (timeout < 0) ? -1 : (int) (timeout * 1000));
+
+        return (n > 0) ? 1 : n;
+}
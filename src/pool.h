@@ -0,0 +1,85 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+
+#define POOL_MAX_WORKERS 64
+#define POOL_FIBER_STACK (256 * 1024) /* Each job's stack */
+#define POOL_PAUSE_WAIT 1.0   /* Seconds a pause waits on jobs with no limit */
+
+enum pool_state {
+        POOL_IDLE,              /* Nothing to do */
+        POOL_QUEUED,            /* Waiting in somebody's deque */
+        POOL_RUNNING            /* A worker has it */
+};
+
+/**
+ * Something to run on a worker.  It lives inside whatever owns it, and
+ * can only be submitted again once its done callback has been called.
+ */
+struct pool_job {
+        void (*work)(struct pool_job *job);     /* On a worker */
+        void (*done)(struct pool_job *job);     /* Back in pool_collect() */
+        void (*overdue)(struct pool_job *job);  /* From pool_watch() */
+        void *data;
+
+        double limit;           /* Seconds it gets, 0 for forever */
+        double started;         /* CLOCK_MONOTONIC, when a worker took it */
+        int is_overdue;         /* Blew its limit (bool) */
+
+        struct pool_job *next;
+};
+
+/**
+ * Jobs that must not run at the same time as each other, like everything
+ * from one module.  They run in the order they were submitted.
+ */
+struct pool_strand {
+        struct pool_job *job_start;
+        struct pool_job *job_end;
+        enum pool_state state;
+        int home;               /* Worker whose deque it goes in, -1 for none */
+
+        struct pool_strand *prev;
+        struct pool_strand *next;
+};
+
+/**
+ * A descriptor watched on the same event loop pool_await() uses.  ready
+ * gets called from there every time it fires, with the pool locked, so it
+ * should only take note and leave the real work to somebody else.
+ */
+struct pool_io {
+        int is_io;              /* Always 1, tells it from a parked fiber */
+        int fd;
+        int mask;               /* EVENT_READ and/or EVENT_WRITE */
+        void (*ready)(struct pool_io *io, int fired);
+};
+
+int pool_start(void (*poke)(void));
+void pool_stop(void);
+void pool_strand_init(struct pool_strand *strand);
+void pool_submit(struct pool_strand *strand, struct pool_job *job);
+int pool_collect(void);
+int pool_watch(double now);
+double pool_next_overdue(void);
+int pool_strand_busy(struct pool_strand *strand);
+int pool_pause(void);
+void pool_resume(void);
+int pool_await(int fd, int mask, double timeout);
+int pool_io_add(struct pool_io *io);
+void pool_io_del(struct pool_io *io);
+
+#endif /* POOL_H */
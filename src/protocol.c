@@ -20,6 +20,7 @@
 #include "daemon.h"
 #include "net.h"
 #include "protocol.h"
+#include "relay.h"
 #include "request.h"
 #include "util.h"
 
@@ -29,15 +30,22 @@ static void protocol_handle_command(donky_conn *cur, const char *buf);
 
 static void protocol_command_var(donky_conn *cur, const char *args);
 static void protocol_command_varonce(donky_conn *cur, const char *args);
+static void protocol_command_unvar(donky_conn *cur, const char *args);
 static void protocol_command_bye(donky_conn *cur, const char *args);
 static void protocol_command_cfg(donky_conn *cur, const char *args);
+static void protocol_command_stats(donky_conn *cur, const char *args);
+static void protocol_command_proto(donky_conn *cur, const char *args);
+static void protocol_stats_conn(donky_conn *c, void *arg);
 
 /* Globals. */
 donky_cmd commands[] = {
         { "var",     &protocol_command_var },
         { "varonce", &protocol_command_varonce },
+        { "unvar",   &protocol_command_unvar },
         { "bye",     &protocol_command_bye },
         { "cfg",     &protocol_command_cfg },
+        { "stats",   &protocol_command_stats },
+        { "proto",   &protocol_command_proto },
         { NULL,      NULL }
 };
 
@@ -69,7 +77,7 @@ static void protocol_handle_auth(donky_conn *cur, const char *buf)
         /* No password needed, set user as authenticated and pass on this
          * buffer to the command handler. */
         if (pass == NULL) {
-                cur->is_authed = 1;
+                donky_conn_authed(cur);
                 protocol_handle_command(cur, buf);
                 return;
         }
@@ -77,10 +85,10 @@ static void protocol_handle_auth(donky_conn *cur, const char *buf)
         /* Grab the password. */
         if (sscanf(buf, PROTO_PASS_REQ, check) == 1) {
                 if (!strcmp(pass, check)) {
-                        cur->is_authed = 1;
-                        sendcrlf(cur->sock, PROTO_PASS_ACK);
+                        donky_conn_authed(cur);
+                        donky_conn_send(cur, PROTO_PASS_ACK);
                 } else {
-                        sendcrlf(cur->sock, PROTO_PASS_NACK);
+                        donky_conn_send(cur, PROTO_PASS_NACK);
                 }
         }
 }
@@ -118,7 +126,7 @@ static void protocol_handle_command(donky_conn *cur, const char *buf)
 
         /* Send some sort of NACK if they used an unknown command. */
         if (!did)
-                sendcrlf(cur->sock, PROTO_ERROR);
+                donky_conn_send(cur, PROTO_ERROR);
 }
 
 /**
@@ -130,14 +138,14 @@ static void protocol_handle_command(donky_conn *cur, const char *buf)
 static void protocol_command_var(donky_conn *cur, const char *args)
 {
         if (args == NULL) {
-                sendcrlf(cur->sock, PROTO_ERROR);
+                donky_conn_send(cur, PROTO_ERROR);
                 return;
         }
         
         if ((request_list_add(cur, args, 0)))
-                sendcrlf(cur->sock, PROTO_GOOD);
+                donky_conn_send(cur, PROTO_GOOD);
         else
-                sendcrlf(cur->sock, PROTO_ERROR);
+                donky_conn_send(cur, PROTO_ERROR);
 }
 
 /**
@@ -149,14 +157,39 @@ static void protocol_command_var(donky_conn *cur, const char *args)
 static void protocol_command_varonce(donky_conn *cur, const char *args)
 {
         if (args == NULL) {
-                sendcrlf(cur->sock, PROTO_ERROR);
+                donky_conn_send(cur, PROTO_ERROR);
                 return;
         }
         
         if ((request_list_add(cur, args, 1)))
-                sendcrlf(cur->sock, PROTO_GOOD);
+                donky_conn_send(cur, PROTO_GOOD);
         else
-                sendcrlf(cur->sock, PROTO_ERROR);
+                donky_conn_send(cur, PROTO_ERROR);
+}
+
+/**
+ * @brief Stop getting a variable
+ *
+ * @param cur Donky connection
+ * @param args Arguments
+ */
+static void protocol_command_unvar(donky_conn *cur, const char *args)
+{
+        unsigned int id;
+        int n;
+
+        if (args == NULL || sscanf(args, "%u", &id) != 1) {
+                donky_conn_send(cur, PROTO_ERROR);
+                return;
+        }
+
+        n = request_list_remove_id(cur, id);
+        n += relay_unsubscribe(cur, id);
+
+        if (n)
+                donky_conn_send(cur, PROTO_GOOD);
+        else
+                donky_conn_send(cur, PROTO_ERROR);
 }
 
 /**
@@ -167,8 +200,8 @@ static void protocol_command_varonce(donky_conn *cur, const char *args)
  */
 static void protocol_command_bye(donky_conn *cur, const char *args)
 {
-        sendcrlf(cur->sock, PROTO_BYE);
-        donky_conn_drop(cur);
+        donky_conn_send(cur, PROTO_BYE);
+        cur->is_closing = 1;
 }
 
 /**
@@ -184,31 +217,93 @@ static void protocol_command_cfg(donky_conn *cur, const char *args)
         char key[64];
         unsigned int type;
 
-        if (sscanf(args, "%7[^:]:%63[^:]:%63[^:]:%u",
+        if (args == NULL ||
+            sscanf(args, "%7[^:]:%63[^:]:%63[^:]:%u",
                    id, mod, key, &type) != 4) {
-                sendcrlf(cur->sock, PROTO_ERROR);
+                donky_conn_send(cur, PROTO_ERROR);
                 return;
         }
 
         switch (type) {
         case 0:
-                sendcrlf(cur->sock, "cfg:%s:\"%s\"",
-                         id, get_char_key(mod, key, ""));
+                donky_conn_send(cur, "cfg:%s:\"%s\"",
+                                id, get_char_key(mod, key, ""));
                 break;
         case 1:
-                sendcrlf(cur->sock, "cfg:%s:%d",
-                         id, get_int_key(mod, key, -1));
+                donky_conn_send(cur, "cfg:%s:%d",
+                                id, get_int_key(mod, key, -1));
                 break;
         case 2:
-                sendcrlf(cur->sock, "cfg:%s:%f",
-                         id, get_double_key(mod, key, -1.0));
+                donky_conn_send(cur, "cfg:%s:%f",
+                                id, get_double_key(mod, key, -1.0));
                 break;
         case 3:
-                sendcrlf(cur->sock, "cfg:%s:%d",
-                         id, get_bool_key(mod, key, -1));
+                donky_conn_send(cur, "cfg:%s:%d",
+                                id, get_bool_key(mod, key, -1));
                 break;
         default:
-                sendcrlf(cur->sock, PROTO_ERROR);
+                donky_conn_send(cur, PROTO_ERROR);
                 break;
         }
 }
+
+/**
+ * @brief Output queue statistics for every client, so slow consumers are
+ *        easy to spot.
+ *
+ * @param cur Donky connection
+ * @param args Arguments
+ */
+static void protocol_command_stats(donky_conn *cur, const char *args)
+{
+        donky_conn_foreach(&protocol_stats_conn, cur);
+        donky_conn_send(cur, PROTO_GOOD);
+}
+
+/**
+ * @brief Send the output queue statistics of one client.
+ *
+ * @param c Client to report on
+ * @param arg Donky connection that asked
+ */
+static void protocol_stats_conn(donky_conn *c, void *arg)
+{
+        unsigned int len;
+        unsigned int hwm;
+        unsigned long conflated;
+        unsigned long writes;
+
+        pthread_mutex_lock(&c->out_lock);
+        len = c->out_len;
+        hwm = c->out_hwm;
+        conflated = c->out_conflated;
+        writes = c->out_writes;
+        pthread_mutex_unlock(&c->out_lock);
+
+        donky_conn_send(arg, "stats:%d:%u:%u:%lu:%lu",
+                        c->sock, len, hwm, conflated, writes);
+}
+
+/**
+ * @brief Pick the wire protocol.  The GOOD still goes out in the old one,
+ *        everything after it in the new one.
+ *
+ * @param cur Donky connection
+ * @param args "binary" or "text"
+ */
+static void protocol_command_proto(donky_conn *cur, const char *args)
+{
+        int binary;
+
+        if (args != NULL && !strcmp(args, "binary")) {
+                binary = 1;
+        } else if (args != NULL && !strcmp(args, "text")) {
+                binary = 0;
+        } else {
+                donky_conn_send(cur, PROTO_ERROR);
+                return;
+        }
+
+        donky_conn_send(cur, PROTO_GOOD);
+        donky_conn_set_binary(cur, binary);
+}
@@ -24,6 +24,7 @@
 #define PROTO_BYE       "PEACE"
 #define PROTO_ERROR     "ERROR"
 #define PROTO_GOOD      "GOOD"
+#define PROTO_BUSY      "BUSY"
 
 typedef struct {
         char *alias;
@@ -0,0 +1,917 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../config.h"
+#include "cfg.h"
+#include "daemon.h"
+#include "event.h"
+#include "module.h"
+#include "net.h"
+#include "relay.h"
+#include "request.h"
+#include "util.h"
+
+#define RELAY_MAX_EVENTS 64
+
+enum relay_state {
+        RELAY_DOWN,             /* Waiting to try again. */
+        RELAY_CONNECTING,       /* connect() in progress. */
+        RELAY_UP
+};
+
+/**
+ * A downstream client subscribed to a relayed variable.
+ */
+struct relay_sub {
+        donky_conn *conn;
+        unsigned int id;        /* Their id. */
+        int once;               /* varonce (bool) */
+
+        struct relay_sub *next;
+};
+
+/**
+ * A variable we're subscribed to on a peer, shared by every downstream
+ * client that asked for the same thing.
+ */
+struct relay_var {
+        unsigned int uid;       /* Our id on the peer. */
+        char *spec;             /* "var args" */
+
+        int have;               /* Got a value yet (bool) */
+        int type;
+        char *value;            /* Last thing the peer sent. */
+
+        struct relay_sub *subs;
+        int refs;
+
+        struct relay_var *prev;
+        struct relay_var *next;
+};
+
+struct relay_peer {
+        char name[64];
+        char pass[64];
+        struct sockaddr_in addr;
+
+        int sock;
+        enum relay_state state;
+        int mask;               /* EVENT_* we're watching for. */
+        double next_try;
+        double backoff;
+
+        char *in_buf;
+        size_t in_len;
+        size_t in_size;
+        char *out_buf;
+        size_t out_len;
+        size_t out_size;
+
+        unsigned int next_uid;
+        struct relay_var *rv_start;
+        struct relay_var *rv_end;
+
+        struct relay_peer *next;
+};
+
+/* Globals. */
+static struct relay_peer *rp_start = NULL;
+static struct relay_peer *rp_end = NULL;
+static struct event_loop *relay_events = NULL;
+static pthread_t relay_thread;
+static int relay_is_launched = 0;       /* bool */
+static volatile int relay_done = 0;     /* bool */
+static double relay_retry;
+static double relay_retry_max;
+
+/* Function prototypes. */
+static struct relay_peer *relay_peer_new(const char *spec);
+static void relay_peer_free(struct relay_peer *p);
+static struct relay_peer *relay_peer_find(const char *name, size_t len);
+static void *relay_run(void *arg);
+static int relay_timers(void);
+static void relay_connect(struct relay_peer *p);
+static void relay_connected(struct relay_peer *p);
+static void relay_up(struct relay_peer *p);
+static void relay_down(struct relay_peer *p);
+static void relay_read(struct relay_peer *p);
+static void relay_line(struct relay_peer *p, char *line);
+static void relay_deliver(struct relay_peer *p,
+                          unsigned int uid,
+                          int type,
+                          const char *value);
+static void relay_send_value(struct relay_sub *sub, struct relay_var *rv);
+static void relay_queue(struct relay_peer *p, const char *fmt, ...);
+static void relay_flush(struct relay_peer *p);
+static void relay_watch(struct relay_peer *p);
+static void relay_var_free(struct relay_peer *p,
+                           struct relay_var *rv,
+                           int tell);
+static int relay_remove(donky_conn *conn, unsigned int id, int any);
+
+/**
+ * @brief Read the peer<N> settings from [relay] and start the relay thread
+ *        if there are any.  Each looks like "name host[:port] [password]".
+ *
+ * @return 0 on success or if there's nothing to relay, -1 on failure
+ */
+int relay_start(void)
+{
+        struct relay_peer *p;
+        const char *val;
+        char key[16];
+        int i;
+
+        relay_retry = get_double_key("relay", "retry", 1.0);
+        relay_retry_max = get_double_key("relay", "retry_max", 60.0);
+        if (relay_retry <= 0)
+                relay_retry = 1.0;
+
+        for (i = 0; i < RELAY_MAX_PEERS; i++) {
+                sprintf(key, "peer%d", i);
+                if ((val = get_char_key("relay", key, NULL)) == NULL)
+                        continue;
+
+                if ((p = relay_peer_new(val)) == NULL)
+                        continue;
+
+                if (rp_end == NULL) {
+                        rp_start = p;
+                        rp_end = p;
+                } else {
+                        rp_end->next = p;
+                        rp_end = p;
+                }
+        }
+
+        if (rp_start == NULL)
+                return 0;
+
+        if ((relay_events = event_loop_new()) == NULL)
+                return -1;
+
+        relay_done = 0;
+        if (pthread_create(&relay_thread, NULL, &relay_run, NULL) != 0)
+                return -1;
+
+        relay_is_launched = 1;
+
+        return 0;
+}
+
+/**
+ * @brief Stop the relay thread and hang up on every peer.  Everybody
+ *        downstream just stops getting their relayed variables.
+ */
+void relay_stop(void)
+{
+        struct relay_peer *next;
+
+        if (relay_is_launched) {
+                relay_done = 1;
+                event_wake(relay_events);
+                pthread_join(relay_thread, NULL);
+                relay_is_launched = 0;
+        }
+
+        request_list_lock();
+
+        while (rp_start) {
+                next = rp_start->next;
+                relay_peer_free(rp_start);
+                rp_start = next;
+        }
+        rp_end = NULL;
+
+        request_list_unlock();
+
+        if (relay_events) {
+                event_loop_free(relay_events);
+                relay_events = NULL;
+        }
+}
+
+/**
+ * @brief Subscribe a client to a relayed variable.  Identical
+ *        subscriptions from any number of clients share one on the peer.
+ *        Call with the request list locked.
+ *
+ * @param conn Client
+ * @param id Client's id for it
+ * @param var "peer/variable"
+ * @param args Arguments, NULL for none
+ * @param once Only send one value (bool)
+ *
+ * @return 1 if subscribed, 0 if there's no such peer
+ */
+int relay_subscribe(donky_conn *conn,
+                    unsigned int id,
+                    const char *var,
+                    const char *args,
+                    int once)
+{
+        const char *slash = strchr(var, '/');
+        struct relay_peer *p;
+        struct relay_var *rv;
+        struct relay_sub *sub;
+        char spec[256];
+
+        if (conn == NULL || slash == NULL || slash[1] == '\0')
+                return 0;
+
+        if ((p = relay_peer_find(var, slash - var)) == NULL)
+                return 0;
+
+        snprintf(spec, sizeof(spec), "%s%s%s", slash + 1,
+                 (args) ? " " : "", (args) ? args : "");
+
+        for (rv = p->rv_start; rv; rv = rv->next)
+                if (!strcmp(rv->spec, spec))
+                        break;
+
+        if (rv == NULL) {
+                rv = calloc(1, sizeof(struct relay_var));
+                rv->uid = p->next_uid++;
+                rv->spec = strdup(spec);
+
+                if (p->rv_end == NULL) {
+                        p->rv_start = rv;
+                        p->rv_end = rv;
+                } else {
+                        p->rv_end->next = rv;
+                        rv->prev = p->rv_end;
+                        p->rv_end = rv;
+                }
+
+                if (p->state == RELAY_UP) {
+                        relay_queue(p, "var %u:%s", rv->uid, rv->spec);
+                        relay_flush(p);
+                        if (p->out_len)
+                                event_wake(relay_events);
+                }
+        }
+
+        sub = malloc(sizeof(struct relay_sub));
+        sub->conn = conn;
+        sub->id = id;
+        sub->once = once;
+
+        /* Whatever we've got is better than nothing, even if the peer's
+         * down right now. */
+        if (rv->have) {
+                relay_send_value(sub, rv);
+
+                if (once) {
+                        free(sub);
+                        return 1;
+                }
+        }
+
+        sub->next = rv->subs;
+        rv->subs = sub;
+        rv->refs++;
+        conn->subs++;
+
+        return 1;
+}
+
+/**
+ * @brief Unsubscribe a client's id from relayed variables.  Call with the
+ *        request list locked.
+ *
+ * @param conn Client
+ * @param id Client's id
+ *
+ * @return How many were removed
+ */
+int relay_unsubscribe(donky_conn *conn, unsigned int id)
+{
+        return relay_remove(conn, id, 0);
+}
+
+/**
+ * @brief A client is going away, forget all of its subscriptions.  Call
+ *        with the request list locked.
+ *
+ * @param conn Client
+ */
+void relay_drop_conn(donky_conn *conn)
+{
+        relay_remove(conn, 0, 1);
+}
+
+/**
+ * @brief Remove a client's subscriptions, and the peer's side of any that
+ *        nobody else wants.
+ *
+ * @param conn Client
+ * @param id Client's id
+ * @param any Ignore id and remove them all (bool)
+ *
+ * @return How many were removed
+ */
+static int relay_remove(donky_conn *conn, unsigned int id, int any)
+{
+        struct relay_peer *p;
+        struct relay_var *rv;
+        struct relay_var *rv_next;
+        struct relay_sub **link;
+        struct relay_sub *sub;
+        int count = 0;
+
+        for (p = rp_start; p; p = p->next) {
+                for (rv = p->rv_start; rv; rv = rv_next) {
+                        rv_next = rv->next;
+                        link = &rv->subs;
+
+                        while ((sub = *link)) {
+                                if (sub->conn != conn ||
+                                    (!any && sub->id != id)) {
+                                        link = &sub->next;
+                                        continue;
+                                }
+
+                                *link = sub->next;
+                                conn->subs--;
+                                rv->refs--;
+                                free(sub);
+                                count++;
+                        }
+
+                        if (rv->refs == 0)
+                                relay_var_free(p, rv, 1);
+                }
+        }
+
+        return count;
+}
+
+/**
+ * @brief Set up a peer from its setting.
+ *
+ * @param spec "name host[:port] [password]"
+ *
+ * @return New peer, NULL if the setting is no good
+ */
+static struct relay_peer *relay_peer_new(const char *spec)
+{
+        struct relay_peer *p;
+        struct hostent *hptr;
+        char host[128];
+        char *colon;
+        int port = 7000;
+        int n;
+
+        p = calloc(1, sizeof(struct relay_peer));
+
+        n = sscanf(spec, "%63s %127s %63s", p->name, host, p->pass);
+        if (n < 2 || strchr(p->name, '/')) {
+                fprintf(stderr, "relay: bad peer setting [%s]\n", spec);
+                free(p);
+                return NULL;
+        }
+
+        if ((colon = strchr(host, ':'))) {
+                *colon = '\0';
+                port = atoi(colon + 1);
+        }
+
+        if ((hptr = gethostbyname(host)) == NULL) {
+                fprintf(stderr, "relay: could not gethostbyname(%s)\n", host);
+                free(p);
+                return NULL;
+        }
+
+        p->addr.sin_family = AF_INET;
+        p->addr.sin_port = htons((short) port);
+        memcpy(&p->addr.sin_addr, hptr->h_addr_list[0], hptr->h_length);
+
+        p->sock = -1;
+        p->state = RELAY_DOWN;
+        p->backoff = relay_retry;
+
+        return p;
+}
+
+/**
+ * @brief Hang up on a peer and free it, with everything subscribed to it.
+ *
+ * @param p Peer
+ */
+static void relay_peer_free(struct relay_peer *p)
+{
+        if (p->sock != -1) {
+                event_del(relay_events, p->sock);
+                close(p->sock);
+        }
+
+        while (p->rv_start)
+                relay_var_free(p, p->rv_start, 0);
+
+        free(p->in_buf);
+        free(p->out_buf);
+        free(p);
+}
+
+/**
+ * @brief Find a peer by name.
+ *
+ * @param name Name, doesn't have to be terminated
+ * @param len Length of name
+ *
+ * @return Peer, NULL if there isn't one
+ */
+static struct relay_peer *relay_peer_find(const char *name, size_t len)
+{
+        struct relay_peer *p;
+
+        for (p = rp_start; p; p = p->next)
+                if (strlen(p->name) == len && !strncmp(p->name, name, len))
+                        return p;
+
+        return NULL;
+}
+
+/**
+ * @brief Relay thread.  Keeps every peer connected and hands what they
+ *        send to whoever's subscribed.
+ *
+ * @param arg Unused
+ *
+ * @return NULL
+ */
+static void *relay_run(void *arg)
+{
+        struct event_fired fired[RELAY_MAX_EVENTS];
+        struct relay_peer *p;
+        int timeout;
+        int n;
+        int i;
+
+        while (!relay_done) {
+                request_list_lock();
+                timeout = relay_timers();
+                request_list_unlock();
+
+                n = event_wait(relay_events, fired, RELAY_MAX_EVENTS,
+                               timeout);
+
+                request_list_lock();
+
+                for (i = 0; i < n; i++) {
+                        p = fired[i].data;
+
+                        if (p->state == RELAY_CONNECTING) {
+                                relay_connected(p);
+                                continue;
+                        }
+
+                        if (fired[i].mask & (EVENT_READ | EVENT_ERROR))
+                                relay_read(p);
+
+                        if (p->state == RELAY_UP &&
+                            (fired[i].mask & EVENT_WRITE))
+                                relay_flush(p);
+                }
+
+                /* Other threads queue subscriptions, make sure we're
+                 * watching for a chance to send them. */
+                for (p = rp_start; p; p = p->next) {
+                        if (p->state != RELAY_UP)
+                                continue;
+
+                        relay_flush(p);
+                        relay_watch(p);
+                }
+
+                request_list_unlock();
+        }
+
+        return NULL;
+}
+
+/**
+ * @brief Start connecting to peers whose backoff is up.
+ *
+ * @return Milliseconds until the next one is due, at most a second
+ */
+static int relay_timers(void)
+{
+        struct relay_peer *p;
+        double now = get_mono_time();
+        double wait = 1.0;
+
+        for (p = rp_start; p; p = p->next) {
+                if (p->state != RELAY_DOWN)
+                        continue;
+
+                if (p->next_try <= now)
+                        relay_connect(p);
+
+                if (p->state == RELAY_DOWN && p->next_try - now < wait)
+                        wait = p->next_try - now;
+        }
+
+        return (wait > 0) ? (int) (wait * 1000) + 1 : 0;
+}
+
+/**
+ * @brief Start a non-blocking connect to a peer.
+ *
+ * @param p Peer
+ */
+static void relay_connect(struct relay_peer *p)
+{
+        if ((p->sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+                perror("socket");
+                relay_down(p);
+                return;
+        }
+
+        sock_set_nonblock(p->sock, 1);
+
+        if (connect(p->sock, (struct sockaddr *) &p->addr,
+                    sizeof(p->addr)) == 0) {
+                event_add(relay_events, p->sock, EVENT_READ, p);
+                p->mask = EVENT_READ;
+                relay_up(p);
+                return;
+        }
+
+        if (errno != EINPROGRESS) {
+                relay_down(p);
+                return;
+        }
+
+        p->state = RELAY_CONNECTING;
+        p->mask = EVENT_WRITE;
+        event_add(relay_events, p->sock, EVENT_WRITE, p);
+}
+
+/**
+ * @brief A connect in progress finished, one way or the other.
+ *
+ * @param p Peer
+ */
+static void relay_connected(struct relay_peer *p)
+{
+        socklen_t len = sizeof(int);
+        int err = 0;
+
+        if (getsockopt(p->sock, SOL_SOCKET, SO_ERROR, &err, &len) == -1 ||
+            err != 0) {
+                relay_down(p);
+                return;
+        }
+
+        relay_up(p);
+}
+
+/**
+ * @brief We're connected.  Log in and ask for everything we're relaying.
+ *
+ * @param p Peer
+ */
+static void relay_up(struct relay_peer *p)
+{
+        struct relay_var *rv;
+
+        printf("relay: connected to %s\n", p->name);
+
+        p->state = RELAY_UP;
+        p->backoff = relay_retry;
+        p->in_len = 0;
+        p->out_len = 0;
+
+        if (*p->pass)
+                relay_queue(p, "pass: %s", p->pass);
+
+        for (rv = p->rv_start; rv; rv = rv->next)
+                relay_queue(p, "var %u:%s", rv->uid, rv->spec);
+
+        relay_flush(p);
+        relay_watch(p);
+}
+
+/**
+ * @brief Hang up on a peer and try again later, waiting twice as long as
+ *        last time.  Last values are kept for whoever's subscribed.
+ *
+ * @param p Peer
+ */
+static void relay_down(struct relay_peer *p)
+{
+        if (p->state == RELAY_UP)
+                printf("relay: lost %s, trying again in %.1fs\n",
+                       p->name, p->backoff);
+
+        if (p->sock != -1) {
+                event_del(relay_events, p->sock);
+                close(p->sock);
+                p->sock = -1;
+        }
+
+        p->state = RELAY_DOWN;
+        p->mask = 0;
+        p->in_len = 0;
+        p->out_len = 0;
+        p->next_try = get_mono_time() + p->backoff;
+
+        p->backoff *= 2;
+        if (p->backoff > relay_retry_max)
+                p->backoff = relay_retry_max;
+}
+
+/**
+ * @brief Read everything a peer sent and handle the complete lines.
+ *
+ * @param p Peer
+ */
+static void relay_read(struct relay_peer *p)
+{
+        char *line;
+        char *end;
+        size_t used;
+        int n;
+
+        while (p->state == RELAY_UP) {
+                if (p->in_size - p->in_len < 1024) {
+                        if (p->in_size >= RELAY_MAX_LINE) {
+                                fprintf(stderr, "relay: %s sent a line too "
+                                        "long, hanging up.\n", p->name);
+                                relay_down(p);
+                                return;
+                        }
+
+                        p->in_size = (p->in_size) ? p->in_size * 2 : 4096;
+                        p->in_buf = realloc(p->in_buf, p->in_size);
+                }
+
+                n = recv(p->sock, p->in_buf + p->in_len,
+                         p->in_size - p->in_len - 1, 0);
+
+                if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        return;
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n <= 0) {
+                        relay_down(p);
+                        return;
+                }
+
+                p->in_len += n;
+                p->in_buf[p->in_len] = '\0';
+
+                line = p->in_buf;
+                while (p->state == RELAY_UP && (end = strchr(line, '\n'))) {
+                        *end = '\0';
+                        if (end > line && end[-1] == '\r')
+                                end[-1] = '\0';
+
+                        relay_line(p, line);
+                        line = end + 1;
+                }
+
+                if (p->state != RELAY_UP)
+                        return;
+
+                used = line - p->in_buf;
+                memmove(p->in_buf, line, p->in_len - used);
+                p->in_len -= used;
+        }
+}
+
+/**
+ * @brief Handle a line from a peer.  All we care about are updates,
+ *        and being told we're not welcome.
+ *
+ * @param p Peer
+ * @param line Line without the \r\n
+ */
+static void relay_line(struct relay_peer *p, char *line)
+{
+        unsigned int uid;
+        int type;
+        int off = 0;
+
+        if (sscanf(line, "%u:%d:%n", &uid, &type, &off) == 2 && off > 0) {
+                relay_deliver(p, uid, type, line + off);
+        } else if (!strcmp(line, "STFU")) {
+                fprintf(stderr, "relay: %s didn't like our password.\n",
+                        p->name);
+                relay_down(p);
+        } else if (!strcmp(line, "BUSY")) {
+                relay_down(p);
+        }
+}
+
+/**
+ * @brief Pass an update from a peer on to everyone subscribed.
+ *
+ * @param p Peer
+ * @param uid Our id on the peer
+ * @param type Variable type, or 404
+ * @param value Value
+ */
+static void relay_deliver(struct relay_peer *p,
+                          unsigned int uid,
+                          int type,
+                          const char *value)
+{
+        struct relay_var *rv;
+        struct relay_sub **link;
+        struct relay_sub *sub;
+
+        for (rv = p->rv_start; rv; rv = rv->next)
+                if (rv->uid == uid)
+                        break;
+
+        if (rv == NULL)
+                return;
+
+        /* The peer doesn't have it, so nobody gets it. */
+        if (type == 404) {
+                for (sub = rv->subs; sub; sub = sub->next)
+                        donky_conn_send(sub->conn, "%u:404:", sub->id);
+
+                relay_var_free(p, rv, 0);
+                return;
+        }
+
+        free(rv->value);
+        rv->value = strdup(value);
+        rv->type = type;
+        rv->have = 1;
+
+        link = &rv->subs;
+        while ((sub = *link)) {
+                relay_send_value(sub, rv);
+
+                if (!sub->once) {
+                        link = &sub->next;
+                        continue;
+                }
+
+                *link = sub->next;
+                sub->conn->subs--;
+                rv->refs--;
+                free(sub);
+        }
+
+        if (rv->refs == 0)
+                relay_var_free(p, rv, 1);
+}
+
+/**
+ * @brief Send a relayed value to one subscriber.
+ *
+ * @param sub Subscriber
+ * @param rv Variable
+ */
+static void relay_send_value(struct relay_sub *sub, struct relay_var *rv)
+{
+        /* Sampled ones come as "<min> <max> <mean> <last>". */
+        if ((rv->type & (VARIABLE_BAR | VARIABLE_GRAPH)) &&
+            !(rv->type & VARIABLE_SAMPLED))
+                donky_conn_update_int(sub->conn, sub->id, rv->type,
+                                      strtoul(rv->value, NULL, 10));
+        else
+                donky_conn_update_str(sub->conn, sub->id, rv->type,
+                                      rv->value);
+}
+
+/**
+ * @brief Queue a line for a peer.
+ *
+ * @param p Peer
+ * @param fmt Format, no \r\n
+ */
+static void relay_queue(struct relay_peer *p, const char *fmt, ...)
+{
+        char buf[512];
+        va_list ap;
+        int n;
+
+        va_start(ap, fmt);
+        n = vsnprintf(buf, sizeof(buf) - 2, fmt, ap);
+        va_end(ap);
+
+        if (n < 0 || n > (int) sizeof(buf) - 3)
+                n = sizeof(buf) - 3;
+        buf[n++] = '\r';
+        buf[n++] = '\n';
+
+        if (p->out_len + n > p->out_size) {
+                p->out_size = (p->out_len + n) * 2;
+                p->out_buf = realloc(p->out_buf, p->out_size);
+        }
+
+        memcpy(p->out_buf + p->out_len, buf, n);
+        p->out_len += n;
+}
+
+/**
+ * @brief Send as much of a peer's queued output as it'll take.
+ *
+ * @param p Peer
+ */
+static void relay_flush(struct relay_peer *p)
+{
+        int n;
+
+        while (p->out_len) {
+                n = send(p->sock, p->out_buf, p->out_len, 0);
+
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        return;
+                if (n <= 0) {
+                        relay_down(p);
+                        return;
+                }
+
+                memmove(p->out_buf, p->out_buf + n, p->out_len - n);
+                p->out_len -= n;
+        }
+}
+
+/**
+ * @brief Watch for writability only while there's something to write.
+ *        Only the relay thread touches the event loop.
+ *
+ * @param p Peer
+ */
+static void relay_watch(struct relay_peer *p)
+{
+        int mask;
+
+        if (p->state != RELAY_UP)
+                return;
+
+        mask = EVENT_READ | ((p->out_len) ? EVENT_WRITE : 0);
+        if (mask != p->mask) {
+                event_mod(relay_events, p->sock, mask, p);
+                p->mask = mask;
+        }
+}
+
+/**
+ * @brief Forget a relayed variable, telling the peer if asked to.
+ *
+ * @param p Peer
+ * @param rv Variable
+ * @param tell Send unvar to the peer (bool)
+ */
+static void relay_var_free(struct relay_peer *p,
+                           struct relay_var *rv,
+                           int tell)
+{
+        struct relay_sub *sub;
+
+        if (tell && p->state == RELAY_UP) {
+                relay_queue(p, "unvar %u", rv->uid);
+                relay_flush(p);
+                if (p->out_len)
+                        event_wake(relay_events);
+        }
+
+        while ((sub = rv->subs)) {
+                rv->subs = sub->next;
+                sub->conn->subs--;
+                free(sub);
+        }
+
+        if (rv->prev)
+                rv->prev->next = rv->next;
+        if (rv->next)
+                rv->next->prev = rv->prev;
+        if (rv == p->rv_start)
+                p->rv_start = rv->next;
+        if (rv == p->rv_end)
+                p->rv_end = rv->prev;
+
+        free(rv->spec);
+        free(rv->value);
+        free(rv);
+}
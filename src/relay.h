@@ -0,0 +1,31 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include "daemon.h"
+
+#define RELAY_MAX_PEERS 256     /* peer0 through peer255 */
+#define RELAY_MAX_LINE 65536    /* Longest line we take from a peer. */
+
+int relay_start(void);
+void relay_stop(void);
+int relay_subscribe(donky_conn *conn,
+                    unsigned int id,
+                    const char *var,
+                    const char *args,
+                    int once);
+int relay_unsubscribe(donky_conn *conn, unsigned int id);
+void relay_drop_conn(donky_conn *conn);
+
+#endif /* RELAY_H */
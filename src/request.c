@@ -10,34 +10,105 @@
  * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
  */
 
-#include <math.h>
+#include <errno.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "../config.h"
 #include "cfg.h"
 #include "daemon.h"
 #include "default_settings.h"
+#include "host.h"
+#include "mcast.h"
 #include "mem.h"
+#include "metrics.h"
 #include "module.h"
 #include "net.h"
+#include "relay.h"
 #include "request.h"
+#include "sampler.h"
+#include "shm.h"
 #include "util.h"
 
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
+
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+
+/* The evaluation an eval heap node is in. */
+#define EVAL_OF(n) ((struct request_eval *) ((char *) (n) - \
+                    offsetof(struct request_eval, sched)))
+
 /* Globals. */
 struct request_list *rl_start = NULL;
 struct request_list *rl_end = NULL;
+static struct request_eval *re_start = NULL;
+static struct request_eval *re_end = NULL;
 static pthread_t request_thread_id;
 static int thread_is_launched = 0; /* bool */
+static int is_kicked = 0; /* bool, a subscription woke it this pass */
+static pthread_mutex_t request_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_wake;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static int wake_pending = 0; /* bool */
+static clockid_t request_clock = CLOCK_MONOTONIC;
+static struct deadline_heap eval_heap;     /* When each evaluation is due */
+static struct request_eval *pend_start = NULL;
+static double request_idle = DEFAULT_GLOBAL_SLEEP;
+static char *push_str = NULL;              /* What modules published */
+static size_t push_size = 0;
+static struct pool_io clock_io;             /* Fires when the clock's set */
+static int clock_is_watched = 0;            /* bool, clock_io's on the pool */
+static int clock_is_set = 0;                /* bool, under wake_lock */
+static int reload_wanted = 0;               /* bool, under wake_lock */
+static int low_wakeup = 0;                  /* bool, [daemon] low_wakeup */
+static double timer_slack = 0;              /* What the kernel's been told */
+static unsigned long wakeups = 0;           /* Times we've woken up */
+static unsigned long wakeups_then = 0;      /* ... at wakeups_since */
+static double wakeups_since = 0;
 
 /* Function prototypes. */
-static void request_handler_sleep_setup(struct timespec *tspec);
 static void *request_handler_exec(void *arg);
-static char *request_handler_strfunc(struct request_list *cur);
-static unsigned int request_handler_intfunc(struct request_list *cur);
+static void request_handler_wait(double now);
+static void request_handler_relock(void *arg);
+static void request_handler_kick(void);
+static void request_handler_low_wakeup(void);
+static void request_handler_wakeups(double now);
+static void request_push_collect(void);
+static void request_clock_watch(void);
+static int request_clock_arm(void);
+static void request_clock_ready(struct pool_io *io, int fired);
+static void request_clock_check(void);
+static void request_reload_check(void);
+static void request_eval_push(struct request_eval *ev,
+                              const char *str,
+                              unsigned int num,
+                              double stamp);
+static int request_eval_due(struct request_eval *ev, double now);
+static double request_eval_period(struct request_eval *ev);
+static void request_eval_dispatch(struct request_eval *ev);
+static void request_eval_sample(struct request_eval *ev, double now);
+static void request_eval_work(struct pool_job *job);
+static void request_eval_done(struct pool_job *job);
+static void request_eval_overdue(struct pool_job *job);
+static void request_eval_pend(struct request_eval *ev);
+static void request_eval_unpend(struct request_eval *ev);
+static void request_eval_deliver(struct request_eval *ev);
+static int request_send(donky_conn *conn,
+                        unsigned int id,
+                        struct request_eval *ev);
+static struct request_eval *request_eval_get(struct module_var *mv,
+                                             const char *args);
+static void request_eval_put(struct request_eval *ev);
+static void request_handler_unlock(void *arg);
 
 /**
  * @brief Start the request handler execution thread.
@@ -46,6 +117,18 @@ int request_handler_start(void)
 {
         int s;
         pthread_attr_t request_thread_attr;
+        pthread_condattr_t cond_attr;
+
+        /* Deadlines are on the monotonic clock, so the wait should be too.
+         * If it can't be, request_handler_wait() makes up the difference. */
+        pthread_condattr_init(&cond_attr);
+        request_clock = CLOCK_MONOTONIC;
+        if (pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC) != 0)
+                request_clock = CLOCK_REALTIME;
+        pthread_cond_init(&request_wake, &cond_attr);
+        pthread_condattr_destroy(&cond_attr);
+
+        request_clock_watch();
 
         s = pthread_attr_init(&request_thread_attr);
         if (s != 0)
@@ -73,191 +156,977 @@ void request_handler_stop(void)
         if (thread_is_launched) {
                 pthread_cancel(request_thread_id);
                 pthread_join(request_thread_id, NULL);
+                pthread_cond_destroy(&request_wake);
+                thread_is_launched = 0;
+        }
+
+        if (clock_is_watched) {
+                pool_io_del(&clock_io);
+                close(clock_io.fd);
+                clock_io.fd = -1;
+                clock_is_watched = 0;
         }
 }
 
 /**
- * @brief Call module methods according to the argument type.
- *
- * @param cur Request list node
+ * @brief Lock the request list.  The donky loop holds this while it adds
+ *        and removes requests, the request handler while it walks them.
+ */
+void request_list_lock(void)
+{
+        pthread_mutex_lock(&request_lock);
+}
+
+/**
+ * @brief Lock the request list, if nobody else has it.
  *
- * @return String
+ * @return 1 if it's locked now, 0 if somebody else has it
  */
-static char *request_handler_strfunc(struct request_list *cur)
+int request_list_trylock(void)
 {
-        char *ret;
-        
-        if (cur->var->type & ARGSTR)
-                ret = cur->var->syms.f_str_str(cur->args);
-        else if (cur->var->type & ARGINT)
-                ret = cur->var->syms.f_str_int((cur->args) ?
-                                               atoi(cur->args) : -1);
-        else if (cur->var->type & ARGDOUBLE)
-                ret = cur->var->syms.f_str_double((cur->args) ?
-                                                  strtod(cur->args, NULL) : -1.0);
-        else
-                ret = cur->var->syms.f_str();
+        return pthread_mutex_trylock(&request_lock) == 0;
+}
 
-        return ret;
+/**
+ * @brief Unlock the request list.
+ */
+void request_list_unlock(void)
+{
+        pthread_mutex_unlock(&request_lock);
 }
 
 /**
- * @brief Call module methods according to the argument type.
- *
- * @param cur Request list node
+ * @brief Wake the request handler up, because a worker finished something
+ *        or a module published something.  Doesn't need the request lock,
+ *        so anybody can, holding it or not.
+ */
+void request_handler_poke(void)
+{
+        pthread_mutex_lock(&wake_lock);
+        wake_pending = 1;
+        pthread_cond_signal(&request_wake);
+        pthread_mutex_unlock(&wake_lock);
+}
+
+/**
+ * @brief Have the request handler reload the config on its next pass.
+ *        It already holds the request lock and watches the workers, so a
+ *        hung module can't hold the reload up past its deadline, and the
+ *        I/O threads don't wait on it at all.
+ */
+void request_handler_reload(void)
+{
+        /* Nobody to hand it to. */
+        if (!thread_is_launched) {
+                request_list_lock();
+                donky_reconfigure();
+                request_list_unlock();
+                return;
+        }
+
+        pthread_mutex_lock(&wake_lock);
+        reload_wanted = 1;
+        wake_pending = 1;
+        pthread_cond_signal(&request_wake);
+        pthread_mutex_unlock(&wake_lock);
+}
+
+/**
+ * @brief Somebody subscribed, so get the handler up to give them something
+ *        right away.  A burst of them, like a front-end sending all its
+ *        vars at once, only wakes it the once.  Request list locked.
+ */
+static void request_handler_kick(void)
+{
+        if (!thread_is_launched || is_kicked)
+                return;
+
+        is_kicked = 1;
+        request_handler_poke();
+}
+
+/**
+ * @brief Cancellation cleanup, so a cancelled handler doesn't hold the lock.
  *
- * @return Integer
+ * @param arg Unused
  */
-static unsigned int request_handler_intfunc(struct request_list *cur)
+static void request_handler_unlock(void *arg)
 {
-        unsigned int ret;
-        
-        if (cur->var->type & ARGSTR)
-                ret = cur->var->syms.f_int_str(cur->args);
-        else if (cur->var->type & ARGINT)
-                ret = cur->var->syms.f_int_int((cur->args) ?
-                                               atoi(cur->args) : -1);
-        else if (cur->var->type & ARGDOUBLE)
-                ret = cur->var->syms.f_int_double((cur->args) ?
-                                                  strtod(cur->args, NULL) : -1.0);
-        else
-                ret = cur->var->syms.f_int();
+        pthread_mutex_unlock(&request_lock);
+}
 
-        return ret;
+/**
+ * @brief Cancellation cleanup for a handler cancelled while it slept, so
+ *        it's back to holding just the request lock.
+ *
+ * @param arg Unused
+ */
+static void request_handler_relock(void *arg)
+{
+        pthread_mutex_unlock(&wake_lock);
+        pthread_mutex_lock(&request_lock);
 }
 
 /**
- * @brief Request handler execution thread.
+ * @brief Request handler execution thread.  It sleeps until the soonest
+ *        deadline or until a worker hands something back, gives out
+ *        whatever's due to the workers and only tells the subscribers of
+ *        what came back.
  *
  * @param arg Arguments
  */
 static void *request_handler_exec(void *arg)
 {
-        struct timespec tspec;
-        struct request_list *cur;
-        struct request_list *next;
-        double timeout;
-        double last_update;
-        char *ret_str;
-        unsigned int ret_int;
-        unsigned int sum;
-        int n;
+        struct deadline *n;
+        struct request_eval *ev;
+        double now;
 
-        request_handler_sleep_setup(&tspec);
+        request_list_lock();
+        pthread_cleanup_push(request_handler_unlock, NULL);
+
+        wakeups_since = get_mono_time();
 
         /* Infinite Spewns Nerdiness Loop (tm) */
         while (1) {
-                module_var_cron_exec();
-                
-                cur = rl_start;
+                /* Every time, a reload might have changed them. */
+                request_idle = get_double_key("daemon", "global_sleep",
+                                              DEFAULT_GLOBAL_SLEEP);
+                request_handler_low_wakeup();
+
+                /* Hold the updates until the whole pass is done. */
+                donky_tick_begin();
+                is_kicked = 0;
+
+                now = get_mono_time();
+
+                /* Whatever the workers finished since last time, and
+                 * whatever they're taking way too long on. */
+                pool_collect();
+                pool_watch(now);
+                request_push_collect();
+                request_clock_check();
+                request_reload_check();
+
+                module_reconfigure_pending();
+                module_var_cron_exec(now, request_idle);
+                module_fd_exec(now);
+
+                /* Work out everything that's due, once per variable and
+                 * args no matter how many want it. */
+                while ((n = deadline_top(&eval_heap)) && n->due <= now) {
+                        ev = EVAL_OF(n);
+
+                        /* Try again once its module is out of the
+                         * doghouse. */
+                        if (module_is_quarantined(ev->var->parent, now)) {
+                                deadline_set(&eval_heap, n,
+                                             ev->var->parent->quarantine_until);
+                                continue;
+                        }
 
-                /* Handle all requests. */
-                while (cur) {
-                        next = cur->next;
+                        deadline_del(&eval_heap, n);
+                        if (module_var_sampled(ev->var))
+                                request_eval_sample(ev, now);
+                        else
+                                request_eval_dispatch(ev);
+                }
 
-                        timeout = cur->var->timeout;
-                        last_update = cur->var->last_update;
+                /* Then give their subscribers whatever they haven't seen
+                 * yet. */
+                while (pend_start)
+                        request_eval_deliver(pend_start);
 
-                        /* Keep going cuz this one hasn't timed out. */
-                        if ((get_time() - last_update < timeout) &&
-                            (timeout != 0 && last_update != 0) &&
-                            (cur->remove != 1) &&
-                            (cur->is_first != 1)) {
-                                cur = next;
-                                continue;
+                mcast_tick();
+                request_handler_wakeups(now);
+                metrics_tick();
+                donky_tick_end();
+
+                request_handler_wait(now);
+        }
+
+        pthread_cleanup_pop(1);
+
+        DEBUGF(("Done with thread!\n"));
+        return NULL;
+}
+
+/**
+ * @brief Pick up [daemon] low_wakeup.  In it variables get some slack so
+ *        their deadlines bunch up (see module_var_next()), we sleep for up
+ *        to a minute when nothing's due instead of global_sleep, and the
+ *        kernel may hold our wakeups back by timer_slack to line them up
+ *        with everybody else's.
+ */
+static void request_handler_low_wakeup(void)
+{
+        double slack = 0;
+
+        low_wakeup = get_bool_key("daemon", "low_wakeup", 0);
+        module_var_low_wakeup(low_wakeup);
+
+        if (low_wakeup)
+                slack = get_double_key("daemon", "timer_slack",
+                                       DEFAULT_TIMER_SLACK);
+        if (slack < 0)
+                slack = 0;
+
+#if defined(HAVE_SYS_PRCTL_H) && defined(PR_SET_TIMERSLACK)
+        /* Only this thread's, 0 puts the default back. */
+        if (slack != timer_slack &&
+            prctl(PR_SET_TIMERSLACK, (unsigned long) (slack * 1000000000),
+                  0, 0, 0) == -1)
+                perror("prctl PR_SET_TIMERSLACK");
+#endif
+        timer_slack = slack;
+}
+
+/**
+ * @brief Tell the metrics how often we've been waking up, once a minute.
+ *
+ * @param now When the pass started
+ */
+static void request_handler_wakeups(double now)
+{
+        if (now - wakeups_since < 60)
+                return;
+
+        metrics_wakeups(wakeups, (wakeups - wakeups_then) * 60 /
+                        (now - wakeups_since));
+        wakeups_then = wakeups;
+        wakeups_since = now;
+}
+
+/**
+ * @brief Sleep until the next thing is due, or somebody pokes us.  Never
+ *        longer than global_sleep (a minute in low_wakeup mode).  The
+ *        request lock is let go meanwhile, and a poke that came in since
+ *        the pass started counts.
+ *
+ * @param now When the pass started
+ */
+static void request_handler_wait(double now)
+{
+        struct deadline *n;
+        struct timespec ts;
+        double next = now + request_idle;
+        double due;
+
+        if (low_wakeup && request_idle < DEFAULT_LOW_WAKEUP_SLEEP)
+                next = now + DEFAULT_LOW_WAKEUP_SLEEP;
+
+        if ((n = deadline_top(&eval_heap)) && n->due < next)
+                next = n->due;
+        if ((due = module_var_cron_next()) && due < next)
+                next = due;
+        if ((due = mcast_next_due()) && due < next)
+                next = due;
+        if ((due = pool_next_overdue()) && due < next)
+                next = due;
+
+        /* Stuck with a wall clock condvar, so move the deadline over. */
+        if (request_clock != CLOCK_MONOTONIC)
+                next += get_time() - get_mono_time();
+
+        ts.tv_sec = (time_t) next;
+        ts.tv_nsec = (long) ((next - (double) ts.tv_sec) * 1000000000);
+
+        pthread_mutex_lock(&wake_lock);
+        request_list_unlock();
+        pthread_cleanup_push(request_handler_relock, NULL);
+
+        while (!wake_pending)
+                if (pthread_cond_timedwait(&request_wake, &wake_lock,
+                                           &ts) == ETIMEDOUT)
+                        break;
+        wake_pending = 0;
+        wakeups++;
+
+        pthread_cleanup_pop(1);
+}
+
+/**
+ * @brief Reload the config, if request_handler_reload() asked for it.
+ */
+static void request_reload_check(void)
+{
+        int is_wanted;
+        int old;
+
+        pthread_mutex_lock(&wake_lock);
+        is_wanted = reload_wanted;
+        reload_wanted = 0;
+        pthread_mutex_unlock(&wake_lock);
+
+        if (!is_wanted)
+                return;
+
+        /* Stopping halfway through would leave a config half swapped. */
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+        donky_reconfigure();
+        pthread_setcancelstate(old, NULL);
+}
+
+/**
+ * @brief Watch for somebody setting the wall clock, since aligned
+ *        variables are due at the wrong time after that.  A timer on the
+ *        wall clock that's cancelled when it's set, on the pool's event
+ *        loop.  Without timerfd they stay wrong until they run again.
+ */
+static void request_clock_watch(void)
+{
+        clock_io.fd = -1;
+
+#if defined(HAVE_SYS_TIMERFD_H) && defined(TFD_TIMER_CANCEL_ON_SET)
+        clock_io.fd = timerfd_create(CLOCK_REALTIME,
+                                     TFD_NONBLOCK | TFD_CLOEXEC);
+        if (clock_io.fd == -1)
+                return;
+
+        clock_io.mask = EVENT_READ;
+        clock_io.ready = &request_clock_ready;
+
+        if (request_clock_arm() == -1 || pool_io_add(&clock_io) == -1) {
+                close(clock_io.fd);
+                clock_io.fd = -1;
+                return;
+        }
+
+        clock_is_watched = 1;
+#endif
+}
+
+/**
+ * @brief Set the clock timer going again.  It's a day out, only here to
+ *        be cancelled, and just gets set again if it ever goes off.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int request_clock_arm(void)
+{
+#if defined(HAVE_SYS_TIMERFD_H) && defined(TFD_TIMER_CANCEL_ON_SET)
+        struct itimerspec its;
+
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = time(NULL) + 86400;
+
+        return timerfd_settime(clock_io.fd,
+                               TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                               &its, NULL);
+#else
+        return -1;
+#endif
+}
+
+/**
+ * @brief The clock timer fired, from the pool's event loop.  Let the
+ *        request handler sort it out.
+ *
+ * @param io Clock timer
+ * @param fired EVENT_* flags
+ */
+static void request_clock_ready(struct pool_io *io, int fired)
+{
+        pthread_mutex_lock(&wake_lock);
+        clock_is_set = 1;
+        wake_pending = 1;
+        pthread_cond_signal(&request_wake);
+        pthread_mutex_unlock(&wake_lock);
+}
+
+/**
+ * @brief If the clock was set, move the aligned evaluations and crons to
+ *        where they belong now.
+ */
+static void request_clock_check(void)
+{
+        struct request_eval *ev;
+        char buf[8];
+        int is_set;
+
+        pthread_mutex_lock(&wake_lock);
+        is_set = clock_is_set;
+        clock_is_set = 0;
+        pthread_mutex_unlock(&wake_lock);
+
+        if (!is_set)
+                return;
+
+        /* Cancelled or expired, either way it goes again. */
+        while (read(clock_io.fd, buf, sizeof(buf)) > 0)
+                ;
+        request_clock_arm();
+
+        for (ev = re_start; ev; ev = ev->next)
+                if (ev->var->is_aligned && ev->sched.slot != -1)
+                        deadline_set(&eval_heap, &ev->sched,
+                                     module_var_next(ev->var,
+                                                     request_eval_period(ev),
+                                                     ev->phase));
+
+        module_var_cron_realign();
+}
+
+/**
+ * @brief Hand what modules published since last time to the evaluations
+ *        of those variables.
+ */
+static void request_push_collect(void)
+{
+        struct module_var *mv;
+        struct request_eval *ev;
+        unsigned int num;
+        double stamp;
+
+        while ((mv = module_var_push_take(&push_str, &push_size, &num,
+                                          &stamp)))
+                for (ev = re_start; ev; ev = ev->next)
+                        if (ev->var == mv)
+                                request_eval_push(ev, push_str, num, stamp);
+}
+
+/**
+ * @brief Give an evaluation a published value, like it came back from a
+ *        worker.
+ *
+ * @param ev Evaluation
+ * @param str Value of STR variables
+ * @param num Value of BAR and GRAPH variables
+ * @param stamp When it was published
+ */
+static void request_eval_push(struct request_eval *ev,
+                              const char *str,
+                              unsigned int num,
+                              double stamp)
+{
+        size_t len;
+
+        ev->last_update = get_mono_time();
+        ev->stamp = stamp;
+        ev->runs++;
+
+        if (ev->var->type & VARIABLE_STR) {
+                shm_publish_str(ev->var, ev->args, str, stamp);
+                metrics_publish_str(ev->var, ev->args, str, stamp);
+
+                if (!ev->have || ev->is_stale || strcmp(ev->str, str)) {
+                        len = strlen(str) + 1;
+                        if (len > ev->size) {
+                                ev->size = len;
+                                ev->str = realloc(ev->str, len);
                         }
+                        memcpy(ev->str, str, len);
 
-                        /* Check that we have a symbol for the module var
-                         * method. */
-                        if (!cur->var->loaded)
-                                goto UPDATESTAT;
-
-                        /* VARIABLE_STR */
-                        if (cur->var->type & VARIABLE_STR) {
-                                ret_str = request_handler_strfunc(cur);
-                                sum = get_str_sum(ret_str);
-
-                                if (sum != cur->var->sum || cur->remove) {
-                                        n = sendcrlf(cur->conn->sock,
-                                                     "%u:%d:%s",
-                                                     cur->id,
-                                                     cur->var->type,
-                                                     ret_str);
-                                        cur->var->sum = sum;
-
-                                        if (n <= 0) {
-                                                DEBUGF(("Removing...\n"));
-                                                cur->remove = 1;
-                                        }
-                                }
-                        /* VARIABLE_BAR || VARIABLE_GRAPH */
-                        } else if (cur->var->type & VARIABLE_BAR ||
-                                   cur->var->type & VARIABLE_GRAPH) {
-                                ret_int = request_handler_intfunc(cur);
-                                sum = ret_int;
-
-                                if (sum != cur->var->sum || cur->remove) {
-                                        n = sendcrlf(cur->conn->sock,
-                                                     "%u:%d:%d",
-                                                     cur->id,
-                                                     cur->var->type,
-                                                     ret_int);
-                                        cur->var->sum = sum;
-
-                                        if (n <= 0) {
-                                                DEBUGF(("Removing...\n"));
-                                                cur->remove = 1;
-                                        }
-                                }
+                        ev->seq++;
+                        ev->have = 1;
+                }
+        } else {
+                shm_publish_int(ev->var, ev->args, num, stamp);
+                metrics_publish_int(ev->var, ev->args, num, stamp);
+
+                if (!ev->have || ev->is_stale || num != ev->num) {
+                        ev->num = num;
+                        ev->seq++;
+                        ev->have = 1;
+                }
+        }
+
+        ev->is_stale = 0;
+        request_eval_pend(ev);
+}
+
+/**
+ * @brief See if an evaluation needs to be run again.
+ *
+ * @param ev Evaluation
+ * @param now Current time
+ *
+ * @return 1 if it's due, 0 if what it has is still good
+ */
+static int request_eval_due(struct request_eval *ev, double now)
+{
+        double timeout = ev->var->timeout;
+
+        /* What was published last is always current. */
+        if (ev->var->is_push)
+                return !ev->have;
+
+        return ev->last_update == 0 || timeout == 0 ||
+               now - ev->last_update >= timeout;
+}
+
+/**
+ * @brief How often an evaluation runs.  No timeout means every
+ *        global_sleep, like it always has.
+ *
+ * @param ev Evaluation
+ *
+ * @return Seconds
+ */
+static double request_eval_period(struct request_eval *ev)
+{
+        return (ev->var->timeout > 0) ? ev->var->timeout : request_idle;
+}
+
+/**
+ * @brief Hand an evaluation to the workers.  It's out of the heap until
+ *        it's back, and it and its module stick around until then too.
+ *
+ * @param ev Evaluation
+ */
+static void request_eval_dispatch(struct request_eval *ev)
+{
+        ev->is_busy = 1;
+        ev->refs++;
+        ev->var->parent->clients++;
+        ev->job.limit = ev->var->deadline;
+
+        pool_submit(&ev->var->parent->strand, &ev->job);
+}
+
+/**
+ * @brief Report what the sampler saw since last time, instead of calling
+ *        the module.  Subscribers get "<min> <max> <mean> <last>", shared
+ *        memory and metrics just the last sample.
+ *
+ * @param ev Evaluation
+ * @param now When the pass started
+ */
+static void request_eval_sample(struct request_eval *ev, double now)
+{
+        struct sampler_stats st;
+        char buf[64];
+        size_t len;
+
+        if (ev->sample == NULL &&
+            (ev->sample = sampler_add(ev->var, ev->args, ev->var->sample_rate,
+                                      request_eval_period(ev))) == NULL) {
+                /* Not on a worker instead, the method's counting on only
+                 * ever being called from the sampler. */
+                deadline_set(&eval_heap, &ev->sched,
+                             now + request_eval_period(ev));
+                return;
+        }
+
+        /* Only just started, or its module's away. */
+        if (!sampler_take(ev->sample, &st)) {
+                deadline_set(&eval_heap, &ev->sched, now + SAMPLER_RETRY);
+                return;
+        }
+
+        ev->last_update = now;
+        ev->stamp = get_time();
+        ev->runs++;
+
+        shm_publish_int(ev->var, ev->args, st.last, ev->stamp);
+        metrics_publish_int(ev->var, ev->args, st.last, ev->stamp);
+
+        sprintf(buf, "%u %u %.1f %u", st.min, st.max, st.mean, st.last);
+        if (!ev->have || ev->is_stale || strcmp(ev->str, buf)) {
+                len = strlen(buf) + 1;
+                if (len > ev->size) {
+                        ev->size = len;
+                        ev->str = realloc(ev->str, len);
+                }
+                memcpy(ev->str, buf, len);
+
+                ev->seq++;
+                ev->have = 1;
+        }
+
+        ev->is_stale = 0;
+        deadline_set(&eval_heap, &ev->sched,
+                     module_var_next(ev->var, request_eval_period(ev),
+                                     ev->phase));
+        request_eval_pend(ev);
+}
+
+/**
+ * @brief Call the module for an evaluation, on a worker.  Only the res_
+ *        fields get touched, the request handler looks at them when it's
+ *        back.
+ *
+ * @param job Job of the evaluation
+ */
+static void request_eval_work(struct pool_job *job)
+{
+        struct request_eval *ev = job->data;
+        const char *str;
+        size_t len;
+
+        ev->res_ok = 0;
+        ev->res_lost = 0;
+        ev->res_stamp = get_time();
+
+        /* Check that we have a symbol for the module var method. */
+        if (!ev->var->loaded)
+                return;
+
+        /* Over in its host, the result's copied straight into res_. */
+        if (ev->var->parent->host) {
+                if (host_call(ev->var->parent->host, ev->var, ev->args,
+                              &ev->res_str, &ev->res_size,
+                              &ev->res_num) == 0)
+                        ev->res_ok = 1;
+                else
+                        ev->res_lost = 1;
+                return;
+        }
+
+        /* VARIABLE_STR */
+        if (ev->var->type & VARIABLE_STR) {
+                if ((str = module_var_call_str(ev->var, ev->args)) == NULL)
+                        str = "";
+
+                /* It might be the module's own buffer, so copy it before
+                 * anything else of the module's runs. */
+                len = strlen(str) + 1;
+                if (len > ev->res_size) {
+                        ev->res_size = len;
+                        ev->res_str = realloc(ev->res_str, len);
+                }
+                memcpy(ev->res_str, str, len);
+                ev->res_ok = 1;
+        /* VARIABLE_BAR || VARIABLE_GRAPH */
+        } else if (ev->var->type & VARIABLE_BAR ||
+                   ev->var->type & VARIABLE_GRAPH) {
+                ev->res_num = module_var_call_int(ev->var, ev->args);
+                ev->res_ok = 1;
+        }
+
+        /* Clear memory list. */
+        mem_list_clear();
+}
+
+/**
+ * @brief An evaluation is back from a worker.  Keep the result, work out
+ *        when it's due again, and let its subscribers know.  The sequence
+ *        number only goes up if the value actually changed.
+ *
+ * @param job Job of the evaluation
+ */
+static void request_eval_done(struct pool_job *job)
+{
+        struct request_eval *ev = job->data;
+        struct module *parent = ev->var->parent;
+        char *tmp;
+        size_t size;
+
+        ev->is_busy = 0;
+        ev->last_update = get_mono_time();
+        ev->runs++;
+
+        /* It was given up on, whatever it got is from who knows when.
+         * Subscribers stay on n/a until the next run. */
+        if (job->is_overdue) {
+                ev->res_ok = 0;
+                ev->res_lost = 0;
+        }
+
+        if (ev->res_ok)
+                ev->stamp = ev->res_stamp;
+
+        if (ev->res_ok && (ev->var->type & VARIABLE_STR)) {
+                shm_publish_str(ev->var, ev->args, ev->res_str, ev->stamp);
+                metrics_publish_str(ev->var, ev->args, ev->res_str,
+                                    ev->stamp);
+
+                /* Swap buffers instead of copying. */
+                if (!ev->have || ev->is_stale ||
+                    strcmp(ev->str, ev->res_str)) {
+                        tmp = ev->str;
+                        size = ev->size;
+                        ev->str = ev->res_str;
+                        ev->size = ev->res_size;
+                        ev->res_str = tmp;
+                        ev->res_size = size;
+
+                        ev->seq++;
+                        ev->have = 1;
+                }
+
+                ev->is_stale = 0;
+        } else if (ev->res_ok) {
+                shm_publish_int(ev->var, ev->args, ev->res_num, ev->stamp);
+                metrics_publish_int(ev->var, ev->args, ev->res_num,
+                                    ev->stamp);
+
+                if (!ev->have || ev->is_stale || ev->res_num != ev->num) {
+                        ev->num = ev->res_num;
+                        ev->seq++;
+                        ev->have = 1;
+                }
+
+                ev->is_stale = 0;
+        } else if (ev->res_lost && !ev->is_stale) {
+                /* Its host went away, n/a until it's back. */
+                ev->is_stale = 1;
+                ev->have = 1;
+                ev->seq++;
+        }
+
+        /* Our reference is the last one if nobody wants it anymore. */
+        if (ev->refs > 1)
+                deadline_set(&eval_heap, &ev->sched,
+                             module_var_next(ev->var, request_eval_period(ev),
+                                             ev->phase));
+
+        request_eval_pend(ev);
+        request_eval_put(ev);
+
+        if (--parent->clients == 0)
+                module_unload(parent);
+}
+
+/**
+ * @brief An evaluation blew its deadline.  Its worker's been given up on,
+ *        so subscribers get n/a until it comes back with something, and
+ *        the module gets left alone for a while.
+ *
+ * @param job Job of the evaluation
+ */
+static void request_eval_overdue(struct pool_job *job)
+{
+        struct request_eval *ev = job->data;
+
+        fprintf(stderr, "%s: Took longer than %.1fs, giving up on it.\n",
+                ev->var->name, job->limit);
+
+        if (!ev->is_stale) {
+                ev->is_stale = 1;
+                ev->have = 1;
+                ev->seq++;
+                request_eval_pend(ev);
+        }
+
+        module_quarantine(ev->var->parent);
+}
+
+/**
+ * @brief Mark an evaluation as having something for its subscribers.
+ *
+ * @param ev Evaluation
+ */
+static void request_eval_pend(struct request_eval *ev)
+{
+        if (ev->is_pending)
+                return;
+
+        ev->is_pending = 1;
+        ev->pend_prev = NULL;
+        ev->pend_next = pend_start;
+        if (pend_start)
+                pend_start->pend_prev = ev;
+        pend_start = ev;
+}
+
+/**
+ * @brief Take an evaluation off the pending list.
+ *
+ * @param ev Evaluation
+ */
+static void request_eval_unpend(struct request_eval *ev)
+{
+        if (!ev->is_pending)
+                return;
+
+        if (ev->pend_prev)
+                ev->pend_prev->pend_next = ev->pend_next;
+        if (ev->pend_next)
+                ev->pend_next->pend_prev = ev->pend_prev;
+        if (ev == pend_start)
+                pend_start = ev->pend_next;
+
+        ev->is_pending = 0;
+}
+
+/**
+ * @brief Give an evaluation's subscribers whatever they haven't seen yet,
+ *        and let go of varonce subscribers that are done.
+ *
+ * @param ev Evaluation, taken off the pending list
+ */
+static void request_eval_deliver(struct request_eval *ev)
+{
+        struct request_list *cur;
+        struct request_list *next;
+
+        request_eval_unpend(ev);
+
+        /* Removing the last subscriber would free it out from under us. */
+        ev->refs++;
+
+        for (cur = ev->subs; cur; cur = next) {
+                next = cur->sub_next;
+
+                /* varonce wants a value from after it asked. */
+                if (cur->remove && ev->runs < cur->after_run)
+                        continue;
+
+                if (ev->have && cur->sent_seq != ev->seq) {
+                        cur->sent_seq = ev->seq;
+
+                        if (request_send(cur->conn, cur->id, ev) <= 0) {
+                                DEBUGF(("Removing...\n"));
+                                cur->remove = 1;
                         }
+                }
 
-UPDATESTAT:
-                        /* Set the last time it was updated. */
-                        cur->var->last_update = get_time();
+                /* varonce is done once it got something, or if there's
+                 * nothing to get. */
+                if (cur->remove && (cur->sent_seq || !cur->var->loaded))
+                        request_list_remove(cur);
+        }
 
-                        /* Clear memory list. */
-                        mem_list_clear();
+        request_eval_put(ev);
+}
 
-                        /* This isn't the first handle anymore. */
-                        if (cur->is_first)
-                                cur->is_first = 0;
+/**
+ * @brief Send an evaluation's value to a subscriber.
+ *
+ * @param conn Connection, NULL for the multicast publisher
+ * @param id Their id
+ * @param ev Evaluation
+ *
+ * @return What donky_conn_update_*() said, > 0 is good
+ */
+static int request_send(donky_conn *conn,
+                        unsigned int id,
+                        struct request_eval *ev)
+{
+        int is_int = !(ev->var->type & VARIABLE_STR) && !ev->sample;
+        int type = ev->var->type | ((ev->sample) ? VARIABLE_SAMPLED : 0);
+
+        /* Stale ones are n/a whatever they are, with the flag so front-ends
+         * can tell. */
+        if (ev->is_stale) {
+                if (conn == NULL) {
+                        mcast_update_str(id, ev->var->type | VARIABLE_STALE,
+                                         "n/a");
+                        return 1;
+                }
+
+                return donky_conn_update_str(conn, id,
+                                             ev->var->type | VARIABLE_STALE,
+                                             "n/a");
+        }
+
+        /* The multicast publisher keeps track of what changed itself, and
+         * the metrics subscriptions only need collecting. */
+        if (conn == NULL) {
+                if (is_int)
+                        mcast_update_int(id, type, ev->num);
+                else
+                        mcast_update_str(id, type, ev->str);
+                return 1;
+        }
+
+        if (is_int)
+                return donky_conn_update_int(conn, id, type, ev->num);
+
+        return donky_conn_update_str(conn, id, type, ev->str);
+}
+
+/**
+ * @brief Find the evaluation for a variable and args, or start a new one.
+ *        Args are trimmed, ARGINT ones turned into plain numbers, so
+ *        "5" and " 05" share, and dropped for variables that take none.
+ *
+ * @param mv Variable
+ * @param args Args as the client sent them, NULL for none
+ *
+ * @return Evaluation, not counting the caller as a user yet
+ */
+static struct request_eval *request_eval_get(struct module_var *mv,
+                                             const char *args)
+{
+        struct request_eval *ev;
+        char canon[64];
+        char *key = NULL;
+        size_t len;
 
-                        /* Remove this request. */
-                        if (cur->remove)
-                                request_list_remove(cur);
-                        
-                        /* Next node. */
-                        cur = next;
+        if (args) {
+                while (*args == ' ' || *args == '\t')
+                        args++;
+                len = strlen(args);
+                while (len && (args[len - 1] == ' ' || args[len - 1] == '\t'))
+                        len--;
+
+                /* Args are thrown away for those that don't take any, so
+                 * they all share one. */
+                if (!(mv->type & (ARGSTR | ARGINT | ARGDOUBLE))) {
+                        len = 0;
+                } else if (len && (mv->type & ARGINT)) {
+                        sprintf(canon, "%d", atoi(args));
+                        key = strdup(canon);
+                } else if (len) {
+                        key = malloc(len + 1);
+                        memcpy(key, args, len);
+                        key[len] = '\0';
                 }
+        }
 
-                /* Sleep! */
-                if (nanosleep(&tspec, NULL) == -1) {
-                        DEBUGF(("Breaking from request handler...\n"));
-                        break;
+        for (ev = re_start; ev; ev = ev->next) {
+                if (ev->var != mv)
+                        continue;
+
+                if ((key == NULL && ev->args == NULL) ||
+                    (key && ev->args && !strcmp(key, ev->args))) {
+                        free(key);
+                        return ev;
                 }
         }
 
-        DEBUGF(("Done with thread!\n"));
-        return NULL;
+        ev = calloc(1, sizeof(struct request_eval));
+        ev->var = mv;
+        ev->args = key;
+        ev->sched.slot = -1;
+        ev->phase = deadline_phase(mv->name, key);
+        ev->job.work = &request_eval_work;
+        ev->job.done = &request_eval_done;
+        ev->job.overdue = &request_eval_overdue;
+        ev->job.data = ev;
+
+        if (re_end == NULL) {
+                re_start = ev;
+                re_end = ev;
+        } else {
+                re_end->next = ev;
+                ev->prev = re_end;
+                re_end = ev;
+        }
+
+        return ev;
 }
 
 /**
- * @brief Setup the nanosleep timespec structure.
+ * @brief Done with an evaluation, free it if nobody else wants it.
  *
- * @param tspec
+ * @param ev Evaluation
  */
-static void request_handler_sleep_setup(struct timespec *tspec)
+static void request_eval_put(struct request_eval *ev)
 {
-        double min_sleep; 
-        int min_seconds;
-        long min_nanoseconds;
+        if (--ev->refs > 0)
+                return;
 
-        /* Setup minimum sleep time. */
-        min_sleep = get_double_key("daemon", "global_sleep", DEFAULT_GLOBAL_SLEEP);
-        min_seconds = (int) min_sleep;
-        min_nanoseconds = (min_sleep - min_seconds) * pow(10, 9);
-        tspec->tv_sec = min_seconds;
-        tspec->tv_nsec = min_nanoseconds;
+        deadline_del(&eval_heap, &ev->sched);
+        request_eval_unpend(ev);
+        if (ev->sample)
+                sampler_del(ev->sample);
+        metrics_forget(ev->var, ev->args);
+
+        if (ev->prev)
+                ev->prev->next = ev->next;
+        if (ev->next)
+                ev->next->prev = ev->prev;
+        if (ev == re_start)
+                re_start = ev->next;
+        if (ev == re_end)
+                re_end = ev->prev;
+
+        free(ev->args);
+        free(ev->str);
+        free(ev->res_str);
+        free(ev);
 }
 
 /**
@@ -267,7 +1136,7 @@ static void request_handler_sleep_setup(struct timespec *tspec)
  * @param buf
  * @param remove
  */
-int request_list_add(const donky_conn *conn, const char *buf, int remove)
+int request_list_add(donky_conn *conn, const char *buf, int remove)
 {
         struct request_list *n;
         unsigned int id;
@@ -275,6 +1144,9 @@ int request_list_add(const donky_conn *conn, const char *buf, int remove)
         char *var;
         char *args;
         struct module_var *mv;
+        struct request_eval *ev;
+        unsigned int num;
+        double stamp;
 
         str = strdup(buf);
 
@@ -298,28 +1170,56 @@ int request_list_add(const donky_conn *conn, const char *buf, int remove)
         id = atoi(str);
         DEBUGF(("Request list add: id[%u] var[%s] args[%s]\n", id, var, args));
 
+        /* peer/variable comes from another donky. */
+        if (strchr(var, '/') && relay_subscribe(conn, id, var, args, remove)) {
+                free(str);
+                return 1;
+        }
+
         /* Find the module_var node for this variable. */
         if ((mv = module_var_find_by_name(var)) == NULL) {
                 DEBUGF(("Couldn't find module var!\n"));
 
                 /* Send an error response. */
-                sendcrlf(conn->sock, "%u:404:", id);
+                if (conn)
+                        donky_conn_send(conn, "%u:404:", id);
                 
                 free(str);
                 return 0;
         }
 
+        ev = request_eval_get(mv, args);
+
+        /* varonce gets what somebody else's subscription already has, if
+         * it's fresh enough that we wouldn't ask the module again. */
+        if (remove && conn && ev->have &&
+            !request_eval_due(ev, get_mono_time())) {
+                request_send(conn, id, ev);
+                free(str);
+                return 1;
+        }
+
         /* Create request_list node... */
         n = malloc(sizeof(struct request_list));
 
         n->id = id;
         n->conn = conn;
         n->var = mv;
+        n->eval = ev;
         n->args = args;
+        n->sent_seq = 0;
+        n->after_run = (remove) ? ev->runs + 1 : 0;
         n->remove = remove;
-        n->is_first = 1;
         n->tofree = str;
 
+        ev->refs++;
+
+        n->sub_prev = NULL;
+        n->sub_next = ev->subs;
+        if (ev->subs)
+                ev->subs->sub_prev = n;
+        ev->subs = n;
+
         n->prev = NULL;
         n->next = NULL;
 
@@ -346,6 +1246,28 @@ int request_list_add(const donky_conn *conn, const char *buf, int remove)
 
         /* Let the module var parent know we are using it. */
         mv->parent->clients++;
+        if (conn)
+                conn->subs++;
+
+        /* Something new is due right now.  Otherwise they get what it has,
+         * except varonce, which waits for the next run.  Either way the
+         * handler shouldn't sleep through it. */
+        if (mv->is_push) {
+                /* Nothing to run, they get whatever was published last or
+                 * wait for the first one. */
+                if (!ev->have && module_var_push_peek(mv, &push_str,
+                                                      &push_size, &num,
+                                                      &stamp))
+                        request_eval_push(ev, push_str, num, stamp);
+                else if (!remove)
+                        request_eval_pend(ev);
+        } else if (ev->sched.slot == -1 && !ev->is_busy) {
+                deadline_set(&eval_heap, &ev->sched, get_mono_time());
+        } else if (!remove) {
+                request_eval_pend(ev);
+        }
+
+        request_handler_kick();
 
         return 1;
 }
@@ -359,8 +1281,19 @@ void request_list_remove(struct request_list *cur)
 {
         if (!cur)
                 return;
+
+        if (cur->sub_prev)
+                cur->sub_prev->sub_next = cur->sub_next;
+        if (cur->sub_next)
+                cur->sub_next->sub_prev = cur->sub_prev;
+        if (cur == cur->eval->subs)
+                cur->eval->subs = cur->sub_next;
         
+        request_eval_put(cur->eval);
+
         cur->var->parent->clients--;
+        if (cur->conn)
+                cur->conn->subs--;
 
         DEBUGF(("Removing from request list...\n"));
 
@@ -403,6 +1336,34 @@ struct request_list *request_list_find_by_conn(donky_conn *conn)
         return NULL;
 }
 
+/**
+ * @brief Remove a connection's requests with the given id.
+ *
+ * @param conn Connection
+ * @param id Their id
+ *
+ * @return How many were removed
+ */
+int request_list_remove_id(donky_conn *conn, unsigned int id)
+{
+        struct request_list *cur = rl_start;
+        struct request_list *next;
+        int count = 0;
+
+        while (cur) {
+                next = cur->next;
+
+                if (cur->conn == conn && cur->id == id) {
+                        request_list_remove(cur);
+                        count++;
+                }
+
+                cur = next;
+        }
+
+        return count;
+}
+
 /**
  * @brief Clear the request list.
  */
@@ -425,4 +1386,16 @@ void request_list_clear(void)
         rl_start = NULL;
         rl_end = NULL;
         thread_is_launched = 0;
+
+        deadline_clear(&eval_heap);
+        pend_start = NULL;
+
+        while (re_start) {
+                re_end = re_start->next;
+                free(re_start->args);
+                free(re_start->str);
+                free(re_start->res_str);
+                free(re_start);
+                re_start = re_end;
+        }
 }
@@ -14,24 +14,83 @@
 #define REQUEST_H
 
 #include "daemon.h"
+#include "deadline.h"
+#include "pool.h"
+#include "sampler.h"
+
+struct request_list;
+
+/**
+ * One evaluation of a variable with some args, shared by everybody who
+ * asked for the same thing.
+ */
+struct request_eval {
+        struct module_var *var;
+        char *args;             /* Canonical args, NULL for none */
+        double last_update;
+        double stamp;           /* When the value was collected, epoch */
+
+        int have;               /* Got a value yet (bool) */
+        int is_stale;           /* Its method hung, it's n/a (bool) */
+        unsigned long seq;      /* Goes up every time the value changes. */
+        char *str;              /* Value of STR variables */
+        size_t size;
+        unsigned int num;       /* Value of BAR and GRAPH variables */
+
+        int refs;
+
+        struct pool_job job;            /* Running it on a worker */
+        int is_busy;                    /* On a worker right now (bool) */
+        unsigned long runs;             /* How many times it came back */
+        int res_ok;                     /* The worker got something (bool) */
+        int res_lost;                   /* Its module host went away (bool) */
+        char *res_str;                  /* What it got, for STR variables */
+        size_t res_size;
+        unsigned int res_num;           /* Ditto, for BAR and GRAPH */
+        double res_stamp;               /* When it was called, epoch */
+
+        struct deadline sched;          /* When it's due again */
+        double phase;                   /* Where in its period it runs */
+        struct sampler_series *sample;  /* Sampled instead, NULL if not */
+
+        struct request_list *subs;      /* Everybody who wants it */
+        int is_pending;                 /* Subscribers have news (bool) */
+        struct request_eval *pend_prev;
+        struct request_eval *pend_next;
+
+        struct request_eval *prev;
+        struct request_eval *next;
+};
 
 struct request_list {
         unsigned int id;
-        const donky_conn *conn;
+        donky_conn *conn;      /* NULL for multicast and metrics */
         struct module_var *var;
+        struct request_eval *eval;
         char *args;
+        unsigned long sent_seq; /* eval->seq they last got, 0 for nothing */
+        unsigned long after_run; /* varonce waits for eval->runs to get here */
         int remove;     /* bool */
-        int is_first;   /* bool */
         char *tofree;
+
+        struct request_list *sub_prev;  /* Same evaluation */
+        struct request_list *sub_next;
         
         struct request_list *prev;
         struct request_list *next;
 };
 
-int request_list_add(const donky_conn *conn, const char *buf, int remove);
+int request_list_add(donky_conn *conn, const char *buf, int remove);
 void request_list_remove(struct request_list *cur);
+int request_list_remove_id(donky_conn *conn, unsigned int id);
 void request_list_clear(void);
+void request_list_lock(void);
+int request_list_trylock(void);
+void request_list_unlock(void);
+void request_handler_poke(void);
+void request_handler_reload(void);
 int request_handler_start(void);
+void request_handler_stop(void);
 struct request_list *request_list_find_by_conn(donky_conn *conn);
 
 #endif /* REQUEST_H */
@@ -0,0 +1,320 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../config.h"
+#include "module.h"
+#include "sampler.h"
+#include "util.h"
+
+/* The request handler must never see head move before the sample's in the
+ * ring, and the sampler never reuse a slot before tail's moved past it. */
+#if defined(__GNUC__)
+#define sampler_barrier() __sync_synchronize()
+#else
+#define sampler_barrier()
+#endif
+
+/* Globals. */
+static struct sampler_series *ss_start = NULL;
+static struct sampler_series *ss_end = NULL;
+static pthread_mutex_t sampler_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sampler_wake;
+static clockid_t sampler_clock = CLOCK_MONOTONIC;
+static pthread_t sampler_thread;
+static int sampler_is_launched = 0; /* bool */
+static int sampler_is_stopping = 0; /* bool */
+
+/* Function prototypes. */
+static int sampler_start(void);
+static void *sampler_run(void *arg);
+static void sampler_sample(struct sampler_series *s);
+
+/**
+ * @brief Start sampling a variable.  The sampler thread is started the
+ *        first time around.  Call with the request lock held.
+ *
+ * @param mv Variable, BAR or GRAPH and in this process
+ * @param args Canonical args, NULL for none
+ * @param rate Samples a second
+ * @param interval Seconds between takes, so the ring can hold them all
+ *
+ * @return Series, NULL if it couldn't be
+ */
+struct sampler_series *sampler_add(struct module_var *mv,
+                                   const char *args,
+                                   double rate,
+                                   double interval)
+{
+        struct sampler_series *s;
+        unsigned long size = SAMPLER_RING_MIN;
+
+        if (rate <= 0 || (!sampler_is_launched && sampler_start() == -1))
+                return NULL;
+        if (rate > SAMPLER_RATE_MAX)
+                rate = SAMPLER_RATE_MAX;
+
+        /* Room for two takes' worth, in case the request handler's late. */
+        while (size < SAMPLER_RING_MAX && size < rate * interval * 2)
+                size <<= 1;
+
+        s = calloc(1, sizeof(struct sampler_series));
+        s->ring = malloc(size * sizeof(unsigned int));
+        s->mask = size - 1;
+        s->mv = mv;
+        s->args = (args) ? strdup(args) : NULL;
+        s->period = 1.0 / rate;
+        s->due = get_mono_time();
+
+        pthread_mutex_lock(&sampler_lock);
+
+        if (ss_end == NULL) {
+                ss_start = s;
+                ss_end = s;
+        } else {
+                ss_end->next = s;
+                s->prev = ss_end;
+                ss_end = s;
+        }
+
+        pthread_cond_signal(&sampler_wake);
+        pthread_mutex_unlock(&sampler_lock);
+
+        DEBUGF(("Sampling %s at %.0f/s, %lu slots\n", mv->name, rate, size));
+
+        return s;
+}
+
+/**
+ * @brief Stop sampling a variable.  Once this is back the sampler thread
+ *        is done with it.
+ *
+ * @param s Series
+ */
+void sampler_del(struct sampler_series *s)
+{
+        pthread_mutex_lock(&sampler_lock);
+
+        if (s->prev)
+                s->prev->next = s->next;
+        if (s->next)
+                s->next->prev = s->prev;
+        if (s == ss_start)
+                ss_start = s->next;
+        if (s == ss_end)
+                ss_end = s->prev;
+
+        pthread_mutex_unlock(&sampler_lock);
+
+        free(s->args);
+        free(s->ring);
+        free(s);
+}
+
+/**
+ * @brief Empty a series' ring into stats, from the request handler.
+ *
+ * @param s Series
+ * @param st Filled in if there was anything
+ *
+ * @return How many samples there were
+ */
+unsigned long sampler_take(struct sampler_series *s,
+                           struct sampler_stats *st)
+{
+        unsigned long head;
+        unsigned long tail;
+        unsigned int num;
+        double sum = 0;
+
+        head = s->head;
+        sampler_barrier();
+
+        if ((tail = s->tail) == head)
+                return 0;
+
+        st->count = head - tail;
+        st->min = st->max = s->ring[tail & s->mask];
+
+        for (; tail != head; tail++) {
+                num = s->ring[tail & s->mask];
+                if (num < st->min)
+                        st->min = num;
+                if (num > st->max)
+                        st->max = num;
+                sum += num;
+        }
+
+        st->mean = sum / st->count;
+        st->last = num;
+
+        /* Only now can the sampler have those slots back. */
+        sampler_barrier();
+        s->tail = tail;
+
+        return st->count;
+}
+
+/**
+ * @brief Keep the sampler out of every module until sampler_release(), so
+ *        one can be unloaded without it being in the middle of a call.
+ */
+void sampler_hold(void)
+{
+        pthread_mutex_lock(&sampler_lock);
+}
+
+/**
+ * @brief Let the sampler back in.
+ */
+void sampler_release(void)
+{
+        pthread_mutex_unlock(&sampler_lock);
+}
+
+/**
+ * @brief Stop the sampler thread, if it was ever started.  It's never
+ *        cancelled, it could be in the middle of a module, so this waits
+ *        for it to finish the sample it's on.
+ */
+void sampler_stop(void)
+{
+        if (!sampler_is_launched)
+                return;
+
+        pthread_mutex_lock(&sampler_lock);
+        sampler_is_stopping = 1;
+        pthread_cond_signal(&sampler_wake);
+        pthread_mutex_unlock(&sampler_lock);
+
+        pthread_join(sampler_thread, NULL);
+        sampler_is_stopping = 0;
+        pthread_cond_destroy(&sampler_wake);
+        sampler_is_launched = 0;
+}
+
+/**
+ * @brief Start the sampler thread.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int sampler_start(void)
+{
+        pthread_condattr_t cond_attr;
+
+        /* Same as the request handler, sleep on the monotonic clock if we
+         * can. */
+        pthread_condattr_init(&cond_attr);
+        sampler_clock = CLOCK_MONOTONIC;
+        if (pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC) != 0)
+                sampler_clock = CLOCK_REALTIME;
+        pthread_cond_init(&sampler_wake, &cond_attr);
+        pthread_condattr_destroy(&cond_attr);
+
+        if (pthread_create(&sampler_thread, NULL, &sampler_run, NULL) != 0) {
+                pthread_cond_destroy(&sampler_wake);
+                fprintf(stderr, "Couldn't start the sampler.\n");
+                return -1;
+        }
+
+        sampler_is_launched = 1;
+
+        return 0;
+}
+
+/**
+ * @brief Sampler thread.  Takes a sample of every series that's due, then
+ *        sleeps until the next one is.  It only holds the lock while
+ *        sampling, never while sleeping.
+ *
+ * @param arg Arguments
+ */
+static void *sampler_run(void *arg)
+{
+        struct sampler_series *s;
+        struct timespec ts;
+        double now;
+        double next;
+
+        pthread_mutex_lock(&sampler_lock);
+
+        while (!sampler_is_stopping) {
+                /* Nothing to sample, sleep until there is. */
+                if (ss_start == NULL) {
+                        pthread_cond_wait(&sampler_wake, &sampler_lock);
+                        continue;
+                }
+
+                now = get_mono_time();
+                next = now + 1.0;
+
+                for (s = ss_start; s; s = s->next) {
+                        if (s->due <= now) {
+                                sampler_sample(s);
+
+                                /* Fell way behind, don't make up for it
+                                 * all at once. */
+                                s->due += s->period;
+                                if (s->due <= now)
+                                        s->due = now + s->period;
+                        }
+
+                        if (s->due < next)
+                                next = s->due;
+                }
+
+                if (sampler_clock != CLOCK_MONOTONIC)
+                        next += get_time() - get_mono_time();
+
+                ts.tv_sec = (time_t) next;
+                ts.tv_nsec = (long) ((next - (double) ts.tv_sec) * 1000000000);
+
+                pthread_cond_timedwait(&sampler_wake, &sampler_lock, &ts);
+        }
+
+        pthread_mutex_unlock(&sampler_lock);
+
+        return NULL;
+}
+
+/**
+ * @brief Take one sample into a series' ring.  If the request handler
+ *        hasn't kept up and it's full, the sample's dropped.  Call with the
+ *        sampler lock held.
+ *
+ * @param s Series
+ */
+static void sampler_sample(struct sampler_series *s)
+{
+        unsigned long head = s->head;
+        unsigned int num;
+
+        /* Its module's not loaded right now. */
+        if (!s->mv->loaded)
+                return;
+
+        num = module_var_call_int(s->mv, s->args);
+
+        sampler_barrier();
+        if (head - s->tail > s->mask)
+                return;
+
+        s->ring[head & s->mask] = num;
+
+        sampler_barrier();
+        s->head = head + 1;
+}
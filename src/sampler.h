@@ -0,0 +1,65 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "module.h"
+
+#define SAMPLER_RING_MIN 64     /* Samples a series holds, at least... */
+#define SAMPLER_RING_MAX 65536  /* ... and at most */
+#define SAMPLER_RATE_MAX 1000.0 /* Samples a second, tops */
+#define SAMPLER_RETRY 0.1       /* Seconds to wait for the first samples */
+
+/**
+ * A variable sampled way more often than it's reported.  The sampler thread
+ * is the only one writing the ring and the request handler the only one
+ * reading it, so neither has to lock the other out.
+ */
+struct sampler_series {
+        struct module_var *mv;
+        char *args;             /* Canonical args, NULL for none */
+        double period;          /* Seconds between samples */
+        double due;             /* Next sample, CLOCK_MONOTONIC */
+
+        unsigned int *ring;
+        unsigned long mask;     /* Ring size - 1, it's a power of two */
+        unsigned long head;     /* Next slot the sampler writes */
+        unsigned long tail;     /* Next slot the request handler reads */
+
+        struct sampler_series *prev;
+        struct sampler_series *next;
+};
+
+/**
+ * What a series saw since it was last taken.
+ */
+struct sampler_stats {
+        unsigned long count;
+        unsigned int min;
+        unsigned int max;
+        double mean;
+        unsigned int last;
+};
+
+struct sampler_series *sampler_add(struct module_var *mv,
+                                   const char *args,
+                                   double rate,
+                                   double interval);
+void sampler_del(struct sampler_series *s);
+unsigned long sampler_take(struct sampler_series *s,
+                           struct sampler_stats *st);
+void sampler_hold(void);
+void sampler_release(void);
+void sampler_stop(void);
+
+#endif /* SAMPLER_H */
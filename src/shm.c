@@ -0,0 +1,239 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../config.h"
+#include "cfg.h"
+#include "module.h"
+#include "shm.h"
+#include "util.h"
+
+/* Readers must never see the value change without the sequence changing. */
+#if defined(__GNUC__)
+#define shm_barrier() __sync_synchronize()
+#else
+#define shm_barrier()
+#endif
+
+/* Globals. */
+extern struct module_var *mv_start;
+static char *shm_base = NULL;
+static size_t shm_size = 0;
+static char shm_path[256];
+
+/* Function prototypes. */
+static struct shm_slot *shm_slot_begin(struct module_var *mv,
+                                       const char *args,
+                                       double stamp);
+static void shm_slot_end(struct shm_slot *slot);
+
+/**
+ * @brief Create the shared memory table, if shm_path is set.  There's a
+ *        slot for every variable in the module_var registry.
+ *
+ * @return 0 on success or if it's turned off, -1 on failure
+ */
+int shm_open_table(void)
+{
+        const char *path = get_char_key("daemon", "shm_path", NULL);
+        struct shm_header *head;
+        struct shm_desc *desc;
+        struct module_var *mv;
+        unsigned int nslots = 0;
+        size_t slots_at;
+        int fd;
+
+        if (path == NULL)
+                return 0;
+
+        /* Cron jobs don't have values. */
+        for (mv = mv_start; mv; mv = mv->next)
+                if (mv->type != VARIABLE_CRON)
+                        nslots++;
+
+        slots_at = sizeof(struct shm_header) +
+                   nslots * sizeof(struct shm_desc);
+        slots_at = (slots_at + 63) & ~((size_t) 63);
+        shm_size = slots_at + nslots * sizeof(struct shm_slot);
+
+        if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+                perror("shm open");
+                return -1;
+        }
+
+        if (ftruncate(fd, shm_size) == -1) {
+                perror("shm ftruncate");
+                close(fd);
+                unlink(path);
+                return -1;
+        }
+
+        shm_base = mmap(NULL, shm_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (shm_base == MAP_FAILED) {
+                perror("shm mmap");
+                shm_base = NULL;
+                unlink(path);
+                return -1;
+        }
+
+        strfcpy(shm_path, path, sizeof(shm_path));
+
+        /* Describe every slot, and remember which one is whose. */
+        desc = (struct shm_desc *) (shm_base + sizeof(struct shm_header));
+        nslots = 0;
+
+        for (mv = mv_start; mv; mv = mv->next) {
+                if (mv->type == VARIABLE_CRON) {
+                        mv->shm_slot = -1;
+                        continue;
+                }
+
+                strfcpy(desc[nslots].name, mv->name, sizeof(desc->name));
+                desc[nslots].type = mv->type;
+                desc[nslots].offset = slots_at +
+                                      nslots * sizeof(struct shm_slot);
+                mv->shm_slot = nslots++;
+        }
+
+        /* Header goes last, a reader that sees the magic sees it all. */
+        head = (struct shm_header *) shm_base;
+        head->version = SHM_VERSION;
+        head->nslots = nslots;
+        head->slot_size = sizeof(struct shm_slot);
+        head->desc_offset = sizeof(struct shm_header);
+        head->pid = getpid();
+        shm_barrier();
+        memcpy(head->magic, SHM_MAGIC, sizeof(head->magic));
+
+        return 0;
+}
+
+/**
+ * @brief Unmap and remove the shared memory table.
+ */
+void shm_close_table(void)
+{
+        struct module_var *mv;
+
+        if (shm_base == NULL)
+                return;
+
+        munmap(shm_base, shm_size);
+        unlink(shm_path);
+        shm_base = NULL;
+
+        for (mv = mv_start; mv; mv = mv->next)
+                mv->shm_slot = -1;
+}
+
+/**
+ * @brief Publish a string value.
+ *
+ * @param mv Variable
+ * @param args Arguments it was collected with
+ * @param str Value
+ * @param stamp When it was collected, seconds since epoch
+ */
+void shm_publish_str(struct module_var *mv,
+                     const char *args,
+                     const char *str,
+                     double stamp)
+{
+        struct shm_slot *slot;
+
+        if ((slot = shm_slot_begin(mv, args, stamp)) == NULL)
+                return;
+
+        strfcpy(slot->value, str, sizeof(slot->value));
+        slot->len = strlen(slot->value);
+        slot->num = 0;
+
+        shm_slot_end(slot);
+}
+
+/**
+ * @brief Publish a BAR or GRAPH value.  The number also goes into value as
+ *        text, for readers that just print things.
+ *
+ * @param mv Variable
+ * @param args Arguments it was collected with
+ * @param num Value
+ * @param stamp When it was collected, seconds since epoch
+ */
+void shm_publish_int(struct module_var *mv,
+                     const char *args,
+                     unsigned long num,
+                     double stamp)
+{
+        struct shm_slot *slot;
+
+        if ((slot = shm_slot_begin(mv, args, stamp)) == NULL)
+                return;
+
+        slot->num = num;
+        slot->len = sprintf(slot->value, "%lu", num);
+
+        shm_slot_end(slot);
+}
+
+/**
+ * @brief Open a variable's slot for writing.  Only the request handler
+ *        writes, so the only thing to keep straight is the readers.
+ *
+ * @param mv Variable
+ * @param args Arguments it was collected with
+ * @param stamp When it was collected
+ *
+ * @return Slot, or NULL if there's no table or no slot
+ */
+static struct shm_slot *shm_slot_begin(struct module_var *mv,
+                                       const char *args,
+                                       double stamp)
+{
+        struct shm_desc *desc;
+        struct shm_slot *slot;
+
+        if (shm_base == NULL || mv->shm_slot < 0)
+                return NULL;
+
+        desc = (struct shm_desc *) (shm_base + sizeof(struct shm_header));
+        slot = (struct shm_slot *) (shm_base + desc[mv->shm_slot].offset);
+
+        slot->seq++;
+        shm_barrier();
+
+        strfcpy(slot->args, (args) ? args : "", sizeof(slot->args));
+        slot->stamp = stamp;
+
+        return slot;
+}
+
+/**
+ * @brief Done writing a slot, readers can have it.
+ *
+ * @param slot Slot
+ */
+static void shm_slot_end(struct shm_slot *slot)
+{
+        shm_barrier();
+        slot->seq++;
+}
@@ -0,0 +1,69 @@
+/**
+ * The CC0 1.0 Universal is applied to this work.
+ *
+ * To the extent possible under law, Matt Hayes and Jake LeMaster have
+ * waived all copyright and related or neighboring rights to donky.
+ * This work is published from the United States.
+ *
+ * Please see the copy of the CC0 included with this program for complete
+ * information including limitations and disclaimers. If no such copy
+ * exists, see <http://creativecommons.org/publicdomain/zero/1.0/legalcode>.
+ */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include "module.h"
+
+#define SHM_MAGIC "donkyshm"
+#define SHM_VERSION 1
+
+#define SHM_NAME_MAX 64
+#define SHM_ARGS_MAX 64
+#define SHM_VALUE_MAX 256
+
+/**
+ * Layout of the shared memory file.  Everything is in host byte order, it's
+ * only for readers on the same box.  The file starts with the header, then
+ * a shm_desc per variable, then a shm_slot per variable.
+ */
+struct shm_header {
+        char magic[8];          /* SHM_MAGIC, no NUL */
+        unsigned int version;   /* SHM_VERSION */
+        unsigned int nslots;
+        unsigned int slot_size; /* sizeof(struct shm_slot) */
+        unsigned int desc_offset;
+        unsigned int pid;       /* Daemon that's writing it. */
+};
+
+struct shm_desc {
+        char name[SHM_NAME_MAX];
+        unsigned int type;      /* VARIABLE_* flags */
+        unsigned int offset;    /* Slot offset from the start of the file. */
+};
+
+/**
+ * Readers: copy seq, bail if it's odd, copy what you want, then check seq
+ * again.  If it changed, the daemon was writing, so try again.
+ */
+struct shm_slot {
+        unsigned int seq;       /* Odd while it's being written. */
+        unsigned int len;       /* Length of value. */
+        double stamp;           /* When it was collected, seconds since epoch. */
+        unsigned long num;      /* Value of BAR and GRAPH variables. */
+        char args[SHM_ARGS_MAX];
+        char value[SHM_VALUE_MAX];
+};
+
+int shm_open_table(void);
+void shm_close_table(void);
+void shm_publish_str(struct module_var *mv,
+                     const char *args,
+                     const char *str,
+                     double stamp);
+void shm_publish_int(struct module_var *mv,
+                     const char *args,
+                     unsigned long num,
+                     double stamp);
+
+#endif /* SHM_H */
@@ -160,6 +160,22 @@ double get_time(void)
         return (double) timev.tv_sec + (((double) timev.tv_usec) / 1000000);
 }
 
+/**
+ * @brief Get the time on the monotonic clock, which never jumps when
+ *        somebody sets the date.  Good for timeouts, useless for showing.
+ *
+ * @return Time in seconds
+ */
+double get_mono_time(void)
+{
+        struct timespec ts;
+
+        if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+                return get_time();
+
+        return (double) ts.tv_sec + (((double) ts.tv_nsec) / 1000000000);
+}
+
 /**
  * @brief Convert raw bytes into formatted values.
  *
@@ -47,6 +47,7 @@ char *chop(char *str);
 char *chomp(char *str);
 char *substr(char *str, int offset, size_t len);
 double get_time(void);
+double get_mono_time(void);
 char *bytes_to_bigger(long double bytes);
 int random_range(int min, int max);
 unsigned int get_str_sum(const char *str);